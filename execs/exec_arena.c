@@ -0,0 +1,235 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ */
+
+/* Allocation arena for the exec machinery.
+ *
+ * do_exec() and do_posix_spawn() build the new argv[] and envp[]
+ * vectors from dozens of small strings. While an arena is active
+ * (see exec_arena_begin()), all allocations made with exec_malloc()
+ * & co. are taken from it:
+ *  - the first block is provided by the caller (a buffer in the stack),
+ *    bigger environments continue to mmap'd overflow blocks,
+ *  - exec_free() does nothing for pointers that belong to the arena,
+ *  - everything is released at once with exec_arena_release().
+ * This keeps the number of malloc() calls low in the posix_spawn()
+ * path, where the memory used to be leaked, and keeps a vfork()ed
+ * child (which executes do_exec() in the parent's address space)
+ * away from the parent's heap.
+ *
+ * The active arena is a per-thread property (see struct sb2context).
+ * Without an active arena the functions are just malloc() & co.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <mapping.h>
+#include <sb2.h>
+
+#include "libsb2.h"
+#include "exported.h"
+#include "sb2_execs.h"
+
+#define EXEC_ARENA_ALIGN		(2 * sizeof(void *))
+#define EXEC_ARENA_MIN_OVERFLOW_SIZE	(64 * 1024)
+
+struct exec_arena_block {
+	struct exec_arena_block	*eab_next;
+	size_t			eab_size;	/* incl. this header */
+};
+
+static struct exec_arena *get_active_exec_arena(void)
+{
+	struct sb2context	*sb2ctx;
+	struct exec_arena	*ea;
+
+	sb2ctx = get_sb2context();
+	ea = sb2ctx ? sb2ctx->exec_arena : NULL;
+	release_sb2context(sb2ctx);
+	return(ea);
+}
+
+static void set_active_exec_arena(struct exec_arena *ea)
+{
+	struct sb2context	*sb2ctx;
+
+	sb2ctx = get_sb2context();
+	if (sb2ctx) sb2ctx->exec_arena = ea;
+	release_sb2context(sb2ctx);
+}
+
+void exec_arena_begin(struct exec_arena *ea, void *buf, size_t bufsize)
+{
+	size_t	misalign = (size_t)buf & (EXEC_ARENA_ALIGN - 1);
+
+	memset(ea, 0, sizeof(*ea));
+	if (misalign) {
+		misalign = EXEC_ARENA_ALIGN - misalign;
+		buf = (char *)buf + misalign;
+		bufsize = (bufsize > misalign ? bufsize - misalign : 0);
+	}
+	ea->ea_first_block = buf;
+	ea->ea_first_block_size = bufsize;
+	ea->ea_next_free = buf;
+	ea->ea_num_free = bufsize;
+	ea->ea_prev = get_active_exec_arena();
+	set_active_exec_arena(ea);
+}
+
+/* Deactivate the arena. The memory stays valid until
+ * exec_arena_release(); this must be called before the real exec,
+ * because after vfork() the parent continues with our sb2context. */
+void exec_arena_end(struct exec_arena *ea)
+{
+	set_active_exec_arena(ea->ea_prev);
+}
+
+void exec_arena_release(struct exec_arena *ea)
+{
+	struct exec_arena_block	*blk = ea->ea_overflow_blocks;
+
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"exec arena: %u allocations, %lu bytes, %u overflow blocks",
+		ea->ea_num_allocs, (unsigned long)ea->ea_num_bytes,
+		ea->ea_num_overflow_blocks);
+	while (blk) {
+		struct exec_arena_block	*next = blk->eab_next;
+
+		munmap(blk, blk->eab_size);
+		blk = next;
+	}
+	ea->ea_overflow_blocks = NULL;
+	ea->ea_num_free = 0;
+}
+
+static void *exec_arena_alloc(struct exec_arena *ea, size_t size)
+{
+	void	*p;
+
+	size = (size + EXEC_ARENA_ALIGN - 1) & ~(EXEC_ARENA_ALIGN - 1);
+	if (size > ea->ea_num_free) {
+		struct exec_arena_block	*blk;
+		size_t			blksize;
+		size_t			hdrsize;
+
+		hdrsize = (sizeof(*blk) + EXEC_ARENA_ALIGN - 1) &
+			~(EXEC_ARENA_ALIGN - 1);
+		blksize = EXEC_ARENA_MIN_OVERFLOW_SIZE <<
+			(ea->ea_num_overflow_blocks < 8 ?
+				ea->ea_num_overflow_blocks : 8);
+		if (blksize < size + hdrsize) blksize = size + hdrsize;
+		blk = mmap(NULL, blksize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (blk == MAP_FAILED) {
+			SB_LOG(SB_LOGLEVEL_ERROR,
+				"exec arena: mmap(%lu) failed",
+				(unsigned long)blksize);
+			return(NULL);
+		}
+		blk->eab_next = ea->ea_overflow_blocks;
+		blk->eab_size = blksize;
+		ea->ea_overflow_blocks = blk;
+		ea->ea_num_overflow_blocks++;
+		ea->ea_next_free = (char *)blk + hdrsize;
+		ea->ea_num_free = blksize - hdrsize;
+	}
+	p = ea->ea_next_free;
+	ea->ea_next_free += size;
+	ea->ea_num_free -= size;
+	ea->ea_num_allocs++;
+	ea->ea_num_bytes += size;
+	return(p);
+}
+
+static int exec_arena_owns(struct exec_arena *ea, const void *ptr)
+{
+	const char		*p = ptr;
+	struct exec_arena_block	*blk;
+
+	for (; ea; ea = ea->ea_prev) {
+		if ((p >= ea->ea_first_block) &&
+		    (p < ea->ea_first_block + ea->ea_first_block_size))
+			return(1);
+		for (blk = ea->ea_overflow_blocks; blk; blk = blk->eab_next) {
+			if ((p >= (char *)blk) &&
+			    (p < (char *)blk + blk->eab_size))
+				return(1);
+		}
+	}
+	return(0);
+}
+
+void *exec_malloc(size_t size)
+{
+	struct exec_arena	*ea = get_active_exec_arena();
+
+	if (!ea) return(malloc(size));
+	return(exec_arena_alloc(ea, size));
+}
+
+void *exec_calloc(size_t nmemb, size_t size)
+{
+	struct exec_arena	*ea = get_active_exec_arena();
+	void			*p;
+
+	if (!ea) return(calloc(nmemb, size));
+	if (size && (nmemb > ((size_t)-1) / size)) return(NULL);
+	p = exec_arena_alloc(ea, nmemb * size);
+	if (p) memset(p, 0, nmemb * size);
+	return(p);
+}
+
+char *exec_strdup(const char *s)
+{
+	size_t	len = strlen(s) + 1;
+	char	*p = exec_malloc(len);
+
+	if (p) memcpy(p, s, len);
+	return(p);
+}
+
+char *exec_strndup(const char *s, size_t n)
+{
+	size_t	len = strnlen(s, n);
+	char	*p = exec_malloc(len + 1);
+
+	if (p) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return(p);
+}
+
+int exec_asprintf(char **strp, const char *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0) return(len);
+
+	*strp = exec_malloc(len + 1);
+	if (!*strp) return(-1);
+	va_start(ap, fmt);
+	len = vsnprintf(*strp, len + 1, fmt, ap);
+	va_end(ap);
+	return(len);
+}
+
+void exec_free(void *ptr)
+{
+	struct exec_arena	*ea;
+
+	if (!ptr) return;
+	ea = get_active_exec_arena();
+	if (ea && exec_arena_owns(ea, ptr)) return;
+	free(ptr);
+}
@@ -78,7 +78,7 @@ int exec_map_script_interpreter(
 			*mapped_interpreter_p = mapping_result;
 
 			if (EXEC_POLICY_GET_BOOLEAN(eph, script_set_argv0_to_mapped_interpreter)) {
-				argv[0] = strdup(mapping_result);
+				argv[0] = exec_strdup(mapping_result);
 				return(0);
 			}
 			return(1);
@@ -96,9 +96,29 @@ static int test_path_match(const char *full_path, size_t full_path_len,
 	return(result);
 }
 
+/* Returns the list of rules that may match 'path': a bucket of the
+ * index (see add_exec_policy_selection_rule_index_to_ruletree()),
+ * selected by the first component of the path. */
+static ruletree_object_offset_t find_exec_policy_selection_rules_from_index(
+	ruletree_object_offset_t index_offs, const char *path)
+{
+	const char	*slash;
+	size_t		len;
+	uint32_t	num_buckets;
+
+	path++; /* skip the leading '/' */
+	slash = strchr(path, '/');
+	len = slash ? (size_t)(slash - path) : strlen(path);
+	num_buckets = ruletree_objectlist_get_list_size(index_offs);
+	return(ruletree_objectlist_get_item(index_offs,
+		ruletree_string_hash_n(path, len) & (num_buckets - 1)));
+}
+
 const char *find_exec_policy_name(const char *mapped_path, const char *virtual_path)
 {
 	static ruletree_object_offset_t		policy_selection_rules_offs = 0;
+	static ruletree_object_offset_t		policy_selection_index_offs = 0;
+	ruletree_object_offset_t	rules_offs;
 	uint32_t	list_size;
 	unsigned int	i;
 	int		mapped_path_len;
@@ -125,15 +145,22 @@ const char *find_exec_policy_name(const char *mapped_path, const char *virtual_p
 				__func__, modename);
 			return(NULL);
 		}
+		policy_selection_index_offs = ruletree_catalog_get(
+			"exec_policy_selection_index", modename);
 	}
-	list_size = ruletree_objectlist_get_list_size(policy_selection_rules_offs);
+	if (policy_selection_index_offs && (*mapped_path == '/'))
+		rules_offs = find_exec_policy_selection_rules_from_index(
+			policy_selection_index_offs, mapped_path);
+	else
+		rules_offs = policy_selection_rules_offs;
+	list_size = ruletree_objectlist_get_list_size(rules_offs);
 	mapped_path_len = strlen(mapped_path);
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: path='%s'", __func__, mapped_path);
 	for (i = 0; i < list_size; i++) {
 		ruletree_object_offset_t	rule_offs;
 
-		rule_offs = ruletree_objectlist_get_item(policy_selection_rules_offs, i);
+		rule_offs = ruletree_objectlist_get_item(rules_offs, i);
 		if (rule_offs) {
 			ruletree_exec_policy_selection_rule_t   *rule;
 
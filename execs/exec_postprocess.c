@@ -41,17 +41,17 @@ struct strv_s {
 	int		strv_new_v_max_size;
 };
 
+/* 'storage' must have room for num_orig_elems + num_additional_elems
+ * pointers, plus the terminating NULL */
 static void init_strv(struct strv_s *svp, const char *name,
-	const char **orig_v, int num_additional_elems)
+	const char **orig_v, int num_orig_elems, int num_additional_elems,
+	const char **storage)
 {
-	int	num_orig_elems = elem_count(orig_v);
-
 	svp->strv_name = name;
 	svp->strv_num_orig_elems = num_orig_elems;
 	svp->strv_orig_v = orig_v;
 	svp->strv_new_v_max_size = num_orig_elems + num_additional_elems;
-	/* add one to 'nmemb' for the terminating NULL */
-	svp->strv_new_v = calloc(svp->strv_new_v_max_size + 1, sizeof(char*));
+	svp->strv_new_v = storage;
 	svp->strv_first_free_idx = 0;
 }
 
@@ -132,7 +132,11 @@ static void setenv_native_app_ld_preload(
 
 	native_app_ld_preload = EXEC_POLICY_GET_STRING(eph, native_app_ld_preload);
 	if (native_app_ld_preload) {
-		new_path = native_app_ld_preload;
+		char *cp;
+
+		assert(exec_asprintf(&cp, "LD_PRELOAD=%s",
+			native_app_ld_preload) > 0);
+		new_path = cp;
 	} else {
 		const char *native_app_ld_preload_prefix = NULL;
 		const char *native_app_ld_preload_suffix = NULL;
@@ -147,7 +151,7 @@ static void setenv_native_app_ld_preload(
 #define str_not_empty(s) ((s) && *(s))
 			char *cp;
 			if (libpath) {
-				assert(asprintf(&cp, "LD_PRELOAD=%s%s%s%s%s",
+				assert(exec_asprintf(&cp, "LD_PRELOAD=%s%s%s%s%s",
 					(str_not_empty(native_app_ld_preload_prefix) ?
 					 native_app_ld_preload_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_preload_prefix) ? ":" : ""), /* 2 */
@@ -159,7 +163,7 @@ static void setenv_native_app_ld_preload(
 					) > 0);	
 			} else {
 				/* no libpath */
-				assert(asprintf(&cp, "LD_PRELOAD=%s%s%s",
+				assert(exec_asprintf(&cp, "LD_PRELOAD=%s%s%s",
 					(str_not_empty(native_app_ld_preload_prefix) ?
 					 native_app_ld_preload_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_preload_prefix) &&
@@ -184,7 +188,7 @@ static void setenv_native_app_ld_preload(
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: No value for LD_PRELOAD, using host's variable '%s'",
 			__func__, new_path);
-		assert(asprintf(&cp, "LD_PRELOAD=%s", new_path) > 0);
+		assert(exec_asprintf(&cp, "LD_PRELOAD=%s", new_path) > 0);
 		new_path = cp;
 	}
 	add_string_to_strv(new_envp, new_path);
@@ -236,7 +240,11 @@ static void setenv_native_app_ld_library_path(
 
 	native_app_ld_library_path = EXEC_POLICY_GET_STRING(eph, native_app_ld_library_path);
 	if (native_app_ld_library_path) {
-		new_path = native_app_ld_library_path;
+		char *cp;
+
+		assert(exec_asprintf(&cp, "LD_LIBRARY_PATH=%s",
+			native_app_ld_library_path) > 0);
+		new_path = cp;
 	} else {
 		const char *native_app_ld_library_path_prefix = NULL;
 		const char *native_app_ld_library_path_suffix = NULL;
@@ -251,7 +259,7 @@ static void setenv_native_app_ld_library_path(
 #define str_not_empty(s) ((s) && *(s))
 			char *cp;
 			if (libpath) {
-				assert(asprintf(&cp, "LD_LIBRARY_PATH=%s%s%s%s%s",
+				assert(exec_asprintf(&cp, "LD_LIBRARY_PATH=%s%s%s%s%s",
 					(str_not_empty(native_app_ld_library_path_prefix) ?
 					 native_app_ld_library_path_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_library_path_prefix) ? ":" : ""), /* 2 */
@@ -263,7 +271,7 @@ static void setenv_native_app_ld_library_path(
 					) > 0);	
 			} else {
 				/* no libpath */
-				assert(asprintf(&cp, "LD_LIBRARY_PATH=%s%s%s",
+				assert(exec_asprintf(&cp, "LD_LIBRARY_PATH=%s%s%s",
 					(str_not_empty(native_app_ld_library_path_prefix) ?
 					 native_app_ld_library_path_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_library_path_prefix) &&
@@ -288,7 +296,7 @@ static void setenv_native_app_ld_library_path(
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: No value for LD_LIBRARY_PATH, using host's path '%s'",
 			__func__, new_path);
-		assert(asprintf(&cp, "LD_LIBRARY_PATH=%s", new_path) > 0);
+		assert(exec_asprintf(&cp, "LD_LIBRARY_PATH=%s", new_path) > 0);
 		new_path = cp;
 	}
 	add_string_to_strv(new_envp, new_path);
@@ -338,19 +346,29 @@ static int exec_postprocess_prepare(
 		"%s: Applying exec_policy '%s'",
 		__func__, exec_policy_name);
 
-	/* allocate new environment.
+	/* allocate new environment and argv, both vectors
+	 * from one block.
 	 * reserve space for new entries, plus __SB2_EXEC_POLICY_NAME
+	 * (add one to both sizes for the terminating NULLs)
 	*/
-	init_strv(new_envp, "envp", orig_env, 1 + add_envp_size);
 	{
-		char	*cp;
-
-		assert(asprintf(&cp, "__SB2_EXEC_POLICY_NAME=%s", exec_policy_name) > 0);
+		int		num_env = elem_count(orig_env);
+		int		num_argv = elem_count(orig_argv);
+		int		envp_size = num_env + 1 + add_envp_size + 1;
+		const char	**vectors;
+		char		*cp;
+
+		vectors = exec_calloc(envp_size + num_argv + add_argv_size + 1,
+			sizeof(char*));
+		init_strv(new_envp, "envp", orig_env, num_env,
+			1 + add_envp_size, vectors);
+		init_strv(new_argv, "argv", orig_argv, num_argv,
+			add_argv_size, vectors + envp_size);
+
+		assert(exec_asprintf(&cp, "__SB2_EXEC_POLICY_NAME=%s", exec_policy_name) > 0);
 		add_string_to_strv(new_envp, cp);
 	}
 
-	init_strv(new_argv, "argv", orig_argv, add_argv_size);
-
 	/* --- end of "generic part" */
 	return(0);
 }
@@ -385,6 +403,7 @@ int exec_postprocess_native_executable(
 	int			first_argv_element_to_copy = 0;
 	struct strv_s		new_envp;
 	struct strv_s		new_argv;
+	ruletree_object_offset_t	env_template_offs;
 
 	/* Prepare. For the new argv, allocate room for 
 	 * for optional new entries, needed if indirect startup:
@@ -450,7 +469,7 @@ int exec_postprocess_native_executable(
 			 * the alternative, loosing LD_PRELOAD..
 			*/
 			if (info->pt_interp) {	
-				char *pt_interp_copy = strdup(info->pt_interp);
+				char *pt_interp_copy = exec_strdup(info->pt_interp);
 				SB_LOG(SB_LOGLEVEL_DEBUG,
 					"%s: No native_app_ld_so, SUID/SGID binary, "
 					"start with PT_INTERP='%s', argv[0]=´%s´",
@@ -478,7 +497,7 @@ int exec_postprocess_native_executable(
 			__func__, native_app_ld_so);
 
 		add_string_to_strv(&new_argv, native_app_ld_so);
-		new_mapped_file = strdup(native_app_ld_so); /* FIXME */
+		new_mapped_file = exec_strdup(native_app_ld_so); /* FIXME */
 
 		/* Ignore RPATH and RUNPATH information:
 		 * This will prevent accidental use of host's libraries,
@@ -562,8 +581,38 @@ int exec_postprocess_native_executable(
 	 *		updated_args = 1
 	 *	end
 	*/
-	setenv_native_app_ld_library_path(eph, &new_envp); 
-	setenv_native_app_ld_preload(eph, &new_envp);
+	env_template_offs = EXEC_POLICY_GET_RULES(eph, native_app_env_template);
+	if (env_template_offs) {
+		/* sb2d has precomputed the variables (see
+		 * add_env_template_to_exec_policy() in
+		 * add_rules_to_rule_tree.lua). LD_LIBRARY_PATH and
+		 * LD_PRELOAD are there unless they depend on
+		 * the user's values. */
+		uint32_t	n = ruletree_objectlist_get_list_size(env_template_offs);
+		uint32_t	i;
+		int		has_ld_library_path = 0;
+		int		has_ld_preload = 0;
+
+		for (i = 0; i < n; i++) {
+			const char *cp = offset_to_ruletree_string_ptr(
+				ruletree_objectlist_get_item(env_template_offs, i),
+				NULL);
+
+			if (!cp) continue;
+			add_string_to_strv(&new_envp, cp);
+			if (!strncmp(cp, "LD_LIBRARY_PATH=", 16))
+				has_ld_library_path = 1;
+			else if (!strncmp(cp, "LD_PRELOAD=", 11))
+				has_ld_preload = 1;
+		}
+		if (!has_ld_library_path)
+			setenv_native_app_ld_library_path(eph, &new_envp); 
+		if (!has_ld_preload)
+			setenv_native_app_ld_preload(eph, &new_envp);
+	} else {
+		setenv_native_app_ld_library_path(eph, &new_envp); 
+		setenv_native_app_ld_preload(eph, &new_envp);
+	}
 
 	/* When exec_policy contains field 'native_app_locale_path' we
 	 * need to set environment variables $LOCPATH (and $NLSPATH) to
@@ -587,16 +636,18 @@ int exec_postprocess_native_executable(
 	{
 		const char *native_app_locale_path;
 
-		native_app_locale_path = EXEC_POLICY_GET_STRING(eph, native_app_locale_path);
+		/* already in the template, if there is one */
+		native_app_locale_path = env_template_offs ? NULL :
+			EXEC_POLICY_GET_STRING(eph, native_app_locale_path);
 		if (native_app_locale_path) {
 			char	*cp;
 
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: setting LOCPATH and NLSPATH to '%s'",
 				__func__, native_app_locale_path);
-			assert(asprintf(&cp, "LOCPATH=%s", native_app_locale_path) > 0);
+			assert(exec_asprintf(&cp, "LOCPATH=%s", native_app_locale_path) > 0);
 			add_string_to_strv(&new_envp, cp);
-			assert(asprintf(&cp, "NLSPATH=%s", native_app_locale_path) > 0);
+			assert(exec_asprintf(&cp, "NLSPATH=%s", native_app_locale_path) > 0);
 			add_string_to_strv(&new_envp, cp);
 		}
 	}
@@ -615,14 +666,15 @@ int exec_postprocess_native_executable(
 	{
 		const char *native_app_gconv_path;
 
-		native_app_gconv_path = EXEC_POLICY_GET_STRING(eph, native_app_gconv_path);
+		native_app_gconv_path = env_template_offs ? NULL :
+			EXEC_POLICY_GET_STRING(eph, native_app_gconv_path);
 		if (native_app_gconv_path) {
 			char	*cp;
 
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: setting GCONV_PATH to '%s'",
 				__func__, native_app_gconv_path);
-			assert(asprintf(&cp, "GCONV_PATH=%s", native_app_gconv_path) > 0);
+			assert(exec_asprintf(&cp, "GCONV_PATH=%s", native_app_gconv_path) > 0);
 			add_string_to_strv(&new_envp, cp);
 		}
 	}
@@ -710,17 +762,6 @@ static int test_cputransp_boolean(const char **namev)
 	return(0);
 }
 
-static const char *get_cputransp_string(const char **namev)
-{
-	ruletree_object_offset_t	ofs = 0;
-
-	ofs = ruletree_catalog_vget(namev);
-	if (ofs) {
-		return(offset_to_ruletree_string_ptr(ofs, NULL));
-	}
-	return(NULL);
-}
-
 static int matches_gconv_path_nlspath_or_locpath(const char *cp)
 {
 	const char *gconv_path_prefix = "GCONV_PATH=";
@@ -739,6 +780,155 @@ static int matches_gconv_path_nlspath_or_locpath(const char *cp)
 	return(0);
 }
 
+/* Qemu parameters of the CPU transparency configurations
+ * ("cputransparency" catalog). These are written by sb2d when the
+ * session is initialized ("init2") and don't change after that,
+ * so the catalog lookups are done only once per process.
+ * Only offsets are stored (the rule tree may be remapped).
+ * In a vfork()ed child, filling a slot updates the parent's copy,
+ * which is fine: the values are the same.
+*/
+#define QEMU_CONF_CACHE_SIZE	4	/* "target", "native" */
+
+struct qemu_conf_cache {
+	int				qcc_valid;
+	char				qcc_name[32];
+
+	ruletree_object_offset_t	qcc_argv_list_offs;
+	uint32_t			qcc_argv_list_size;
+	ruletree_object_offset_t	qcc_env_list_offs;
+	uint32_t			qcc_env_list_size;
+	ruletree_object_offset_t	qcc_cmd_offs;
+
+	int				qcc_has_argv0_flag;
+	int				qcc_has_libattr_hack_flag;
+	int				qcc_has_env_control_flags;
+
+	/* "LD_LIBRARY_PATH=..." and "LD_PRELOAD=..." for qemu, or
+	 * 0 if the host's values should be used: */
+	ruletree_object_offset_t	qcc_ld_library_path_offs;
+	ruletree_object_offset_t	qcc_ld_preload_offs;
+	/* host's values (without the names): */
+	ruletree_object_offset_t	qcc_host_ld_library_path_offs;
+	ruletree_object_offset_t	qcc_host_ld_preload_offs;
+};
+
+static struct qemu_conf_cache qemu_conf_cache[QEMU_CONF_CACHE_SIZE];
+
+static ruletree_object_offset_t get_cputransp_nonempty_string_offs(
+	const char **namev)
+{
+	ruletree_object_offset_t	ofs = 0;
+	const char			*cp;
+
+	ofs = ruletree_catalog_vget(namev);
+	if (ofs) {
+		cp = offset_to_ruletree_string_ptr(ofs, NULL);
+		if (cp && *cp) return(ofs);
+	}
+	return(0);
+}
+
+/* Returns a pointer to the cached configuration, or to 'conf' if
+ * the cache is full or the name does not fit in qcc_name.
+ * NULL if the configuration does not exist. */
+static const struct qemu_conf_cache *get_qemu_conf(
+	const char *conf_cputransparency_name,
+	struct qemu_conf_cache *conf)
+{
+	struct qemu_conf_cache	*qcc;
+	const char		*namev_in_ruletree[4];
+	int			name_fits;
+	int			i;
+
+	for (i = 0; i < QEMU_CONF_CACHE_SIZE; i++) {
+		int	valid;
+
+		qcc = &qemu_conf_cache[i];
+		valid = __atomic_load_n(&qcc->qcc_valid, __ATOMIC_ACQUIRE);
+		if (valid == 0) break;	/* end of used slots */
+		if ((valid == 1) &&
+		    !strcmp(qcc->qcc_name, conf_cputransparency_name))
+			return(qcc);
+	}
+
+	memset(conf, 0, sizeof(*conf));
+	name_fits = (strlen(conf_cputransparency_name) <
+		sizeof(conf->qcc_name));
+	if (name_fits) strcpy(conf->qcc_name, conf_cputransparency_name);
+
+	namev_in_ruletree[0] = "cputransparency";
+	namev_in_ruletree[1] = conf_cputransparency_name;
+	namev_in_ruletree[2] = NULL; /* this will be varied below */
+	namev_in_ruletree[3] = NULL;
+
+	namev_in_ruletree[2] = "qemu_argv";
+	conf->qcc_argv_list_offs = ruletree_catalog_vget(namev_in_ruletree);
+	if (conf->qcc_argv_list_offs)
+		conf->qcc_argv_list_size = ruletree_objectlist_get_list_size(
+			conf->qcc_argv_list_offs);
+	namev_in_ruletree[2] = "qemu_env";
+	conf->qcc_env_list_offs = ruletree_catalog_vget(namev_in_ruletree);
+	if (conf->qcc_env_list_offs)
+		conf->qcc_env_list_size = ruletree_objectlist_get_list_size(
+			conf->qcc_env_list_offs);
+	namev_in_ruletree[2] = "cmd";
+	conf->qcc_cmd_offs = ruletree_catalog_vget(namev_in_ruletree);
+
+	namev_in_ruletree[2] = "has_argv0_flag";
+	conf->qcc_has_argv0_flag = test_cputransp_boolean(namev_in_ruletree);
+	namev_in_ruletree[2] = "qemu_has_libattr_hack_flag";
+	conf->qcc_has_libattr_hack_flag = test_cputransp_boolean(namev_in_ruletree);
+	namev_in_ruletree[2] = "qemu_has_env_control_flags";
+	conf->qcc_has_env_control_flags = test_cputransp_boolean(namev_in_ruletree);
+
+	namev_in_ruletree[2] = "qemu_ld_library_path";
+	conf->qcc_ld_library_path_offs =
+		get_cputransp_nonempty_string_offs(namev_in_ruletree);
+	namev_in_ruletree[2] = "qemu_ld_preload";
+	conf->qcc_ld_preload_offs =
+		get_cputransp_nonempty_string_offs(namev_in_ruletree);
+	conf->qcc_host_ld_library_path_offs =
+		ruletree_catalog_get("config", "host_ld_library_path");
+	conf->qcc_host_ld_preload_offs =
+		ruletree_catalog_get("config", "host_ld_preload");
+
+	if (!conf->qcc_argv_list_size && !conf->qcc_cmd_offs) {
+		/* Not configured (yet?). Don't cache that. */
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"%s: No command for cpu_transparency (%s)", __func__,
+			conf_cputransparency_name);
+		return(NULL);
+	}
+
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"%s: loaded '%s' (argv %u, env %u)", __func__,
+		conf_cputransparency_name, conf->qcc_argv_list_size,
+		conf->qcc_env_list_size);
+
+	/* Add to the cache, if there is room. Another thread may have
+	 * added the same config already; a duplicate is harmless. */
+	if (!name_fits) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"%s: name too long for the cache, not cached", __func__);
+		return(conf);
+	}
+	for (i = 0; i < QEMU_CONF_CACHE_SIZE; i++) {
+		int	expected = 0;
+
+		qcc = &qemu_conf_cache[i];
+		/* claim the slot (-1), then publish it (1) */
+		if (__atomic_compare_exchange_n(&qcc->qcc_valid, &expected, -1,
+		    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			conf->qcc_valid = -1;
+			memcpy(qcc, conf, sizeof(*conf));
+			__atomic_store_n(&qcc->qcc_valid, 1, __ATOMIC_RELEASE);
+			return(qcc);
+		}
+	}
+	return(conf);
+}
+
 /* CPU transparency with Qemu:
  *
  * Another very straightforward conversion from Lua.
@@ -766,11 +956,8 @@ static int exec_postprocess_qemu(
 	char			*new_mapped_file = *mapped_file;
 	struct strv_s		new_envp;
 	struct strv_s		new_argv;
-	const char		*namev_in_ruletree[4];
-	ruletree_object_offset_t	qemu_argv_list_offs = 0;
-	uint32_t			qemu_argv_list_size = 0;
-	ruletree_object_offset_t	qemu_env_list_offs = 0;
-	uint32_t			qemu_env_list_size = 0;
+	const struct qemu_conf_cache	*qc;
+	struct qemu_conf_cache		qc_buf;
 	const char	*ld_trace_prefix = "LD_TRACE_";
 	const int	ld_trace_prefix_len = strlen(ld_trace_prefix);
 	const char	*sb2_ld_preload_prefix = "__SB2_LD_PRELOAD=";
@@ -780,25 +967,13 @@ static int exec_postprocess_qemu(
 	SB_LOG(SB_LOGLEVEL_DEBUG,
 		"%s: postprocess '%s' '%s'", __func__, *mapped_file, *mapped_file);
 
-	namev_in_ruletree[0] = "cputransparency";
-	namev_in_ruletree[1] = conf_cputransparency_name;
-	namev_in_ruletree[2] = NULL; /* this will be varied below */
-	namev_in_ruletree[3] = NULL;
-	
-	/* get number of additional argv elements for Qemu: */
-	namev_in_ruletree[2] = "qemu_argv";
-	qemu_argv_list_offs = ruletree_catalog_vget(namev_in_ruletree);
-	if (qemu_argv_list_offs)
-		qemu_argv_list_size = ruletree_objectlist_get_list_size(
-			qemu_argv_list_offs);
-	/* and additional envp elements for Qemu: */
-	namev_in_ruletree[2] = "qemu_env";
-	qemu_env_list_offs = ruletree_catalog_vget(namev_in_ruletree);
-	if (qemu_env_list_offs)
-		qemu_env_list_size = ruletree_objectlist_get_list_size(
-			qemu_env_list_offs);
-	/* count number of LD_TRACE_ variables in environment */
-	{
+	/* numbers of additional argv and envp elements for Qemu etc. */
+	qc = get_qemu_conf(conf_cputransparency_name, &qc_buf);
+	if (!qc) return(-1); /* do not execute */
+
+	/* count number of LD_TRACE_ variables in environment
+	 * (those are moved to qemu's command line, if qemu can do it) */
+	if (qc->qcc_has_env_control_flags) {
 		int i;
 		for (i = 0; orig_env[i]; i++) {
 			const char *orig_env_var = orig_env[i];
@@ -827,8 +1002,8 @@ static int exec_postprocess_qemu(
 	*/
 	if (exec_postprocess_prepare(exec_policy_name, &eph, mapped_file,
 		filename, binary_name, orig_argv,
-		&new_argv, qemu_argv_list_size + 5 + 2*num_ld_trace_env_vars,
-		orig_env, &new_envp, qemu_env_list_size + 2))
+		&new_argv, qc->qcc_argv_list_size + 5 + 2*num_ld_trace_env_vars,
+		orig_env, &new_envp, qc->qcc_env_list_size + 2))
 			return(-1);
 
 	/* Old Lua code, for reference:
@@ -857,11 +1032,11 @@ static int exec_postprocess_qemu(
 	 *			new_filename = conf_cputransparency.qemu_argv[1]
 	 *		end
 	*/
-	if (qemu_argv_list_size == 0) {
-		const char	*cputransparency_cmd = NULL;
+	if (qc->qcc_argv_list_size == 0) {
+		const char	*cputransparency_cmd;
 
-		namev_in_ruletree[2] = "cmd";
-		cputransparency_cmd = get_cputransp_string(namev_in_ruletree);
+		cputransparency_cmd = offset_to_ruletree_string_ptr(
+			qc->qcc_cmd_offs, NULL);
 		if (!cputransparency_cmd) {
 			SB_LOG(SB_LOGLEVEL_ERROR,
 				"%s: No command for cpu_transparency (%s)", __func__,
@@ -869,18 +1044,18 @@ static int exec_postprocess_qemu(
 			return(-1); /* do not execute */
 		}
 		add_string_to_strv(&new_argv, cputransparency_cmd);
-		new_mapped_file = strdup(cputransparency_cmd);
+		new_mapped_file = exec_strdup(cputransparency_cmd);
 	} else {
 		uint32_t i;
-		for (i = 0; i < qemu_argv_list_size; i++) {
+		for (i = 0; i < qc->qcc_argv_list_size; i++) {
 			const char *cp = NULL;
 
 			cp = add_string_from_ruletreelist_to_strv(
-				qemu_argv_list_offs, i, &new_argv,
+				qc->qcc_argv_list_offs, i, &new_argv,
 				conf_cputransparency_name);
 			if (!cp) return(-1); /* do not execute */
 			if (i == 0) {
-				new_mapped_file = strdup(cp);
+				new_mapped_file = exec_strdup(cp);
 			}
 		}
 	}
@@ -891,13 +1066,13 @@ static int exec_postprocess_qemu(
 	 *			end
 	 *		end
 	*/
-	if (qemu_env_list_offs) {
+	if (qc->qcc_env_list_offs) {
 		uint32_t i;
-		for (i = 0; i < qemu_env_list_size; i++) {
+		for (i = 0; i < qc->qcc_env_list_size; i++) {
 			const char *cp = NULL;
 
 			cp = add_string_from_ruletreelist_to_strv(
-				qemu_env_list_offs, i, &new_envp,
+				qc->qcc_env_list_offs, i, &new_envp,
 				conf_cputransparency_name);
 			if (!cp) return(-1); /* do not execute */
 		}
@@ -916,8 +1091,7 @@ static int exec_postprocess_qemu(
 	 *			table.insert(new_argv, argv[1])
 	 *		end
 	*/
-	namev_in_ruletree[2] = "has_argv0_flag";
-	if (test_cputransp_boolean(namev_in_ruletree)) {
+	if (qc->qcc_has_argv0_flag) {
 		add_string_to_strv(&new_argv, "-0");
 		add_string_to_strv(&new_argv, orig_argv[0]);
 	}
@@ -932,8 +1106,7 @@ static int exec_postprocess_qemu(
 	 *			table.insert(new_argv, "-libattr-hack")
 	 *		end
 	*/
-	namev_in_ruletree[2] = "qemu_has_libattr_hack_flag";
-	if (test_cputransp_boolean(namev_in_ruletree)) {
+	if (qc->qcc_has_libattr_hack_flag) {
 		add_string_to_strv(&new_argv, "-libattr-hack");
 	}
 
@@ -958,8 +1131,7 @@ static int exec_postprocess_qemu(
 	 *			new_envp = envp
 	 *		end
 	*/
-	namev_in_ruletree[2] = "qemu_has_env_control_flags";
-	if (test_cputransp_boolean(namev_in_ruletree)) {
+	if (qc->qcc_has_env_control_flags) {
 		int i;
 		for (i = 0; i < new_envp.strv_num_orig_elems; i++) {
 			const char *orig_env_var = orig_env[i];
@@ -1057,40 +1229,43 @@ static int exec_postprocess_qemu(
 		char	*cp = NULL;
 
 		/* LD_LIBRARY_PATH */
-		namev_in_ruletree[2] = "qemu_ld_library_path";
-		qemu_ldlibpath = get_cputransp_string(namev_in_ruletree);
-		if (!qemu_ldlibpath || (*qemu_ldlibpath == '\0')) {
+		if (!qc->qcc_ld_library_path_offs) {
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: No qemu_ld_library_path, using host's ld_library_path (%s)",
 				__func__, conf_cputransparency_name);
-			qemu_ldlibpath = ruletree_catalog_get_string("config", "host_ld_library_path");
-			assert(asprintf(&cp, "LD_LIBRARY_PATH=%s", qemu_ldlibpath) > 0);	
+			qemu_ldlibpath = offset_to_ruletree_string_ptr(
+				qc->qcc_host_ld_library_path_offs, NULL);
+			assert(exec_asprintf(&cp, "LD_LIBRARY_PATH=%s", qemu_ldlibpath) > 0);	
+			qemu_ldlibpath = cp;
 		} else {
-			/* qemu_ldlibpath has LD_LIBRARY_PATH= prefix */
+			/* qemu_ldlibpath has LD_LIBRARY_PATH= prefix,
+			 * and it can be used as-is from the rule tree */
+			qemu_ldlibpath = offset_to_ruletree_string_ptr(
+				qc->qcc_ld_library_path_offs, NULL);
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: set ld_library_path (%s) = %s",
 				__func__, conf_cputransparency_name, qemu_ldlibpath);
-			cp = strdup(qemu_ldlibpath);
 		} 
-		add_string_to_strv(&new_envp, cp);
+		add_string_to_strv(&new_envp, qemu_ldlibpath);
 
 		/* LD_PRELOAD */
-		namev_in_ruletree[2] = "qemu_ld_preload";
-		qemu_ldpreload = get_cputransp_string(namev_in_ruletree);
-		if (!qemu_ldpreload || (*qemu_ldpreload == '\0')) {
+		if (!qc->qcc_ld_preload_offs) {
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: No qemu_ld_preload, using host's ld_preload (%s)",
 				__func__, conf_cputransparency_name);
-			qemu_ldpreload = ruletree_catalog_get_string("config", "host_ld_preload");
-			assert(asprintf(&cp, "LD_PRELOAD=%s", qemu_ldpreload) > 0);	
+			qemu_ldpreload = offset_to_ruletree_string_ptr(
+				qc->qcc_host_ld_preload_offs, NULL);
+			assert(exec_asprintf(&cp, "LD_PRELOAD=%s", qemu_ldpreload) > 0);	
+			qemu_ldpreload = cp;
 		} else {
 			/* qemu_ldpreload has LD_PRELOAD= prefix */
+			qemu_ldpreload = offset_to_ruletree_string_ptr(
+				qc->qcc_ld_preload_offs, NULL);
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: set ld_preload (%s) = %s",
 				__func__, conf_cputransparency_name, qemu_ldpreload);
-			cp = strdup(qemu_ldpreload);
 		} 
-		add_string_to_strv(&new_envp, cp);
+		add_string_to_strv(&new_envp, qemu_ldpreload);
 	}
 
 	/*		-- unmapped file is exec'd
@@ -1204,11 +1379,11 @@ int exec_postprocess_host_static_executable(
 			return(-1);
 
 	hp = ruletree_catalog_get_string("config", "host_ld_library_path");
-	assert(asprintf(&cp, "LD_LIBRARY_PATH=%s", hp) > 0);
+	assert(exec_asprintf(&cp, "LD_LIBRARY_PATH=%s", hp) > 0);
 	add_string_to_strv(&new_envp, cp);
 	
 	hp = ruletree_catalog_get_string("config", "host_ld_preload");
-	assert(asprintf(&cp, "LD_PRELOAD=%s", hp) > 0);
+	assert(exec_asprintf(&cp, "LD_PRELOAD=%s", hp) > 0);
 	add_string_to_strv(&new_envp, cp);
 
 	/* Append arguments */
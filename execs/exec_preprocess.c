@@ -68,7 +68,7 @@ static int add_elements_to_argv(
 		str_offs = ruletree_objectlist_get_item(add_tbl_offs, j);
 		str = offset_to_ruletree_string_ptr(str_offs, NULL);
 		
-		argv[add_idx] = strdup(str);
+		argv[add_idx] = exec_strdup(str);
 		SB_LOG(SB_LOGLEVEL_NOISE,
 			"%s: add from %s to argv[%d] = '%s'",
 				__func__, table_name, add_idx, str);
@@ -132,11 +132,14 @@ static int check_path_prefix_match(
 	return(0);
 }
 
+/* If the hashed index exists ("argvmods_index"), only the rules
+ * that are in the same bucket as the basename need to be checked. */
 static ruletree_exec_preprocessing_rule_t *find_exec_preprocessing_rule(
 	ruletree_object_offset_t argvmods_rules_offs,
+	ruletree_object_offset_t argvmods_index_offs,
 	const char *filename)
 {
-	uint32_t list_size = ruletree_objectlist_get_list_size(argvmods_rules_offs);
+	uint32_t list_size;
 	const char *file_basename;
 	int i;
 	ruletree_exec_preprocessing_rule_t *execpp_rule;
@@ -150,6 +153,22 @@ static ruletree_exec_preprocessing_rule_t *find_exec_preprocessing_rule(
 		file_basename = filename;
 	}
 	file_basename_len = strlen(file_basename);
+
+	if (argvmods_index_offs) {
+		uint32_t num_buckets = ruletree_objectlist_get_list_size(
+			argvmods_index_offs);
+
+		argvmods_rules_offs = ruletree_objectlist_get_item(
+			argvmods_index_offs, ruletree_string_hash(file_basename) &
+				(num_buckets - 1));
+		if (!argvmods_rules_offs) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"%s: No exec preprocessing rules for '%s' (index).",
+				__func__, file_basename);
+			return(NULL);
+		}
+	}
+	list_size = ruletree_objectlist_get_list_size(argvmods_rules_offs);
 	SB_LOG(SB_LOGLEVEL_DEBUG,
 		"%s: check %d rules, file='%s'",
 		__func__, list_size, file_basename);
@@ -194,6 +213,7 @@ static ruletree_exec_preprocessing_rule_t *find_exec_preprocessing_rule(
 int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 {
 	static ruletree_object_offset_t	argvmods_rules_offs = 0;
+	static ruletree_object_offset_t	argvmods_index_offs = 0;
 	ruletree_exec_preprocessing_rule_t *execpp_rule;
 	int orig_argc;
 	int max_new_argv_elements = 0;
@@ -217,10 +237,13 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 
 			argvmods_rules_offs = ruletree_catalog_get("argvmods",
 				(use_gcc_rules ? "gcc" : "misc"));
+			argvmods_index_offs = ruletree_catalog_get("argvmods_index",
+				(use_gcc_rules ? "gcc" : "misc"));
 
 			SB_LOG(SB_LOGLEVEL_DEBUG,
-				"%s: argvmods rules @%u, use_gcc_rules=%d",
-				__func__, argvmods_rules_offs, use_gcc_rules);
+				"%s: argvmods rules @%u, index @%u, use_gcc_rules=%d",
+				__func__, argvmods_rules_offs, argvmods_index_offs,
+				use_gcc_rules);
                 }
 	}
 	if (!argvmods_rules_offs) {
@@ -228,7 +251,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		return(0);
 	}
 	execpp_rule = find_exec_preprocessing_rule(
-		argvmods_rules_offs, *file);
+		argvmods_rules_offs, argvmods_index_offs, *file);
 
 	if (!execpp_rule) return(0);
 
@@ -259,7 +282,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: allocating new argv, size = %d",
 			__func__, orig_argc + max_new_argv_elements);
-		new_argv = (char **)calloc(orig_argc + max_new_argv_elements + 1, sizeof(char *));
+		new_argv = (char **)exec_calloc(orig_argc + max_new_argv_elements + 1, sizeof(char *));
 	} else {
 		new_argv = *argv;
 	}
@@ -311,7 +334,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 						"%s: remove argv[%d], '%s'",
 						__func__, k, str);
 				} else {
-					new_argv[i] = strdup((*argv)[k]);
+					new_argv[i] = exec_strdup((*argv)[k]);
 					SB_LOG(SB_LOGLEVEL_DEBUG,
 						"%s: argv[%d]='%s'",
 						__func__, i, new_argv[i]);
@@ -323,7 +346,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		int k;
 		/* nothing to remove, copy old argv */
 		for (k = 1; k < orig_argc; i++, k++) {
-			new_argv[i] = strdup((*argv)[k]);
+			new_argv[i] = exec_strdup((*argv)[k]);
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: move argv[%d] -> argv[%d], '%s'",
 				__func__, k, i, new_argv[i]);
@@ -355,13 +378,13 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 			execpp_rule->rtree_xpr_new_filename_offs, NULL);
 		if (new_file_name) {
 #if 0 /* FIXME */
-			if (*file) free(*file);
+			if (*file) exec_free(*file);
 #endif
-			*file = strdup(new_file_name);
+			*file = exec_strdup(new_file_name);
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: new filename '%s'.",
 				__func__, new_file_name);
-			(*argv)[0] = strdup(*file);
+			(*argv)[0] = exec_strdup(*file);
 		}
 	}
 
@@ -374,13 +397,13 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: num.env.vars = %d, allocate +2",
 			__func__, orig_envc);
-		new_envp = (char **)calloc(orig_envc + 2 + 1, sizeof(char *));
+		new_envp = (char **)exec_calloc(orig_envc + 2 + 1, sizeof(char *));
 		/* copy old env. */
 		for (k = 0; k < orig_envc; k++) {
-			new_envp[k] = strdup((*envp)[k]);
+			new_envp[k] = exec_strdup((*envp)[k]);
 		}
-		new_envp[orig_envc] = strdup("SBOX_DISABLE_MAPPING=1");
-		new_envp[orig_envc+1] = strdup("SBOX_DISABLE_ARGVENVP=1");
+		new_envp[orig_envc] = exec_strdup("SBOX_DISABLE_MAPPING=1");
+		new_envp[orig_envc+1] = exec_strdup("SBOX_DISABLE_ARGVENVP=1");
 		new_envp[orig_envc+2] = NULL;
 		*envp = new_envp;
 	}
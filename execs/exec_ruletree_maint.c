@@ -86,6 +86,76 @@ ruletree_object_offset_t add_exec_preprocessing_rule_to_ruletree(
 	return(rule_location);
 }
 
+/* Create a hashed index for a list of "argvmods" rules:
+ * The index is a list of 2^N buckets, the bucket is selected by
+ * ruletree_string_hash(binary_name). Every bucket is a list of the
+ * rules that belong to it (in the same order as in the original list),
+ * or 0 if there are none. */
+ruletree_object_offset_t add_exec_preprocessing_rule_index_to_ruletree(
+	ruletree_object_offset_t rule_list_offs)
+{
+	uint32_t	list_size;
+	uint32_t	num_buckets;
+	uint32_t	*bucket_of_rule;
+	uint32_t	*bucket_size;
+	uint32_t	i, b;
+	ruletree_object_offset_t index_offs;
+
+	list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+
+	num_buckets = 16;
+	while (num_buckets < 2 * list_size) num_buckets <<= 1;
+
+	bucket_of_rule = calloc(list_size + 1, sizeof(uint32_t));
+	bucket_size = calloc(num_buckets, sizeof(uint32_t));
+	if (!bucket_of_rule || !bucket_size) {
+		free(bucket_of_rule);
+		free(bucket_size);
+		return(0);
+	}
+
+	for (i = 0; i < list_size; i++) {
+		ruletree_exec_preprocessing_rule_t *execpp_rule;
+		const char *rule_bin_name = NULL;
+
+		execpp_rule = offset_to_exec_preprocessing_rule_ptr(
+			ruletree_objectlist_get_item(rule_list_offs, i));
+		if (execpp_rule && execpp_rule->rtree_xpr_binary_name_offs)
+			rule_bin_name = offset_to_ruletree_string_ptr(
+				execpp_rule->rtree_xpr_binary_name_offs, NULL);
+		if (!rule_bin_name) {
+			/* can never match, leave it out */
+			bucket_of_rule[i] = num_buckets;
+			continue;
+		}
+		b = ruletree_string_hash(rule_bin_name) & (num_buckets - 1);
+		bucket_of_rule[i] = b;
+		bucket_size[b]++;
+	}
+
+	index_offs = ruletree_objectlist_create_list(num_buckets);
+	for (b = 0; index_offs && (b < num_buckets); b++) {
+		ruletree_object_offset_t bucket_offs;
+		uint32_t n = 0;
+
+		if (!bucket_size[b]) continue;
+		bucket_offs = ruletree_objectlist_create_list(bucket_size[b]);
+		for (i = 0; i < list_size; i++) {
+			if (bucket_of_rule[i] != b) continue;
+			ruletree_objectlist_set_item(bucket_offs, n++,
+				ruletree_objectlist_get_item(rule_list_offs, i));
+		}
+		ruletree_objectlist_set_item(index_offs, b, bucket_offs);
+	}
+	free(bucket_of_rule);
+	free(bucket_size);
+
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"Added exec preprocessing rule index: %u rules, %u buckets @ %u",
+			list_size, num_buckets, index_offs);
+	return(index_offs);
+}
+
 ruletree_object_offset_t add_exec_policy_selection_rule_to_ruletree(
 	uint32_t	ruletype,
 	const char	*selector,
@@ -116,3 +186,125 @@ ruletree_object_offset_t add_exec_policy_selection_rule_to_ruletree(
 	return(rule_location);
 }
 
+/* Returns the length of the first component of an exec policy
+ * selection rule's selector (e.g. "usr" from "/usr/bin/foo"), or
+ * -1 if the rule can match paths that start with any component. */
+static int exec_policy_selector_first_component(
+	uint32_t selector_type, const char *selector)
+{
+	const char *slash;
+
+	if (!selector || (*selector != '/')) return(-1);
+	slash = strchr(selector + 1, '/');
+	switch (selector_type) {
+	case SB2_RULETREE_FSRULE_SELECTOR_PATH:
+	case SB2_RULETREE_FSRULE_SELECTOR_DIR:
+		/* the first component must match completely */
+		if (!selector[1]) return(-1); /* "/" */
+		return(slash ? slash - (selector + 1) : (int)strlen(selector + 1));
+	case SB2_RULETREE_FSRULE_SELECTOR_PREFIX:
+		/* "/usr" matches "/usr2", too */
+		if (!slash) return(-1);
+		return(slash - (selector + 1));
+	}
+	return(-1);
+}
+
+/* Create an index for a list of exec policy selection rules:
+ * The index is a list of 2^N buckets, the bucket is selected by
+ * ruletree_string_hash_n() of the first component of the path.
+ * Every bucket is a list of the rules that may match paths which
+ * start with that component, in the same order as in the original
+ * list (rules that may match any path are included in every
+ * bucket), so the first match is still the same. */
+ruletree_object_offset_t add_exec_policy_selection_rule_index_to_ruletree(
+	ruletree_object_offset_t rule_list_offs)
+{
+	uint32_t	list_size;
+	uint32_t	num_keyed = 0;
+	uint32_t	num_wild = 0;
+	uint32_t	num_buckets;
+	uint32_t	*bucket_of_rule;
+	uint32_t	*bucket_size;
+	uint32_t	i, b;
+	ruletree_object_offset_t index_offs;
+	ruletree_object_offset_t wild_offs = 0;
+
+	list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	bucket_of_rule = calloc(list_size + 1, sizeof(uint32_t));
+	if (!bucket_of_rule) return(0);
+
+	for (i = 0; i < list_size; i++) {
+		ruletree_exec_policy_selection_rule_t *rule;
+		const char *selector = NULL;
+		int len = -1;
+
+		rule = offset_to_ruletree_object_ptr(
+			ruletree_objectlist_get_item(rule_list_offs, i),
+			SB2_RULETREE_OBJECT_TYPE_EXEC_SEL_RULE);
+		if (rule) {
+			selector = offset_to_ruletree_string_ptr(
+				rule->rtree_xps_selector_offs, NULL);
+			len = exec_policy_selector_first_component(
+				rule->rtree_xps_type, selector);
+		}
+		if (len < 0) {
+			bucket_of_rule[i] = UINT32_MAX;
+			num_wild++;
+		} else {
+			bucket_of_rule[i] = ruletree_string_hash_n(
+				selector + 1, len);
+			num_keyed++;
+		}
+	}
+
+	num_buckets = 16;
+	while (num_buckets < 2 * num_keyed) num_buckets <<= 1;
+	bucket_size = calloc(num_buckets, sizeof(uint32_t));
+	if (!bucket_size) {
+		free(bucket_of_rule);
+		return(0);
+	}
+	for (i = 0; i < list_size; i++) {
+		if (bucket_of_rule[i] == UINT32_MAX) continue;
+		bucket_of_rule[i] &= (num_buckets - 1);
+		bucket_size[bucket_of_rule[i]]++;
+	}
+
+	index_offs = ruletree_objectlist_create_list(num_buckets);
+	for (b = 0; index_offs && (b < num_buckets); b++) {
+		ruletree_object_offset_t bucket_offs;
+		uint32_t n = 0;
+
+		if (!bucket_size[b]) {
+			/* only the rules that match any path; shared */
+			if (!wild_offs && num_wild) {
+				wild_offs = ruletree_objectlist_create_list(num_wild);
+				for (i = 0; i < list_size; i++) {
+					if (bucket_of_rule[i] != UINT32_MAX) continue;
+					ruletree_objectlist_set_item(wild_offs, n++,
+						ruletree_objectlist_get_item(
+							rule_list_offs, i));
+				}
+			}
+			ruletree_objectlist_set_item(index_offs, b, wild_offs);
+			continue;
+		}
+		bucket_offs = ruletree_objectlist_create_list(
+			bucket_size[b] + num_wild);
+		for (i = 0; i < list_size; i++) {
+			if ((bucket_of_rule[i] != b) &&
+			    (bucket_of_rule[i] != UINT32_MAX)) continue;
+			ruletree_objectlist_set_item(bucket_offs, n++,
+				ruletree_objectlist_get_item(rule_list_offs, i));
+		}
+		ruletree_objectlist_set_item(index_offs, b, bucket_offs);
+	}
+	free(bucket_of_rule);
+	free(bucket_size);
+
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"Added exec policy selection rule index: %u rules (%u for any path), %u buckets @ %u",
+			list_size, num_wild, num_buckets, index_offs);
+	return(index_offs);
+}
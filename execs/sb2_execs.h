@@ -47,6 +47,7 @@ struct exec_policy_fields {
 
 	char native_app_locale_path;
 	char native_app_gconv_path;
+	char native_app_env_template; /* generated by sb2d */
 
 	char exec_flags;
 
@@ -70,8 +71,40 @@ struct binary_info {
 
 	char *pt_interp;
 	int has_capabilities; /* flag */
+
+	char *hashbang; /* scripts: the "#!" line, without "#!" and '\n' */
+};
+
+/* Allocation arena for do_exec() and do_posix_spawn(), see exec_arena.c */
+#define EXEC_ARENA_STACK_SIZE	(16 * 1024)
+
+struct exec_arena_block;
+
+struct exec_arena {
+	char			*ea_first_block; /* caller's buffer */
+	size_t			ea_first_block_size;
+	char			*ea_next_free;
+	size_t			ea_num_free;
+	struct exec_arena_block	*ea_overflow_blocks;
+	struct exec_arena	*ea_prev; /* previously active arena */
+
+	/* statistics, for debug log */
+	unsigned int		ea_num_allocs;
+	unsigned int		ea_num_overflow_blocks;
+	size_t			ea_num_bytes;
 };
 
+extern void exec_arena_begin(struct exec_arena *ea, void *buf, size_t bufsize);
+extern void exec_arena_end(struct exec_arena *ea);
+extern void exec_arena_release(struct exec_arena *ea);
+
+extern void *exec_malloc(size_t size);
+extern void *exec_calloc(size_t nmemb, size_t size);
+extern char *exec_strdup(const char *s);
+extern char *exec_strndup(const char *s, size_t n);
+extern int exec_asprintf(char **strp, const char *fmt, ...);
+extern void exec_free(void *ptr);
+
 #define exec_policy_handle_is_valid(eph) ((eph).exec_policy_offset != 0)
 
 /* Use CPU transparency even if binaries are compatible with host */
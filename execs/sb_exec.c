@@ -108,6 +108,8 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stddef.h>
+#include <byteswap.h>
 
 #include <sys/utsname.h>
 #include <sys/user.h>
@@ -190,18 +192,6 @@ static int prepare_exec(const char *exec_fn_name,
 static void change_environment_variable(
 	char **my_envp, const char *var_prefix, const char *new_value);
 
-static uint16_t byte_swap(uint16_t a)
-{
-	uint16_t b;
-	uint8_t *r;
-	uint8_t *t;
-	t = (uint8_t *)&a;
-	r = (uint8_t *)&b;
-	*r++ = *(t + 1);
-	*r = *t;
-	return b;
-}
-
 #if 0
 static int is_subdir(const char *root, const char *subdir)
 {
@@ -253,7 +243,7 @@ char **split_to_tokens(char *str)
 	char **tokens, *start, *end;
 
 	c = token_count(str);
-	tokens = calloc(c + 1, sizeof(char *));
+	tokens = exec_calloc(c + 1, sizeof(char *));
 	i = 0;
 	for (start = str; *start; start++) {
 		if (isspace(*start))
@@ -262,7 +252,7 @@ char **split_to_tokens(char *str)
 		while (*end && !isspace(*end))
 			end++;
 		len = end - start;
-		tokens[i] = malloc(sizeof(char) * (len + 1));
+		tokens[i] = exec_malloc(sizeof(char) * (len + 1));
 		strncpy(tokens[i], start, len);
 		tokens[i][len] = '\0';
 		start = end - 1;
@@ -272,104 +262,206 @@ char **split_to_tokens(char *str)
 	return tokens;
 }
 
-static int elf_hdr_match(const char *region, uint16_t match, int ei_data)
+/* ELF parsing. The file has been mmap'd (read-only); every access
+ * is checked against the size of the mapping, so truncated or
+ * otherwise malformed files can't make us read outside of it.
+ * Both ELF classes and byte orders are handled, because the same
+ * code inspects host and target binaries.
+*/
+struct elf_view {
+	const char	*ev_region;
+	size_t		ev_size;
+	int		ev_swap;	/* byte order differs from host's */
+	int		ev_64;		/* ELFCLASS64 */
+};
+
+/* offset of a field in the ELF structures of the file's class */
+#define ELF_FIELD(ev, type, field) ((ev)->ev_64 ? \
+	offsetof(Elf64_##type, field) : offsetof(Elf32_##type, field))
+#define ELF_SIZE(ev, type) ((ev)->ev_64 ? \
+	sizeof(Elf64_##type) : sizeof(Elf32_##type))
+
+static int elf_view_has(const struct elf_view *ev, uint64_t offs, uint64_t len)
 {
-	/*
-	 * It is OK to use Elf32_Ehdr here because fields accessed
-	 * in this function are same in both 64-bit and 32-bit ELF formats.
-	 */
-	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)region;
-	int swap;
+	return ((offs <= ev->ev_size) && (len <= ev->ev_size - offs));
+}
 
-	if (ehdr->e_ident[EI_DATA] != ei_data)
-		return 0;
+static uint16_t elf_get16(const struct elf_view *ev, uint64_t offs)
+{
+	uint16_t	v;
 
-#ifdef WORDS_BIGENDIAN
-	swap = (ei_data == ELFDATA2LSB);
-#else
-	swap = (ei_data == ELFDATA2MSB);
-#endif
+	memcpy(&v, ev->ev_region + offs, sizeof(v));
+	return(ev->ev_swap ? bswap_16(v) : v);
+}
 
-	if (swap && ehdr->e_machine == byte_swap(match))
-		return 1;
+static uint32_t elf_get32(const struct elf_view *ev, uint64_t offs)
+{
+	uint32_t	v;
 
-	if (!swap && ehdr->e_machine == match)
-		return 1;
+	memcpy(&v, ev->ev_region + offs, sizeof(v));
+	return(ev->ev_swap ? bswap_32(v) : v);
+}
 
-	return 0;
+/* addresses, offsets, sizes and dynamic entries
+ * (32 or 64 bits, depending on the class) */
+static uint64_t elf_get_word(const struct elf_view *ev, uint64_t offs)
+{
+	uint64_t	v;
+
+	if (!ev->ev_64) return(elf_get32(ev, offs));
+	memcpy(&v, ev->ev_region + offs, sizeof(v));
+	return(ev->ev_swap ? bswap_64(v) : v);
+}
+
+/* Returns a pointer to a string at 'offs', or NULL if it is not
+ * terminated inside the mapping and the first 'max_len' bytes. */
+static const char *elf_get_string(const struct elf_view *ev,
+	uint64_t offs, uint64_t max_len)
+{
+	uint64_t	avail;
+
+	if (offs >= ev->ev_size) return(NULL);
+	avail = ev->ev_size - offs;
+	if (max_len < avail) avail = max_len;
+	if (!memchr(ev->ev_region + offs, '\0', avail)) return(NULL);
+	return(ev->ev_region + offs);
 }
 
+/* Inspect the mmap'd file. All information is collected
+ * in one pass over the ELF headers (PT_INTERP, machine and
+ * byte order) to 'info'; the
+ * return value tells if this is a host binary. The caller
+ * checks if it is a target binary. */
 static enum binary_type inspect_elf_binary(const char *region,
-	struct binary_info *info)
+	size_t region_size, struct binary_info *info)
 {
+	struct elf_view	ev;
+	uint64_t	phoff;
+	unsigned int	phentsize, phnum, i;
+	const char	*pt_interp = NULL;
+	int		is_host = 0;
+
 	assert(region != NULL);
 
 	/* check for hashbang */
-	if (region[EI_MAG0] == '#' && region[EI_MAG1] == '!')
+	if ((region_size >= 2) && region[0] == '#' && region[1] == '!')
 		return (BIN_HASHBANG);
 
+	if ((region_size < EI_NIDENT) || memcmp(region, ELFMAG, SELFMAG))
+		return (BIN_UNKNOWN);
+
+	ev.ev_region = region;
+	ev.ev_size = region_size;
+	switch (region[EI_CLASS]) {
+	case ELFCLASS32: ev.ev_64 = 0; break;
+	case ELFCLASS64: ev.ev_64 = 1; break;
+	default: return (BIN_UNKNOWN);
+	}
+	switch (region[EI_DATA]) {
+	case ELFDATA2LSB:
+	case ELFDATA2MSB:
+		ev.ev_swap = (region[EI_DATA] != HOST_ELF_DATA);
+		break;
+	default: return (BIN_UNKNOWN);
+	}
+	if (!elf_view_has(&ev, 0, ELF_SIZE(&ev, Ehdr)))
+		return (BIN_UNKNOWN);
+
+	info->data = region[EI_DATA];
+	info->machine = elf_get16(&ev, ELF_FIELD(&ev, Ehdr, e_machine));
+
 	/*
 	 * We go through ELF program headers one by one and check
 	 * whether there is interpreter (PT_INTERP) section.
 	 * In that case this is dynamically linked, otherwise
 	 * it is statically linked.
 	 */
-#ifdef HOST_ELF_MACHINE_32
-	if (elf_hdr_match(region, HOST_ELF_MACHINE_32, HOST_ELF_DATA)) {
-		Elf32_Ehdr *eh = (Elf32_Ehdr *)region;
-		Elf32_Phdr *ph;
-		size_t ph_entsize = eh->e_phentsize;
-		int i;
-
-		if (info) {
-			info->machine = eh->e_machine;
-			info->data = eh->e_ident[EI_DATA];
-		}
+	phoff = elf_get_word(&ev, ELF_FIELD(&ev, Ehdr, e_phoff));
+	phentsize = elf_get16(&ev, ELF_FIELD(&ev, Ehdr, e_phentsize));
+	phnum = elf_get16(&ev, ELF_FIELD(&ev, Ehdr, e_phnum));
+	if (phentsize < ELF_SIZE(&ev, Phdr)) phnum = 0;
 
-		for (i = 0; i < eh->e_phnum; i++) {
-			ph = (Elf32_Phdr *)
-			    (region + eh->e_phoff + (i * ph_entsize));
-			if (ph->p_type == PT_INTERP) {
-				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 32-bit ELF, PT_INTERP='%s'",
-					__func__, region + ph->p_offset);
-				info->pt_interp = strdup(region + ph->p_offset);
-				return (BIN_HOST_DYNAMIC);
-			}
+	for (i = 0; i < phnum; i++) {
+		uint64_t	ph = phoff + (uint64_t)i * phentsize;
+		uint64_t	p_offset, p_filesz;
+
+		if (!elf_view_has(&ev, ph, ELF_SIZE(&ev, Phdr))) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"%s: program headers truncated", __func__);
+			break;
+		}
+		p_offset = elf_get_word(&ev, ph + ELF_FIELD(&ev, Phdr, p_offset));
+		p_filesz = elf_get_word(&ev, ph + ELF_FIELD(&ev, Phdr, p_filesz));
+		if (elf_get32(&ev, ph + ELF_FIELD(&ev, Phdr, p_type)) ==
+		    PT_INTERP) {
+			pt_interp = elf_get_string(&ev, p_offset, p_filesz);
+			if (!pt_interp)
+				SB_LOG(SB_LOGLEVEL_DEBUG,
+					"%s: invalid PT_INTERP", __func__);
+			break;
 		}
-		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 32-bit ELF, static", __func__);
-		return (BIN_HOST_STATIC);
 	}
+
+	if (pt_interp) info->pt_interp = exec_strdup(pt_interp);
+
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"%s: %d-bit ELF, machine=%u, PT_INTERP='%s'",
+		__func__, (ev.ev_64 ? 64 : 32), (unsigned)info->machine,
+		(pt_interp ? pt_interp : ""));
+
+	if (info->data == HOST_ELF_DATA) {
+#ifdef HOST_ELF_MACHINE_32
+		if (info->machine == HOST_ELF_MACHINE_32) is_host = 1;
 #endif
 #ifdef HOST_ELF_MACHINE_64
-	if (elf_hdr_match(region, HOST_ELF_MACHINE_64, HOST_ELF_DATA)) {
-		Elf64_Ehdr *eh = (Elf64_Ehdr *)region;
-		Elf64_Phdr *ph;
-		size_t ph_entsize = eh->e_phentsize;
-		int i;
-
-		if (info) {
-			info->machine = eh->e_machine;
-			info->data = eh->e_ident[EI_DATA];
-		}
-
-		for (i = 0; i < eh->e_phnum; i++) {
-			ph = (Elf64_Phdr *)
-			    (region + eh->e_phoff + (i * ph_entsize));
-			if (ph->p_type == PT_INTERP) {
-				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 64-bit ELF, PT_INTERP='%s'",
-					__func__, region + ph->p_offset);
-				info->pt_interp = strdup(region + ph->p_offset);
-				return (BIN_HOST_DYNAMIC);
-			}
-		}
-		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 64-bit ELF, static", __func__);
-		return (BIN_HOST_STATIC);
-	}
+		if (info->machine == HOST_ELF_MACHINE_64) is_host = 1;
 #endif
+	}
+	if (is_host)
+		return (pt_interp ? BIN_HOST_DYNAMIC : BIN_HOST_STATIC);
+
 	/* could not identify as host binary */
 	return (BIN_UNKNOWN);
 }
 
+/* Results of inspect_binary() are cached to the rule tree, keyed by
+ * the identity of the file and validated by size and timestamps
+ * from the fstat() that is needed anyway (ctime changes also when
+ * the capabilities are changed). Access permissions and mode/uid/gid
+ * are not cached.
+*/
+static void binary_info_cache_set_key(ruletree_binary_info_cache_entry_t *ce,
+	const struct stat64 *status)
+{
+	memset(ce, 0, sizeof(*ce));
+	ce->rbic_dev = status->st_dev;
+	ce->rbic_ino = status->st_ino;
+	ce->rbic_size = status->st_size;
+	ce->rbic_mtime_sec = status->st_mtim.tv_sec;
+	ce->rbic_mtime_nsec = status->st_mtim.tv_nsec;
+	ce->rbic_ctime_sec = status->st_ctim.tv_sec;
+	ce->rbic_ctime_nsec = status->st_ctim.tv_nsec;
+}
+
+/* For scripts, rbic_pt_interp contains the "#!" line instead. */
+static void binary_info_cache_store(ruletree_binary_info_cache_entry_t *ce,
+	enum binary_type type, const struct binary_info *info)
+{
+	const char *str = (type == BIN_HASHBANG ?
+		info->hashbang : info->pt_interp);
+
+	if (str) {
+		if (strlen(str) >= sizeof(ce->rbic_pt_interp))
+			return; /* too long, don't cache */
+		strcpy(ce->rbic_pt_interp, str);
+	}
+	ce->rbic_type = type;
+	ce->rbic_machine = info->machine;
+	ce->rbic_data = info->data;
+	ce->rbic_has_capabilities = info->has_capabilities;
+	ruletree_binary_info_cache_store(ce);
+}
+
 static enum binary_type inspect_binary(const char *filename,
 	int check_x_permission,
 	struct binary_info *info)
@@ -379,11 +471,21 @@ static enum binary_type inspect_binary(const char *filename,
 	int fd, j;
 	struct stat64 status;
 	char *region;
+	ruletree_binary_info_cache_entry_t cache_entry;
 	unsigned int ei_data;
 	uint16_t e_machine;
+	struct binary_info local_info;
+	unsigned int elf_data;
+	uint16_t elf_machine;
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s(%s)", __func__, filename);
 
+	if (!info) {
+		/* caller is not interested in the details */
+		memset(&local_info, 0, sizeof(local_info));
+		info = &local_info;
+	}
+
 	retval = BIN_NONE; /* assume it doesn't exist, until proven otherwise */
 	if (check_x_permission && access_nomap_nolog(filename, X_OK) < 0) {
 		int saved_errno = errno;
@@ -463,11 +565,9 @@ static enum binary_type inspect_binary(const char *filename,
 		goto _out_close;
 	}
 
-	if (info) {
-		info->mode = status.st_mode;
-		info->uid = status.st_uid;
-		info->gid = status.st_gid;
-	}
+	info->mode = status.st_mode;
+	info->uid = status.st_uid;
+	info->gid = status.st_gid;
 
 	if (!S_ISREG(status.st_mode) && !S_ISLNK(status.st_mode)) {
 		SB_LOG(SB_LOGLEVEL_DEBUG,
@@ -483,16 +583,51 @@ static enum binary_type inspect_binary(const char *filename,
 		goto _out_close;
 	}
 
+	binary_info_cache_set_key(&cache_entry, &status);
+	if (ruletree_binary_info_cache_lookup(&cache_entry)) {
+		retval = cache_entry.rbic_type;
+		info->machine = cache_entry.rbic_machine;
+		info->data = cache_entry.rbic_data;
+		info->has_capabilities = cache_entry.rbic_has_capabilities;
+		if (retval == BIN_HASHBANG)
+			info->hashbang = exec_strdup(cache_entry.rbic_pt_interp);
+		else if (cache_entry.rbic_pt_interp[0])
+			info->pt_interp = exec_strdup(cache_entry.rbic_pt_interp);
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"%s: cached type %d => out", __func__, (int)retval);
+		goto _out_close;
+	}
+
+	/* Pages are read in only when they are touched, so this
+	 * reads the ELF headers (or the "#!" line) and the few
+	 * pages that the program headers refer to. */
 	region = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!region) {
+	if (region == MAP_FAILED) {
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: mmap failed => out", __func__);
 		goto _out_close;
 	}
 
-	retval = inspect_elf_binary(region, info);
+	retval = inspect_elf_binary(region, status.st_size, info);
+	/* as found from the file, the target check below may
+	 * overwrite info->machine and info->data */
+	elf_machine = info->machine;
+	elf_data = info->data;
 	switch (retval) {
 	case BIN_HASHBANG:
+		/* keep the "#!" line for prepare_hashbang(); the file
+		 * doesn't need to be read again. */
+		{
+			size_t	max_len = status.st_size;
+			size_t	len;
+
+			if (max_len > SBOX_MAXPATH - 1)
+				max_len = SBOX_MAXPATH - 1;
+			for (len = 2; len < max_len; len++)
+				if ((region[len] == '\n') ||
+				    (region[len] == '\0')) break;
+			info->hashbang = exec_strndup(region + 2, len - 2);
+		}
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: script => out", __func__);
 		goto _out_munmap;
@@ -583,17 +718,23 @@ static enum binary_type inspect_binary(const char *filename,
 		break;
 	}
 
-	if (elf_hdr_match(region, e_machine, ei_data)) {
+	if ((e_machine != EM_NONE) && (elf_machine == e_machine) &&
+	    (elf_data == ei_data)) {
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: BIN_TARGET", __func__);
 		retval = BIN_TARGET;
 	}
 
 _out_munmap:
+	binary_info_cache_store(&cache_entry, retval, info);
 	munmap(region, status.st_size);
 _out_close:
 	close_nomap_nolog(fd);
 _out:
+	if (info == &local_info) {
+		if (local_info.pt_interp) exec_free(local_info.pt_interp);
+		if (local_info.hashbang) exec_free(local_info.hashbang);
+	}
 	return retval;
 }
 
@@ -602,7 +743,8 @@ static int prepare_hashbang(
 	char *orig_file,
 	char ***argvp,
 	char ***envpp,
-	const char *exec_policy_name)
+	const char *exec_policy_name,
+	const char *hashbang_line) /* from inspect_binary(), or NULL */
 {
 	int argc, fd, c, i, j, n;
 	char ch;
@@ -614,21 +756,27 @@ static int prepare_hashbang(
 	char *tmp = NULL, *mapped_binaryname = NULL;
 	int result = 0;
 
-	if ((fd = open_nomap(*mapped_file, O_RDONLY)) < 0) {
-		/* unexpected error, just run it */
-		return 0;
-	}
+	if (hashbang_line && (strlen(hashbang_line) < SBOX_MAXPATH - 3)) {
+		c = snprintf(hashbang, sizeof(hashbang), "#!%s\n",
+			hashbang_line);
+	} else {
+		if ((fd = open_nomap(*mapped_file, O_RDONLY)) < 0) {
+			/* unexpected error, just run it */
+			return 0;
+		}
 
-	if ((c = read(fd, &hashbang[0], SBOX_MAXPATH - 1)) < 2) {
-		/* again unexpected error, close fd and run it */
+		if ((c = read(fd, &hashbang[0], SBOX_MAXPATH - 1)) < 2) {
+			/* again unexpected error, close fd and run it */
+			close_nomap_nolog(fd);
+			return 0;
+		}
 		close_nomap_nolog(fd);
-		return 0;
 	}
 
 	argc = elem_count(*argvp);
 
 	/* extra element for hashbang argument */
-	new_argv = calloc(argc + 3, sizeof(char *));
+	new_argv = exec_calloc(argc + 3, sizeof(char *));
 
 	/* skip any initial whitespace following "#!" */
 	for (i = 2; (hashbang[i] == ' ' 
@@ -646,13 +794,13 @@ static int prepare_hashbang(
 				if (n == 0) {
 					char *ptr = &hashbang[j];
 					strcpy(interpreter, ptr);
-					new_argv[n++] = strdup(interpreter);
+					new_argv[n++] = exec_strdup(interpreter);
 				} else {
 					/* this was the one and only
 					 * allowed argument for the
 					 * interpreter
 					 */
-					interp_arg = strdup(&hashbang[j]);
+					interp_arg = exec_strdup(&hashbang[j]);
 					new_argv[n++] = interp_arg;
 					break;
 				}
@@ -662,7 +810,7 @@ static int prepare_hashbang(
 		if (ch == '\n' || ch == 0) break;
 	}
 
-	new_argv[n++] = strdup(orig_file); /* the unmapped script path */
+	new_argv[n++] = exec_strdup(orig_file); /* the unmapped script path */
 	for (i = 1; (*argvp)[i] != NULL && i < argc; ) {
 		new_argv[n++] = (*argvp)[i++];
 	}
@@ -700,7 +848,7 @@ static int prepare_hashbang(
 	case 2:
                 SB_LOG(SB_LOGLEVEL_DEBUG,
                         "%s: <2> Use ordinary path mapping", __func__);
-		if (mapped_interpreter) free(mapped_interpreter);
+		if (mapped_interpreter) exec_free(mapped_interpreter);
                 mapped_interpreter = NULL;
                 {
                         mapping_results_t       mapping_result;
@@ -710,10 +858,10 @@ static int prepare_hashbang(
                                 interpreter, &mapping_result);
                         if (mapping_result.mres_result_buf) {
                                 mapped_interpreter =
-                                        strdup(mapping_result.mres_result_buf);
+                                        exec_strdup(mapping_result.mres_result_buf);
                         }
                         if (mapping_result.mres_exec_policy_name)
-				c_new_exec_policy_name = strdup(mapping_result.mres_exec_policy_name);
+				c_new_exec_policy_name = exec_strdup(mapping_result.mres_exec_policy_name);
 			else
 				c_new_exec_policy_name = NULL;
                         free_mapping_results(&mapping_result);
@@ -725,7 +873,7 @@ static int prepare_hashbang(
 		break;
 	case -1:
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: <-1> exec denied", __func__);
-		if (mapped_interpreter) free(mapped_interpreter);
+		if (mapped_interpreter) exec_free(mapped_interpreter);
 		mapped_interpreter = NULL;
 		return(-1);
 	default:
@@ -746,12 +894,12 @@ static int prepare_hashbang(
 	 * the interpreter name so we set it here.  Note that it is now
 	 * basename of the mapped interpreter (not the original one)!
 	 */
-	tmp = strdup(mapped_interpreter);
-	mapped_binaryname = strdup(basename(tmp));
+	tmp = exec_strdup(mapped_interpreter);
+	mapped_binaryname = exec_strdup(basename(tmp));
 	change_environment_variable(*envpp, "__SB2_BINARYNAME=",
 	    mapped_binaryname);
-	free(mapped_binaryname);
-	free(tmp);
+	exec_free(mapped_binaryname);
+	exec_free(tmp);
 	
 	SB_LOG(SB_LOGLEVEL_DEBUG, "prepare_hashbang(): interpreter=%s,"
 			"mapped_interpreter=%s", interpreter,
@@ -782,9 +930,9 @@ static char **duplicate_argv(char *const *argv)
 	char	**my_argv;
 
 	SB_LOG(SB_LOGLEVEL_NOISE2, "duplicate_argv: argc=%d", argc);
-	my_argv = (char **)calloc(argc + 1, sizeof(char *));
+	my_argv = (char **)exec_calloc(argc + 1, sizeof(char *));
 	for (i = 0, p = (char **)argv; *p; p++) {
-		my_argv[i++] = strdup(*p);
+		my_argv[i++] = exec_strdup(*p);
 		SB_LOG(SB_LOGLEVEL_NOISE2, "duplicate_argv: [%d] = '%s'", i-1, my_argv[i-1]);
 	}
 	my_argv[i] = NULL;
@@ -811,6 +959,29 @@ static int check_envp_has_ld_preload_and_ld_library_path(
 	return (has_ld_preload && has_ld_library_path);
 }
 
+/* Max. number of variables that prepare_envp_for_do_exec() adds
+ * to the environment: SBOX_SESSION_DIR, SBOX_MAPPING_METHOD,
+ * SBOX_SESSION_MODE, SBOX_VPERM_IDS, SBOX_SESSION_EXEC_TRACE_DIR,
+ * SBOX_SIGTRAP, __SB2_BINARYNAME, __SB2_ORIG_BINARYNAME,
+ * __SB2_EXEC_BINARYNAME, __SB2_REAL_BINARYNAME, __SB2_LD_PRELOAD,
+ * __SB2_LD_LIBRARY_PATH, __SB2_CHROOT_PATH and __SB2_RULETREE_FD.
+ * Update this when adding variables there. */
+#define PREPARE_ENVP_MAX_ADDED_VARS	14
+
+/* add "var" to "envp", which has room for "envp_size" pointers
+ * (including the terminating NULL) */
+static void add_to_envp(char **envp, int *ip, int envp_size, char *var)
+{
+	if (!var) return;
+	assert(*ip < envp_size - 1);
+	if (*ip >= envp_size - 1) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"%s: no room for %s", __func__, var);
+		return;
+	}
+	envp[(*ip)++] = var;
+}
+
 /* Prepare environment vector for do_exec() and other
  * pieces of exec*() processing: This will add/check SB2's
  * private variables and rename some user-specified
@@ -831,11 +1002,13 @@ static int check_envp_has_ld_preload_and_ld_library_path(
  *    prepare_exec() will deny the exec.)
 */
 static char **prepare_envp_for_do_exec(const char *orig_file,
-	const char *binaryname, char *const *envp)
+	const char *binaryname, char *const *envp, int pass_ruletree_fd)
 {
 	char	**p;
 	int	envc = 0;
 	char	**my_envp;
+	int	my_envp_size;
+	char	*var;
 	char	*user_ld_preload = NULL;
 	char	*user_ld_library_path = NULL;
 	int	i;
@@ -878,7 +1051,7 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 		switch (**p) {
 		case 'L':
 			if (strncmp("LD_PRELOAD=", *p, strlen("LD_PRELOAD=")) == 0) {
-				if (asprintf(&user_ld_preload,
+				if (exec_asprintf(&user_ld_preload,
 					"__SB2_%s", *p) < 0) {
 					SB_LOG(SB_LOGLEVEL_ERROR,
 						"asprintf failed to create __SB2_%s", *p);
@@ -886,7 +1059,7 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 				continue;
 			}
 			if (strncmp("LD_LIBRARY_PATH=", *p, strlen("LD_LIBRARY_PATH=")) == 0) {
-				if (asprintf(&user_ld_library_path,
+				if (exec_asprintf(&user_ld_library_path,
 					"__SB2_%s", *p) < 0) {
 					SB_LOG(SB_LOGLEVEL_ERROR,
 						"asprintf failed to create __SB2_%s", *p);
@@ -943,9 +1116,10 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 				"restored to %s", sbox_mapping_method);
 	}
 
-	/* allocate new environment. Add 15 extra elements (all may not be
-	 * needed always) */
-	my_envp = (char **)calloc(envc + 15, sizeof(char *));
+	/* allocate new environment, with room for our variables
+	 * (all may not be needed always) and the NULL */
+	my_envp_size = envc + PREPARE_ENVP_MAX_ADDED_VARS + 1;
+	my_envp = (char **)exec_calloc(my_envp_size, sizeof(char *));
 
 	for (i = 0, p=(char **)envp; *p; p++) {
 		if (strncmp(*p, "__SB2_", strlen("__SB2_")) == 0) {
@@ -992,7 +1166,7 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 					continue;
 				}
 
-				if (asprintf(&rulefile, "%s/rules/%s.lua",
+				if (exec_asprintf(&rulefile, "%s/rules/%s.lua",
 					sbox_session_dir, requested_mode) < 0) {
 
 					SB_LOG(SB_LOGLEVEL_ERROR,
@@ -1006,7 +1180,7 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 						requested_mode);
 					has_sbox_session_mode = 1;
 				}
-				free(rulefile);
+				exec_free(rulefile);
 				if (has_sbox_session_mode == 0) continue;
 			} else if (strncmp(*p, "SBOX_SESSION_",
 					sbox_session_varname_prefix_len) == 0) {
@@ -1030,47 +1204,58 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 			}
 			break;
 		}
-		my_envp[i++] = strdup(*p);
+		my_envp[i++] = exec_strdup(*p);
 	}
 
 	/* add our session directory */
-	if (asprintf(&(my_envp[i]), "SBOX_SESSION_DIR=%s", sbox_session_dir) < 0) {
+	if (exec_asprintf(&var, "SBOX_SESSION_DIR=%s", sbox_session_dir) < 0) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"asprintf failed to create SBOX_SESSION_DIR");
 	} else {
-		i++;
+		add_to_envp(my_envp, &i, my_envp_size, var);
 	}
 
 	/* add our mapping method, if needed */
 	if (sbox_mapping_method) {
-		if (asprintf(&(my_envp[i]), "SBOX_MAPPING_METHOD=%s", sbox_mapping_method) < 0) {
+		if (exec_asprintf(&var, "SBOX_MAPPING_METHOD=%s", sbox_mapping_method) < 0) {
 			SB_LOG(SB_LOGLEVEL_ERROR,
 				"asprintf failed to create SBOX_MAPPING_METHOD");
 		} else {
-			i++;
+			add_to_envp(my_envp, &i, my_envp_size, var);
 		}
 	}
 
 	/* add mode, if not using the default mode */
 	if (sbox_session_mode && (has_sbox_session_mode==0)) {
-		if (asprintf(&(my_envp[i]), "SBOX_SESSION_MODE=%s",
+		if (exec_asprintf(&var, "SBOX_SESSION_MODE=%s",
 		     sbox_session_mode) < 0) {
 			SB_LOG(SB_LOGLEVEL_ERROR,
 				"asprintf failed to create SBOX_SESSION_MODE");
 		} else {
-			i++;
+			add_to_envp(my_envp, &i, my_envp_size, var);
 		}
 	}
 
 	/* add virtual uid & gid info.
 	 * at this point we don't know it is has SUID/SGID bits, we'll fix that
 	 * later if it has those */
-	my_envp[i] = vperm_export_ids_as_string_for_exec("SBOX_VPERM_IDS=", 0,0,0, user_vperm_request);
-	if (!my_envp[i]) {
+	var = vperm_export_ids_as_string_for_exec("SBOX_VPERM_IDS=", 0,0,0, user_vperm_request);
+	if (!var) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"vperm_export_ids_as_string to create SBOX_VPERM_IDS");
 	} else {
-		i++;
+		add_to_envp(my_envp, &i, my_envp_size, var);
+	}
+
+	/* exec timeline tracing; this is a read-only variable, too */
+	if (sbox_exec_trace_dir) {
+		if (exec_asprintf(&var, "SBOX_SESSION_EXEC_TRACE_DIR=%s",
+		     sbox_exec_trace_dir) < 0) {
+			SB_LOG(SB_LOGLEVEL_ERROR,
+				"asprintf failed to create SBOX_SESSION_EXEC_TRACE_DIR");
+		} else {
+			add_to_envp(my_envp, &i, my_envp_size, var);
+		}
 	}
 
 	/* add back SBOX_SIGTRAP if it was removed accidentally, so
@@ -1079,12 +1264,12 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 		SB_LOG(SB_LOGLEVEL_NOTICE,
 		       "Detected attempt to clear SBOX_SIGTRAP, "
 		       "restored to %s", getenv("SBOX_SIGTRAP"));
-		if (asprintf(&(my_envp[i]), "SBOX_SIGTRAP=%s",
+		if (exec_asprintf(&var, "SBOX_SIGTRAP=%s",
 			     getenv("SBOX_SIGTRAP")) < 0) {
 			SB_LOG(SB_LOGLEVEL_ERROR,
 			       "asprintf failed to create SBOX_SIGTRAP");
 		} else {
-			i++;
+			add_to_envp(my_envp, &i, my_envp_size, var);
 		}
 	}
 
@@ -1092,48 +1277,56 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 	 * to the new process so that it's available even before
 	 * its main function is called
 	 */
-	if (asprintf(&new_binaryname_var, "__SB2_BINARYNAME=%s", binaryname) < 0) {
+	if (exec_asprintf(&new_binaryname_var, "__SB2_BINARYNAME=%s", binaryname) < 0) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"asprintf failed to create __SB2_BINARYNAME");
 	}
-	my_envp[i++] = new_binaryname_var; /* add the new process' name */
+	add_to_envp(my_envp, &i, my_envp_size, new_binaryname_var); /* add the new process' name */
 
-	if (asprintf(&new_orig_file_var, "__SB2_ORIG_BINARYNAME=%s", orig_file) < 0) {
+	if (exec_asprintf(&new_orig_file_var, "__SB2_ORIG_BINARYNAME=%s", orig_file) < 0) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"asprintf failed to create __SB2_ORIG_BINARYNAME");
 	}
-	my_envp[i++] = new_orig_file_var; /* add the new process' name */
+	add_to_envp(my_envp, &i, my_envp_size, new_orig_file_var); /* add the new process' name */
 
 	/* __SB2_EXEC_BINARYNAME is the original filename; for scripts,
 	 * it is the name of script, otherwise it is same as
 	 *  __SB2_ORIG_BINARYNAME
 	*/
-	if (asprintf(&new_exec_file_var, "__SB2_EXEC_BINARYNAME=%s", orig_file) < 0) {
+	if (exec_asprintf(&new_exec_file_var, "__SB2_EXEC_BINARYNAME=%s", orig_file) < 0) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"asprintf failed to create __SB2_EXEC_BINARYNAME");
 	}
-	my_envp[i++] = new_exec_file_var; /* add the new process' name */
+	add_to_envp(my_envp, &i, my_envp_size, new_exec_file_var); /* add the new process' name */
 
 	/* allocate slot for __SB2_REAL_BINARYNAME that is filled later on */
-	my_envp[i++] = strdup("__SB2_REAL_BINARYNAME=");
+	add_to_envp(my_envp, &i, my_envp_size,
+		exec_strdup("__SB2_REAL_BINARYNAME="));
 
 	/* add user's versions of LD_PRELOAD and LD_LIBRARY_PATH */
 	if (user_ld_preload != NULL) {
-		my_envp[i++] = user_ld_preload;
+		add_to_envp(my_envp, &i, my_envp_size, user_ld_preload);
 		SB_LOG(SB_LOGLEVEL_NOISE, "Added %s", user_ld_preload);
 	}
 	if (user_ld_library_path != NULL) {
-		my_envp[i++] = user_ld_library_path;
+		add_to_envp(my_envp, &i, my_envp_size, user_ld_library_path);
 		SB_LOG(SB_LOGLEVEL_NOISE, "Added %s", user_ld_library_path);
 	}
 
 	if (sbox_chroot_path) {
 		/* chroot simulation is active, relay the value */
-		if (asprintf(&new_exec_file_var, "__SB2_CHROOT_PATH=%s", sbox_chroot_path) < 0) {
+		if (exec_asprintf(&new_exec_file_var, "__SB2_CHROOT_PATH=%s", sbox_chroot_path) < 0) {
 			SB_LOG(SB_LOGLEVEL_ERROR,
 				"asprintf failed to create __SB2_CHROOT_PATH");
 		}
-		my_envp[i++] = new_exec_file_var;
+		add_to_envp(my_envp, &i, my_envp_size, new_exec_file_var);
+	}
+
+	/* the new process can use our rule tree fd instead of
+	 * opening the rule tree again */
+	if (pass_ruletree_fd) {
+		new_exec_file_var = ruletree_get_exec_fd_env_var(exec_asprintf);
+		add_to_envp(my_envp, &i, my_envp_size, new_exec_file_var);
 	}
 
 	my_envp[i] = NULL;
@@ -1222,9 +1415,9 @@ static void change_environment_variable(
 
 		/* release the placeholder */
 		orig_value = my_envp[idx];
-		free(orig_value);
+		exec_free(orig_value);
 
-		if (asprintf(&new_value_buf, "%s%s",
+		if (exec_asprintf(&new_value_buf, "%s%s",
 		    var_prefix, new_value) < 0) {
 			SB_LOG(SB_LOGLEVEL_ERROR,
 				"asprintf failed to create new value %s%s",
@@ -1416,11 +1609,11 @@ static int prepare_exec(const char *exec_fn_name,
 	SB_LOG(SB_LOGLEVEL_NOISE,
 		"%s: exec_policy_name='%s'", __func__, exec_policy_name);
 
-	tmp = strdup(orig_file);
-	binaryname = strdup(basename(tmp)); /* basename may modify *tmp */
-	free(tmp);
+	tmp = exec_strdup(orig_file);
+	binaryname = exec_strdup(basename(tmp)); /* basename may modify *tmp */
+	exec_free(tmp);
 	
-	my_file = strdup(orig_file);
+	my_file = exec_strdup(orig_file);
 
 	my_argv = duplicate_argv(orig_argv);
 
@@ -1441,11 +1634,11 @@ static int prepare_exec(const char *exec_fn_name,
 		/* (e.g. we came back from run_hashbang()) */
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"prepare_exec(): no double mapping, my_file = %s", my_file);
-		mapped_file = strdup(my_file);
+		mapped_file = exec_strdup(my_file);
 	} else if (strvec_contains_prefix(my_envp, "SBOX_DISABLE_MAPPING=1", NULL)) {
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"do_exec(): mapping disabled, my_file = %s", my_file);
-		mapped_file = strdup(my_file);
+		mapped_file = exec_strdup(my_file);
 
 		/* we won't call sbox_map_path_for_exec() because mapping
 		 * is disabled.  */
@@ -1460,9 +1653,9 @@ static int prepare_exec(const char *exec_fn_name,
 		START_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk3, "map_path_for_exec");
 		sbox_map_path_for_exec("do_exec", my_file, &mapping_result);
 		mapped_file = (mapping_result.mres_result_buf ?
-			strdup(mapping_result.mres_result_buf) : NULL);
+			exec_strdup(mapping_result.mres_result_buf) : NULL);
 		exec_policy_name = (mapping_result.mres_exec_policy_name ?
-			strdup(mapping_result.mres_exec_policy_name) : NULL);
+			exec_strdup(mapping_result.mres_exec_policy_name) : NULL);
 		STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk3, mapped_file);
 
 		if (mapping_result.mres_errno) {
@@ -1517,7 +1710,8 @@ static int prepare_exec(const char *exec_fn_name,
 			/* prepare_hashbang() will call prepare_exec()
 			 * recursively */
 			ret = prepare_hashbang(&mapped_file, my_file,
-					&my_argv, &my_envp, exec_policy_name);
+					&my_argv, &my_envp, exec_policy_name,
+					info.hashbang);
 			break;
 
 		case BIN_HOST_DYNAMIC:
@@ -1679,7 +1873,8 @@ static int prepare_exec(const char *exec_fn_name,
 	*new_envp = my_envp;
 	err = errno;
 	STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, orig_file);
-	if (info.pt_interp) free(info.pt_interp);
+	if (info.pt_interp) exec_free(info.pt_interp);
+	if (info.hashbang) exec_free(info.hashbang);
 	errno = err;
 	return(ret);
 }
@@ -1692,9 +1887,13 @@ int do_exec(int *result_errno_ptr,
 	char **new_argv = NULL;
 	char **new_envp = NULL;
 	int  result;
+	struct exec_arena arena;
+	char arena_buf[EXEC_ARENA_STACK_SIZE];
 	PROCESSCLOCK(clk1)
 
+	exec_trace_begin_exec();
 	START_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, "do_exec");
+	exec_arena_begin(&arena, arena_buf, sizeof(arena_buf));
 	if (getenv("SBOX_DISABLE_MAPPING")) {
 		/* just run it, don't worry, be happy! */
 	} else {
@@ -1703,24 +1902,25 @@ int do_exec(int *result_errno_ptr,
 		char	*tmp, *binaryname;
 		enum binary_type type;
 
-		tmp = strdup(orig_file);
-		binaryname = strdup(basename(tmp)); /* basename may modify *tmp */
-		free(tmp);
+		tmp = exec_strdup(orig_file);
+		binaryname = exec_strdup(basename(tmp)); /* basename may modify *tmp */
+		exec_free(tmp);
 
 		if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_DEBUG)) {
 			char *buf = strvec_to_string(orig_argv);
 
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"EXEC/Orig.args: %s : %s", orig_file, buf);
-			free(buf);
+			exec_free(buf);
 		
 			/* create a copy of intended environment for logging,
 			 * before preprocessing */
 			my_envp_copy = prepare_envp_for_do_exec(orig_file,
-				binaryname, orig_envp);
+				binaryname, orig_envp, 1);
 		}
 		
-		new_envp = prepare_envp_for_do_exec(orig_file, binaryname, orig_envp);
+		new_envp = prepare_envp_for_do_exec(orig_file, binaryname,
+			orig_envp, 1);
 
 		r = prepare_exec(exec_fn_name, NULL/*exec_policy_name: not yet known*/,
 			orig_file, 0, orig_argv, orig_envp,
@@ -1739,6 +1939,9 @@ int do_exec(int *result_errno_ptr,
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"EXEC denied by prepare_exec(), %s", orig_file);
 			STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, "Exec denied");
+			exec_arena_end(&arena);
+			exec_arena_release(&arena);
+			exec_trace_end_exec();
 			return(r); /* exec denied */
 		}
 
@@ -1751,17 +1954,31 @@ int do_exec(int *result_errno_ptr,
 				"by exec mapping logic", orig_file);
 			*result_errno_ptr = EINVAL;
 			STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, "Config error");
+			exec_arena_end(&arena);
+			exec_arena_release(&arena);
+			exec_trace_end_exec();
 			return(-1);
 		}
 	}
 
+	exec_arena_end(&arena);
 	errno = *result_errno_ptr; /* restore to orig.value */
 	STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, orig_file);
+	/* before the exec: after vfork() the parent continues
+	 * with our variables */
+	exec_trace_end_exec();
+	if (exec_trace_is_active())
+		exec_trace_event("exec", NULL, "file",
+			(new_file ? new_file : orig_file), NULL, 0);
 	result = sb_next_execve(
 		(new_file ? new_file : orig_file),
 		(new_argv ? new_argv : orig_argv),
 		(new_envp ? new_envp : orig_envp));
 	*result_errno_ptr = errno;
+	exec_arena_release(&arena);
+	if (exec_trace_is_active())
+		exec_trace_event("exec failed", NULL, "file", orig_file,
+			"errno", *result_errno_ptr);
 	SB_LOG(SB_LOGLEVEL_DEBUG,
 		"EXEC failed (%s), errno=%d", orig_file, *result_errno_ptr);
 	return(result);
@@ -1777,9 +1994,14 @@ int do_posix_spawn(int *result_errno_ptr,
 	char **new_argv = NULL;
 	char **new_envp = NULL;
 	int  result;
+	struct exec_arena arena;
+	char arena_buf[EXEC_ARENA_STACK_SIZE];
+	struct timespec spawn_start_time;
 	PROCESSCLOCK(clk1)
 
+	exec_trace_begin_exec();
 	START_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, "do_posix_spawn");
+	exec_arena_begin(&arena, arena_buf, sizeof(arena_buf));
 	if (getenv("SBOX_DISABLE_MAPPING")) {
 		/* just run it, don't worry, be happy! */
 	} else {
@@ -1788,24 +2010,26 @@ int do_posix_spawn(int *result_errno_ptr,
 		char	*tmp, *binaryname;
 		enum binary_type type;
 
-		tmp = strdup(orig_path);
-		binaryname = strdup(basename(tmp)); /* basename may modify *tmp */
-		free(tmp);
+		tmp = exec_strdup(orig_path);
+		binaryname = exec_strdup(basename(tmp)); /* basename may modify *tmp */
+		exec_free(tmp);
 
 		if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_DEBUG)) {
 			char *buf = strvec_to_string(orig_argv);
 
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"SPAWN/Orig.args: %s : %s", orig_path, buf);
-			free(buf);
+			exec_free(buf);
 
 			/* create a copy of intended environment for logging,
 			 * before preprocessing */
 			my_envp_copy = prepare_envp_for_do_exec(orig_path,
-				binaryname, orig_envp);
+				binaryname, orig_envp,
+				sb_posix_spawn_passes_ruletree_fd(file_actions));
 		}
 
-		new_envp = prepare_envp_for_do_exec(orig_path, binaryname, orig_envp);
+		new_envp = prepare_envp_for_do_exec(orig_path, binaryname,
+			orig_envp, sb_posix_spawn_passes_ruletree_fd(file_actions));
 
 		r = prepare_exec(exec_fn_name, NULL/*exec_policy_name: not yet known*/,
 			orig_path, 0, orig_argv, orig_envp,
@@ -1824,6 +2048,9 @@ int do_posix_spawn(int *result_errno_ptr,
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"EXEC denied by prepare_exec(), %s", orig_path);
 			STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, "Exec denied");
+			exec_arena_end(&arena);
+			exec_arena_release(&arena);
+			exec_trace_end_exec();
 			return(r); /* exec denied */
 		}
 
@@ -1836,18 +2063,30 @@ int do_posix_spawn(int *result_errno_ptr,
 				"by exec mapping logic", orig_path);
 			*result_errno_ptr = EINVAL;
 			STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, "Config error");
+			exec_arena_end(&arena);
+			exec_arena_release(&arena);
+			exec_trace_end_exec();
 			return(-1);
 		}
 	}
 
+	exec_arena_end(&arena);
 	errno = *result_errno_ptr; /* restore to orig.value */
-	STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, orig_file);
+	STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, orig_path);
+	exec_trace_end_exec();
+	if (exec_trace_is_active())
+		clock_gettime(CLOCK_MONOTONIC, &spawn_start_time);
 	result = sb_next_posix_spawn(pid,
 		(new_path ? new_path : orig_path),
         file_actions, attrp,
 		(new_argv ? new_argv : orig_argv),
 		(new_envp ? new_envp : orig_envp));
 	*result_errno_ptr = errno;
+	if (exec_trace_is_active())
+		exec_trace_event("posix_spawn", &spawn_start_time, "file",
+			(new_path ? new_path : orig_path),
+			"child", (result == 0 && pid ? *pid : -1));
+	exec_arena_release(&arena);
 	SB_LOG(SB_LOGLEVEL_DEBUG,
 		"EXEC failed (%s), errno=%d", orig_path, *result_errno_ptr);
 	return(result);
@@ -1868,17 +2107,17 @@ int sb2show__execve_mods__(
 
 	if (!file) return(ret);
 
-	tmp = strdup(file);
-	binaryname = strdup(basename(tmp)); /* basename may modify *tmp */
-	free(tmp);
+	tmp = exec_strdup(file);
+	binaryname = exec_strdup(basename(tmp)); /* basename may modify *tmp */
+	exec_free(tmp);
 
-	*new_envp = prepare_envp_for_do_exec(file, binaryname, orig_envp);
+	*new_envp = prepare_envp_for_do_exec(file, binaryname, orig_envp, 1);
 
 	ret = prepare_exec("sb2show_exec", NULL/*exec_policy_name*/,
 		file, 0, orig_argv, orig_envp,
 		NULL, new_file, new_argv, new_envp);
 
-	if (!*new_file) *new_file = strdup(file);
+	if (!*new_file) *new_file = exec_strdup(file);
 	if (!*new_argv) *new_argv = duplicate_argv(orig_argv);
 	if (!*new_envp) *new_envp = duplicate_argv(orig_envp);
 
@@ -1915,6 +2154,6 @@ char *sb2show__binary_type__(const char *filename)
 		/* this should not happen! */
 		result = "internal error"; break;
 	}
-	return(strdup(result));
+	return(exec_strdup(result));
 }
 
@@ -6,35 +6,42 @@
  * print results to log.
  *
  * clock_gettime() requires librt, which isn't linked in
- * by default => this feature is active only if 
+ * by default => this feature is active only if
  * USE_PROCESSCLOCK has been defined in the top-level
  * Makefile.
+ *
+ * Independently of that, the regions are recorded (as elapsed
+ * wall-clock time) to the exec timeline trace, if tracing is
+ * active and an exec is being prepared (see sb2_exectrace.h)
 */
 
 #ifndef SB2_PROCESSCLOCK_H__
 #define SB2_PROCESSCLOCK_H__
 
-#ifdef USE_PROCESSCLOCK
-
 #include <time.h>
-#include "sb2.h"
+#include "sb2_exectrace.h"
 
 typedef struct {
+#ifdef USE_PROCESSCLOCK
 	struct timespec	pclk_start_time;
 	struct timespec	pclk_stop_time;
 	long long pclk_ns;
+#endif
+	struct timespec	pclk_trace_start_time; /* tv_sec==0: not traced */
 	const char *pclk_name;
 } processclock_t;
 
-#define PROCESSCLOCK(v) processclock_t v;
-#define START_PROCESSCLOCK(debuglevel,pclk,name) do { \
+#ifdef USE_PROCESSCLOCK
+
+#include "sb2.h"
+
+#define START_PROCESSCLOCK_CPUTIME(debuglevel,pclk) do { \
 		if (SB_LOG_IS_ACTIVE((debuglevel))) { \
-			(pclk)->pclk_name = (name); \
 			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &(pclk)->pclk_start_time); \
 		} \
 	} while(0)
 
-#define STOP_AND_REPORT_PROCESSCLOCK(debuglevel,pclk,str_param) do { \
+#define STOP_AND_REPORT_PROCESSCLOCK_CPUTIME(debuglevel,pclk,str_param) do { \
 		if (SB_LOG_IS_ACTIVE((debuglevel))) { \
 			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &(pclk)->pclk_stop_time); \
 			processclock_finalize((pclk)); \
@@ -48,12 +55,27 @@ extern void processclock_finalize(processclock_t *pclk);
 
 #else /* USE_PROCESSCLOCK not active */
 
-typedef char processclock_t;
-
-#define PROCESSCLOCK(v)
-#define START_PROCESSCLOCK(debuglevel,pclk,name)
-#define STOP_AND_REPORT_PROCESSCLOCK(debuglevel,pclk,str_param)
+#define START_PROCESSCLOCK_CPUTIME(debuglevel,pclk)
+#define STOP_AND_REPORT_PROCESSCLOCK_CPUTIME(debuglevel,pclk,str_param)
 
 #endif /* USE_PROCESSCLOCK */
 
+#define PROCESSCLOCK(v) processclock_t v;
+
+#define START_PROCESSCLOCK(debuglevel,pclk,name) do { \
+		(pclk)->pclk_name = (name); \
+		if (exec_trace_regions_active()) \
+			clock_gettime(CLOCK_MONOTONIC, &(pclk)->pclk_trace_start_time); \
+		else \
+			(pclk)->pclk_trace_start_time.tv_sec = 0; \
+		START_PROCESSCLOCK_CPUTIME(debuglevel,pclk); \
+	} while(0)
+
+#define STOP_AND_REPORT_PROCESSCLOCK(debuglevel,pclk,str_param) do { \
+		STOP_AND_REPORT_PROCESSCLOCK_CPUTIME(debuglevel,pclk,str_param); \
+		if ((pclk)->pclk_trace_start_time.tv_sec) \
+			exec_trace_region((pclk)->pclk_name, \
+				&(pclk)->pclk_trace_start_time, (str_param)); \
+	} while(0)
+
 #endif /* SB2_PROCESSCLOCK_H__ */
@@ -42,6 +42,8 @@ typedef struct ruletree_object_hdr_s {
 #define SB2_RULETREE_OBJECT_TYPE_INODESTAT	7	/* ruletree_inodestat_t */
 #define SB2_RULETREE_OBJECT_TYPE_UINT32		8	/* ruletree_uint32_t */
 #define SB2_RULETREE_OBJECT_TYPE_BOOLEAN	9	/* also ruletree_uint32_t */
+#define SB2_RULETREE_OBJECT_TYPE_BLOOMFILTER	10	/* ruletree_bloomfilter_t */
+#define SB2_RULETREE_OBJECT_TYPE_BINARY_INFO_CACHE	11	/* ruletree_binary_info_cache_t */
 #define SB2_RULETREE_OBJECT_TYPE_EXEC_PP_RULE	14	/* ruletree_exec_preprocessing_rule_t */
 #define SB2_RULETREE_OBJECT_TYPE_EXEC_SEL_RULE	15	/* ruletree_exec_policy_selection_rule_t */
 #define SB2_RULETREE_OBJECT_TYPE_NET_RULE	21	/* ruletree_net_rule_t */
@@ -60,7 +62,7 @@ typedef struct ruletree_hdr_s {
 	uint32_t		rtree_min_client_socket_fd;	/* for clients */
 } ruletree_hdr_t;
 
-#define RULE_TREE_VERSION	6
+#define RULE_TREE_VERSION	12
 
 /* catalogs are lists of name+value pairs
  * (the value can be a rule, string, or another catalog).
@@ -143,6 +145,20 @@ typedef struct {
 	uint32_t	inodesimu_suidsgid;	/* simulated SUID/SGID bits */
 
 	uint32_t	inodesimu_active_fields;	/* bit mask (RULETREE_INODESTAT_SIM_*) */
+
+	uint32_t	inodesimu_real_ifmt;	/* S_IFMT bits of the real file, 0 if
+						 * not known. Used to detect stale
+						 * entries after the inode has been
+						 * reused (see vperm snapshots) */
+	uint32_t	inodesimu_flags;	/* RULETREE_INODESTAT_FLAG_* */
+
+	/* identity of the real file, as seen by the client that set
+	 * the fields (if RULETREE_INODESTAT_FLAG_REAL_ID is set). ctime
+	 * and size together tell if an inode that was restored from a
+	 * snapshot still is the same file. */
+	uint32_t	inodesimu_real_ctime_nsec;
+	int64_t		inodesimu_real_ctime_sec;
+	uint64_t	inodesimu_real_size;
 } inodesimu_t;
 
 typedef struct ruletree_inodestat_s {
@@ -158,6 +174,12 @@ typedef struct ruletree_inodestat_s {
 #define RULETREE_INODESTAT_SIM_DEVNODE	0x8	/* set when simulating a blk/chr device */
 #define RULETREE_INODESTAT_SIM_SUIDSGID	0x10	/* set when SUID/SGID simulation is active */
 
+/* bit mask inodesimu_flags: */
+#define RULETREE_INODESTAT_FLAG_REAL_ID		0x1	/* inodesimu_real_ctime_* and
+							 * inodesimu_real_size are valid */
+#define RULETREE_INODESTAT_FLAG_RESTORED	0x2	/* loaded from a vperm snapshot,
+							 * identity not verified yet */
+
 /* the string header structure is followed by the string itself. */
 typedef struct ruletree_string_hdr_s {
 	ruletree_object_hdr_t	rtree_str_objhdr;
@@ -181,6 +203,53 @@ typedef struct ruletree_uint32_s {
 	uint32_t	rtree_uint32;
 } ruletree_uint32_t;
 
+/* A bloom filter. The header is followed by the bit array
+ * (rtree_bf_num_bits/32 uint32_t words). Bits are only ever set,
+ * never cleared, so readers can test it without locking. */
+typedef struct ruletree_bloomfilter_s {
+	ruletree_object_hdr_t	rtree_bf_objhdr;
+
+	uint32_t	rtree_bf_num_bits;	/* a power of two */
+} ruletree_bloomfilter_t;
+
+/* A cache of results from inspecting binaries (see sb_exec.c).
+ * The header is followed by rtree_bic_num_entries entries, which
+ * are organized as 4-way sets. This is the only object in the rule
+ * tree that is written by clients: Every entry is protected by a
+ * sequence counter (odd while the entry is being updated), readers
+ * retry or give up if it changes while they are copying the entry.
+ * The key is the identity of the file (dev,ino) + size and
+ * timestamps, so a modified or replaced file is never found. */
+#define RULETREE_BINARY_INFO_CACHE_WAYS		4
+#define RULETREE_BINARY_INFO_PT_INTERP_SIZE	128
+
+typedef struct ruletree_binary_info_cache_s {
+	ruletree_object_hdr_t	rtree_bic_objhdr;
+
+	uint32_t	rtree_bic_num_entries;	/* a power of two */
+} ruletree_binary_info_cache_t;
+
+typedef struct ruletree_binary_info_cache_entry_s {
+	uint32_t	rbic_seq;
+	uint32_t	rbic_type;	/* enum binary_type, 0 = free entry */
+
+	/* key */
+	uint64_t	rbic_dev;
+	uint64_t	rbic_ino;
+	uint64_t	rbic_size;
+	int64_t		rbic_mtime_sec;
+	int64_t		rbic_ctime_sec;
+	uint32_t	rbic_mtime_nsec;
+	uint32_t	rbic_ctime_nsec;
+
+	/* value */
+	uint16_t	rbic_machine;
+	uint8_t		rbic_data;
+	uint8_t		rbic_has_capabilities;
+	uint32_t	rbic_reserved;
+	char		rbic_pt_interp[RULETREE_BINARY_INFO_PT_INTERP_SIZE];
+} ruletree_binary_info_cache_entry_t;
+
 /* the three "usual selectors", used in normal rules */
 #define SB2_RULETREE_FSRULE_SELECTOR_PATH		101
 #define SB2_RULETREE_FSRULE_SELECTOR_PREFIX		102
@@ -250,6 +319,12 @@ extern char *ruletree_reverse_path(
 extern int create_ruletree_file(const char *ruletree_path,
 	uint32_t max_size, uint64_t min_mmap_addr, int min_client_socket_fd);
 extern int attach_ruletree(const char *ruletree_path, int keep_open);
+extern int attach_inherited_ruletree(const char *ruletree_path,
+	const char *fd_info);
+extern char *ruletree_get_exec_fd_env_var(
+	int (*asprintf_fn)(char **strp, const char *fmt, ...));
+extern int ruletree_get_exec_fd(void);
+extern void ruletree_set_exec_fd_inheritable(int inheritable);
 
 extern void *offset_to_ruletree_object_ptr(ruletree_object_offset_t offs,
 	uint32_t required_type);
@@ -261,6 +336,8 @@ extern ruletree_exec_preprocessing_rule_t *offset_to_exec_preprocessing_rule_ptr
 
 /* strings */
 extern ruletree_object_offset_t append_string_to_ruletree_file(const char *str);
+extern uint32_t ruletree_string_hash(const char *str);
+extern uint32_t ruletree_string_hash_n(const char *str, size_t len);
 
 /* ints */
 extern uint32_t *ruletree_get_pointer_to_uint32(ruletree_object_offset_t offs);
@@ -270,6 +347,21 @@ extern ruletree_object_offset_t append_uint32_to_ruletree_file(uint32_t initial_
 extern uint32_t *ruletree_get_pointer_to_boolean(ruletree_object_offset_t offs);
 extern ruletree_object_offset_t append_boolean_to_ruletree_file(uint32_t initial_value);
 
+/* bloom filters */
+extern ruletree_object_offset_t ruletree_bloomfilter_create(uint32_t num_bits);
+extern void ruletree_bloomfilter_add(ruletree_object_offset_t bf_offs,
+	uint64_t key1, uint64_t key2);
+extern int ruletree_bloomfilter_test(ruletree_object_offset_t bf_offs,
+	uint64_t key1, uint64_t key2);
+
+/* binary info cache */
+extern ruletree_object_offset_t ruletree_binary_info_cache_create(
+	uint32_t num_entries);
+extern int ruletree_binary_info_cache_lookup(
+	ruletree_binary_info_cache_entry_t *entry);
+extern void ruletree_binary_info_cache_store(
+	const ruletree_binary_info_cache_entry_t *entry);
+
 /* lists */
 extern ruletree_object_offset_t ruletree_objectlist_create_list(uint32_t size);
 extern int ruletree_objectlist_set_item(ruletree_object_offset_t list_offs,
@@ -306,6 +398,9 @@ typedef struct {
 	/* bintree node offset, if known */
 	ruletree_object_offset_t	rfh_offs;
 
+	/* root of the inodestat tree of rfh_dev, if known */
+	ruletree_object_offset_t	rfh_dev_root;
+
 	/* next two fields are filled by ruletree_find_inodestat(),
 	 * and used by ruletree_set_inodestat() */
 	ruletree_object_offset_t        rfh_last_visited_node;
@@ -328,6 +423,51 @@ extern ruletree_object_offset_t ruletree_set_inodestat(
 	ruletree_inodestat_handle_t	*handle,
         inodesimu_t      		*istat_struct);
 
+extern int ruletree_inodestat_may_exist(
+	const ruletree_inodestat_handle_t *handle);
+
+/* returns nonzero if "istat" may describe a file with "real_mode" */
+#define ruletree_inodestat_matches_real_mode(istat, real_mode) \
+	(((istat)->inodesimu_real_ifmt == 0) || \
+	 ((istat)->inodesimu_real_ifmt == ((real_mode) & S_IFMT)))
+
+/* returns nonzero if the real file still has the ctime and size that
+ * were recorded to "istat" */
+#define ruletree_inodestat_matches_real_id(istat, ctime_sec, ctime_nsec, size) \
+	((((istat)->inodesimu_flags & RULETREE_INODESTAT_FLAG_REAL_ID) == 0) || \
+	 (((istat)->inodesimu_real_ctime_sec == (int64_t)(ctime_sec)) && \
+	  ((istat)->inodesimu_real_ctime_nsec == (uint32_t)(ctime_nsec)) && \
+	  ((istat)->inodesimu_real_size == (uint64_t)(size))))
+
+/* returns nonzero if "istat" can't describe the real file: the type
+ * differs, or it was restored from a snapshot and the file has been
+ * changed (or replaced) after the snapshot was saved. */
+#define ruletree_inodestat_is_stale(istat, real_mode, ctime_sec, ctime_nsec, size) \
+	(!ruletree_inodestat_matches_real_mode((istat), (real_mode)) || \
+	 (((istat)->inodesimu_flags & RULETREE_INODESTAT_FLAG_RESTORED) && \
+	  !ruletree_inodestat_matches_real_id((istat), (ctime_sec), \
+		(ctime_nsec), (size))))
+
+/* calls "fn" for every inodestat structure. Stops if "fn" returns
+ * nonzero. Returns the number of visited structures. */
+extern uint32_t ruletree_for_each_inodestat(
+	int (*fn)(const inodesimu_t *istat, void *arg), void *arg);
+
+/* bulk load; sorts "istats" */
+extern uint32_t ruletree_add_inodestats(inodesimu_t *istats,
+	uint32_t num_istats);
+
+typedef struct ruletree_usage_stats_s {
+	uint32_t	rtus_file_size;
+	uint32_t	rtus_max_size;
+	uint32_t	rtus_inodestats_live;
+	uint32_t	rtus_inodestats_dead;
+	uint32_t	rtus_inodestats_max_depth;
+	uint32_t	rtus_inodestat_devices;
+} ruletree_usage_stats_t;
+
+extern void ruletree_get_usage_stats(ruletree_usage_stats_t *stats);
+
 /* ------------ fs mapping rule maintenance routines ------------ */
 extern ruletree_object_offset_t add_rule_to_ruletree(
 	const char *name, int selector_type, const char *selector,
@@ -348,11 +488,17 @@ ruletree_object_offset_t add_exec_preprocessing_rule_to_ruletree(
         const char *new_filename,
         int disable_mapping);
 
+ruletree_object_offset_t add_exec_preprocessing_rule_index_to_ruletree(
+	ruletree_object_offset_t rule_list_offs);
+
 ruletree_object_offset_t add_exec_policy_selection_rule_to_ruletree(
 	uint32_t	ruletype,
         const char      *selector,
         const char      *exec_policy_name,
 	uint32_t	flags);
+
+ruletree_object_offset_t add_exec_policy_selection_rule_index_to_ruletree(
+	ruletree_object_offset_t rule_list_offs);
  
 /* ------------ net rule maintenance routines ------------ */
 ruletree_object_offset_t add_net_rule_to_ruletree(
@@ -363,5 +509,7 @@ ruletree_object_offset_t add_net_rule_to_ruletree(
 extern void inc_vperm_num_active_inodestats(void);
 extern void dec_vperm_num_active_inodestats(void);
 extern uint32_t get_vperm_num_active_inodestats(void);
+extern void set_vperm_pending_updates_fns(void (*flush_fn)(void),
+	uint32_t (*num_pending_fn)(void));
 
 #endif /* SB2_RULETREE_H__ */
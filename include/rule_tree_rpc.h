@@ -14,7 +14,21 @@
  *   information to the rule tree.
 */
 
-#define RULETREE_RPC_PROTOCOL_VERSION	2
+#define RULETREE_RPC_PROTOCOL_VERSION	4
+
+/* Max. size of the VPERM_IMPORT message payload */
+#define RULETREE_RPC_VPERM_IMPORT_MAX_SIZE	4096
+
+/* Max. number of records in one FILEINFO_BATCH message */
+#define RULETREE_RPC_FILEINFO_BATCH_MAX	64
+
+/* One record of a FILEINFO_BATCH message. rimb_command is
+ * RULETREE_RPC_MESSAGE_COMMAND__{SET,RELEASE,CLEAR}FILEINFO */
+typedef struct ruletree_rpc_fileinfo_record_s {
+	uint32_t	rimb_command;
+	uint32_t	rimb_reserved;
+	inodesimu_t	rimb_fileinfo;
+} ruletree_rpc_fileinfo_record_t;
 
 /* Commands: Client -> server messages */
 typedef struct ruletree_rpc_msg_command_s {
@@ -25,16 +39,68 @@ typedef struct ruletree_rpc_msg_command_s {
 		/* for most message types */
 		uint32_t	rimm_status; 
 
-		/* for SETFILEINFO */
+		/* for SETFILEINFO, RELEASEFILEINFO and CLEARFILEINFO */
 		inodesimu_t	rimm_fileinfo;
+
+		/* for FILEINFO_BATCH. Only the used records are sent. */
+		struct {
+			uint32_t	rimb_num_records;
+			uint32_t	rimb_reserved;
+			ruletree_rpc_fileinfo_record_t
+				rimb_records[RULETREE_RPC_FILEINFO_BATCH_MAX];
+		} rimm_fileinfo_batch;
+
+		/* for VPERM_IMPORT: absolute path of the manifest and
+		 * the root directory for the files listed in it, both
+		 * NUL-terminated */
+		char	rimm_vperm_import[RULETREE_RPC_VPERM_IMPORT_MAX_SIZE];
 	} rim_message;
 } ruletree_rpc_msg_command_t;
 
+/* Commands are sent with the payload that they use, not as
+ * sizeof(ruletree_rpc_msg_command_t) (which is over 4 KB because of
+ * the longest variants); this is the size of a command whose payload
+ * is rim_message.<member>. FILEINFO_BATCH and VPERM_IMPORT are
+ * shorter still: only the used records / the strings are sent. */
+#define RULETREE_RPC_COMMAND_SIZE(member) \
+	(offsetof(ruletree_rpc_msg_command_t, rim_message) + \
+	 sizeof(((ruletree_rpc_msg_command_t*)0)->rim_message.member))
+
 #define RULETREE_RPC_MESSAGE_COMMAND__PING	1
 #define RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO	2
 #define RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO	3
 #define RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO	4
 #define RULETREE_RPC_MESSAGE_COMMAND__INIT2		5
+#define RULETREE_RPC_MESSAGE_COMMAND__FILEINFO_BATCH	6
+#define RULETREE_RPC_MESSAGE_COMMAND__STATS		7
+#define RULETREE_RPC_MESSAGE_COMMAND__VPERM_IMPORT	8
+
+/* reply to STATS */
+#define RULETREE_RPC_STATS_MAX_COMMAND	8
+typedef struct ruletree_rpc_stats_s {
+	/* number of commands by type; [0] counts unknown types */
+	uint64_t	rist_num_commands[RULETREE_RPC_STATS_MAX_COMMAND+1];
+	uint64_t	rist_num_batch_records;	/* in FILEINFO_BATCHes */
+
+	/* commands waiting for or being executed by the writer thread */
+	uint32_t	rist_writer_queue_depth;
+	uint32_t	rist_writer_queue_max_depth;
+
+	/* time from receiving a command to having the reply ready,
+	 * microseconds. Percentiles are upper bounds (powers of two) */
+	uint32_t	rist_latency_p50_usec;
+	uint32_t	rist_latency_p90_usec;
+	uint32_t	rist_latency_p99_usec;
+	uint32_t	rist_latency_max_usec;
+
+	uint32_t	rist_ruletree_file_size;
+	uint32_t	rist_ruletree_max_size;
+
+	uint32_t	rist_inodestats_live;	/* has active fields */
+	uint32_t	rist_inodestats_dead;	/* all fields released */
+	uint32_t	rist_inodestats_max_depth;	/* deepest device tree */
+	uint32_t	rist_inodestat_devices;
+} ruletree_rpc_stats_t;
 
 /* Replies: Server -> Client messages */
 typedef struct ruletree_rpc_msg_reply_hdr_s {
@@ -49,6 +115,12 @@ typedef struct ruletree_rpc_msg_reply_s {
 	ruletree_rpc_msg_reply_hdr_t	hdr;
 	union {
 		char	rimr_str[RULETREE_RPC_REPLY_MAX_STR_SIZE];	/* Variable size, max RULETREE_RPC_REPLY_MAX_STR_SIZE */
+
+		/* reply to FILEINFO_BATCH: one RULETREE_RPC_MESSAGE_REPLY__*
+		 * code per record, in the same order as in the command */
+		uint8_t	rimr_batch_status[RULETREE_RPC_FILEINFO_BATCH_MAX];
+
+		ruletree_rpc_stats_t	rimr_stats;
 	} msg;
 } ruletree_rpc_msg_reply_t;
 
@@ -58,21 +130,99 @@ typedef struct ruletree_rpc_msg_reply_s {
 #define RULETREE_RPC_MESSAGE_REPLY__PROTOVRSERR	4	/* wrong protocol version */
 #define RULETREE_RPC_MESSAGE_REPLY__MESSAGE	5	/* string message */
 
+/* ------------ Shared-memory command queue ------------
+ * An alternative transport for the messages above: sb2d creates
+ * $SBOX_SESSION_DIR/sb2d-cmdq, clients map it and put commands
+ * to free slots without any locks or syscalls. sb2d is woken up
+ * with a futex (rcq_doorbell), and sb2d wakes up the client
+ * with another futex (rcqs_state of the slot) when the reply is
+ * ready. The AF_UNIX socket is used if the queue is not available
+ * or all slots are busy.
+*/
+#define RULETREE_CMDQ_MAGIC		0x53423251	/* "SB2Q" */
+#define RULETREE_CMDQ_NUM_SLOTS		64
+
+/* rcqs_state contains the state in the low 8 bits and a generation
+ * number in the upper 24 bits. The generation is incremented when a
+ * client claims the slot, and all later transitions are done with
+ * compare-and-swap of the whole word; so a client whose slot has been
+ * reclaimed (see below) can't touch the slot of the next owner.
+ * sb2d frees slots that have stayed CLAIMED or DONE with the same
+ * generation for RULETREE_CMDQ_SLOT_TIMEOUT seconds (the client
+ * died or was stopped); the client then uses the socket instead.
+*/
+#define RULETREE_CMDQ_SLOT_FREE		0
+#define RULETREE_CMDQ_SLOT_CLAIMED	1	/* client is filling it */
+#define RULETREE_CMDQ_SLOT_READY	2	/* waiting for sb2d */
+#define RULETREE_CMDQ_SLOT_PROCESSING	3	/* sb2d is working on it */
+#define RULETREE_CMDQ_SLOT_DONE		4	/* reply is ready */
+
+#define RULETREE_CMDQ_SLOT_STATE(w)		((w) & 0xff)
+#define RULETREE_CMDQ_SLOT_GEN(w)		((w) >> 8)
+#define RULETREE_CMDQ_SLOT_WORD(gen, state)	((((gen) & 0xffffff) << 8) | (state))
+
+#define RULETREE_CMDQ_SLOT_TIMEOUT	10	/* seconds */
+
+typedef struct ruletree_cmdq_slot_s {
+	volatile uint32_t	rcqs_state;
+	uint32_t		rcqs_reserved;
+	uint32_t		rcqs_command_size;
+	uint32_t		rcqs_reply_size;
+	ruletree_rpc_msg_command_t	rcqs_command;
+	ruletree_rpc_msg_reply_t	rcqs_reply;
+} ruletree_cmdq_slot_t;
+
+typedef struct ruletree_cmdq_s {
+	uint32_t		rcq_magic;
+	uint32_t		rcq_protocol_version;
+	uint32_t		rcq_num_slots;
+	uint32_t		rcq_server_pid;
+
+	volatile uint32_t	rcq_doorbell;	/* incremented by clients */
+	volatile uint32_t	rcq_server_sleeping;
+	volatile uint32_t	rcq_next_slot;	/* where to start looking */
+	uint32_t		rcq_reserved;
+
+	ruletree_cmdq_slot_t	rcq_slots[RULETREE_CMDQ_NUM_SLOTS];
+} ruletree_cmdq_t;
+
 /* client-side RPC library: */
 extern void ruletree_rpc__ping(void);
 extern char *ruletree_rpc__init2(void);
+extern char *ruletree_rpc__stats(void);
+extern char *ruletree_rpc__vperm_import(const char *manifest_path,
+	const char *root_dir);
 
 extern void ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino);
 
-extern void ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
+struct stat64;
+
+/* the "set" functions record the identity of the real file
+ * (dev, ino, type, ctime and size) from "real_st" */
+extern void ruletree_rpc__vperm_set_ids(const struct stat64 *real_st,
 	int set_uid, uint32_t uid, int set_gid, uint32_t gid);
 extern void ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
 	int release_uid, int release_gid);
-extern void ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
+extern void ruletree_rpc__vperm_set_dev_node(const struct stat64 *real_st,
 	mode_t mode, uint64_t rdev);
 
-extern void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
-	mode_t real_mode, mode_t virt_mode, mode_t suid_sgid_bits);
+extern void ruletree_rpc__vperm_set_mode(const struct stat64 *real_st,
+	mode_t virt_mode, mode_t suid_sgid_bits);
 extern void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino);
 
+/* records a new ctime and size of the real file, after it has been
+ * modified. Also marks an inodestat that was restored from a snapshot
+ * as verified. */
+extern void ruletree_rpc__vperm_set_real_id(uint64_t dev, uint64_t ino,
+	int64_t ctime_sec, uint32_t ctime_nsec, uint64_t size);
+
+/* in write-behind mode, vperm updates are queued and sent to sb2d
+ * in batches; this sends the queued updates now. */
+extern void ruletree_rpc__vperm_flush(void);
+
+/* applies the queued updates of dev/ino to an inodestat that was
+ * read from the tree. Returns nonzero if the inodestat exists. */
+extern int ruletree_rpc__vperm_apply_queued_updates(uint64_t dev, uint64_t ino,
+	inodesimu_t *istat, int found);
+
 #endif /* SB2_RULETREE_H__ */
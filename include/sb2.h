@@ -50,6 +50,9 @@ struct sb2context {
 	/* for path mapping logic: */
 	char *host_cwd;
 	char *virtual_reversed_cwd;
+
+	/* for exec logic: active allocation arena, see execs/exec_arena.c */
+	struct exec_arena *exec_arena;
 };
 
 /* Library interface version string:
@@ -173,7 +176,7 @@ struct sb2context {
 /* This version string is used to check that init.lua offers
  * what sb2d expects, and v.v.
 */
-#define SB2D_LUA_C_INTERFACE_VERSION "301"
+#define SB2D_LUA_C_INTERFACE_VERSION "306"
 
 /* get sb2context, without activating lua: */
 extern struct sb2context *get_sb2context(void);
@@ -192,6 +195,17 @@ extern int sb_next_execve(const char *filename, char *const argv [],
 extern int do_exec(int *result_errno_ptr, const char *exec_fn_name, const char *file,
 		char *const *argv, char *const *envp);
 
+/* posix_spawn() can pass the rule tree fd to the new program only
+ * with a private dup2(fd,fd) file action, which clears FD_CLOEXEC in
+ * the child (glibc >= 2.29). That is done only when the caller has no
+ * file actions of its own (those might close the fd); otherwise
+ * the child opens the rule tree by its path. */
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)
+#define sb_posix_spawn_passes_ruletree_fd(file_actions) ((file_actions) == NULL)
+#else
+#define sb_posix_spawn_passes_ruletree_fd(file_actions) 0
+#endif
+
 extern int sb_next_posix_spawn(pid_t* pid, const char *path,
         const posix_spawn_file_actions_t *file_actions,
         const posix_spawnattr_t *attrp, char *const argv [],
@@ -271,6 +285,10 @@ extern char *sbox_mapping_method;
 
 extern char *sbox_chroot_path; /* virtual path to the chroot directory. */
 
+extern char *sbox_inherited_ruletree_fd; /* see attach_inherited_ruletree() */
+
+extern char *sbox_exec_trace_dir; /* see sblib/exec_trace.c */
+
 extern void check_pthread_library(void);
 
 extern int pthread_library_is_available; /* flag */
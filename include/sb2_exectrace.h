@@ -0,0 +1,37 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ */
+
+/* Exec timeline tracing ("sb2 -X dir"), see sblib/exec_trace.c */
+
+#ifndef __SB2_EXECTRACE_H
+#define __SB2_EXECTRACE_H
+
+#include <time.h>
+
+/* > 0 while do_exec() or do_posix_spawn() is running in the calling
+ * thread; PROCESSCLOCK regions are recorded to the trace only then. */
+extern __thread int exec_trace_region_depth__;
+
+#define exec_trace_regions_active() (exec_trace_region_depth__ > 0)
+
+extern void exec_trace_init(const char *trace_dir);
+extern int exec_trace_is_active(void);
+
+extern void exec_trace_begin_exec(void);
+extern void exec_trace_end_exec(void);
+
+/* Record an event: "instant" if start_time is NULL, otherwise a
+ * "complete" event from start_time to now. Both arguments are
+ * optional (NULL keys are omitted). */
+extern void exec_trace_event(const char *name,
+	const struct timespec *start_time,
+	const char *str_key, const char *str_val,
+	const char *int_key, long long int_val);
+
+extern void exec_trace_region(const char *name,
+	const struct timespec *start_time, const char *param);
+
+extern void exec_trace_exit(int status);
+
+#endif
@@ -25,4 +25,6 @@ extern int vperm_set_owner_and_group_of_unknown_files(uid_t *uidp, gid_t *gidp);
 
 extern int vperm_simulate_root_fs_permissions(void);
 
+extern int vperm_write_behind_updates(void);
+
 #endif
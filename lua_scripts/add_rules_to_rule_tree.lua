@@ -300,6 +300,94 @@ function add_list_of_rules(rules, modename)
 	return rule_list_index
 end
 
+-- Identity rules: unconditional "force_orig_path" rules (and
+-- "force_orig_path_unless_chroot" rules, libsb2 doesn't use these when
+-- chroot is simulated) always map a path to itself, and symlinks
+-- are never followed under them. libsb2 can pass such paths through
+-- without running the full path resolution, but only if no earlier
+-- rule in the list could match the same paths (rules are
+-- "first match wins").
+-- The collected rules are stored to "identity_rules"/<mode> as
+-- a list of rule offsets.
+local function selectors_overlap(s1, s2)
+	return (string.sub(s1, 1, #s2) == s2) or (string.sub(s2, 1, #s1) == s1)
+end
+
+local function rule_is_identity_candidate(rule)
+	if not (rule.force_orig_path or rule.force_orig_path_unless_chroot) then
+		return false
+	end
+	if not (rule.dir or rule.prefix) then
+		return false
+	end
+	if rule.func_class or rule.binary_name or rule.exec_policy_name or
+	   rule.readonly or rule.protection or rule.custom_map_funct or
+	   rule.actions or rule.rules or rule.then_actions then
+		return false
+	end
+	return true
+end
+
+local function rule_has_condition(rule)
+	return rule.if_active_exec_policy_is or
+		rule.if_redirect_ignore_is_active or
+		rule.if_redirect_force_is_active or
+		rule.if_env_var_is_not_empty or
+		rule.if_env_var_is_empty or
+		rule.if_exists_in
+end
+
+function add_identity_rules(rules, rule_list_index, modename)
+	local earlier_selectors = {}
+	local identity_rule_offsets = {}
+
+	if rules == nil or rule_list_index == 0 then
+		return 0
+	end
+
+	for n=1,#rules do
+		local rule = rules[n]
+		local selector = rule.dir or rule.prefix or rule.path
+
+		if rule_has_condition(rule) then
+			-- the C engine can't handle conditions at
+			-- this level; don't try to look past them.
+			break
+		end
+		if selector then
+			local shadowed = false
+
+			for i=1,#earlier_selectors do
+				if selectors_overlap(selector, earlier_selectors[i]) then
+					shadowed = true
+					break
+				end
+			end
+			if not shadowed and rule_is_identity_candidate(rule) then
+				local rule_offs = ruletree.objectlist_get(rule_list_index, n-1)
+				if rule_offs ~= 0 then
+					table.insert(identity_rule_offsets, rule_offs)
+				end
+			end
+			table.insert(earlier_selectors, selector)
+		end
+	end
+
+	local identity_list_index = 0
+	if #identity_rule_offsets > 0 then
+		identity_list_index = ruletree.objectlist_create(#identity_rule_offsets)
+		for n=1,#identity_rule_offsets do
+			ruletree.objectlist_set(identity_list_index, n-1,
+				identity_rule_offsets[n])
+		end
+	end
+	if debug_messages_enabled then
+		print("-- Identity rules for "..modename..": ",
+			#identity_rule_offsets, "idx=", identity_list_index)
+	end
+	return identity_list_index
+end
+
 -- ================= Exec rules =================
 
 local valid_keywords_in_exec_policy = {
@@ -308,8 +396,10 @@ local valid_keywords_in_exec_policy = {
 	log_level = "string",
 	log_message = "string",
 
+	native_app_ld_library_path = "string",
 	native_app_ld_library_path_prefix = "string",
 	native_app_ld_library_path_suffix = "string",
+	native_app_ld_preload = "string",
 	native_app_ld_preload_prefix = "string",
 	native_app_ld_preload_suffix = "string",
 
@@ -353,6 +443,45 @@ function add_mapping_rules_to_exec_policy(modename_in_ruletree, ep_name, key, va
 		key, ri)
 end
 
+-- Precompute the environment variables that are set for native
+-- applications (see exec_postprocess_native_executable()), as far as
+-- they don't depend on the user's environment. Same order of
+-- precedence as in setenv_native_app_ld_library_path(): the
+-- policy's value, or the user's value with prefix/suffix (left out
+-- from the template), or the host's value.
+function add_env_template_to_exec_policy(modename_in_ruletree, ep)
+	local env = {}
+
+	if ep.native_app_ld_library_path ~= nil then
+		table.insert(env, "LD_LIBRARY_PATH="..ep.native_app_ld_library_path)
+	elseif ep.native_app_ld_library_path_prefix == nil and
+	   ep.native_app_ld_library_path_suffix == nil and
+	   host_ld_library_path ~= nil then
+		table.insert(env, "LD_LIBRARY_PATH="..host_ld_library_path)
+	end
+	if ep.native_app_ld_preload ~= nil then
+		table.insert(env, "LD_PRELOAD="..ep.native_app_ld_preload)
+	elseif ep.native_app_ld_preload_prefix == nil and
+	   ep.native_app_ld_preload_suffix == nil and
+	   host_ld_preload ~= nil then
+		table.insert(env, "LD_PRELOAD="..host_ld_preload)
+	end
+	if ep.native_app_locale_path ~= nil then
+		table.insert(env, "LOCPATH="..ep.native_app_locale_path)
+		table.insert(env, "NLSPATH="..ep.native_app_locale_path)
+	end
+	if ep.native_app_gconv_path ~= nil then
+		table.insert(env, "GCONV_PATH="..ep.native_app_gconv_path)
+	end
+
+	local env_index = ruletree.objectlist_create(#env)
+	for k = 1, #env do
+		ruletree.objectlist_set(env_index, k-1, ruletree.new_string(env[k]))
+	end
+	ruletree.catalog_vset("exec_policy", modename_in_ruletree, ep.name,
+		"native_app_env_template", env_index)
+end
+
 function add_all_exec_policies(modename_in_ruletree)
         if (all_exec_policies ~= nil) then
                 for i = 1, #all_exec_policies do
@@ -384,6 +513,8 @@ function add_all_exec_policies(modename_in_ruletree)
 							key, modename_in_ruletree, ep_name))
 					end
 				end
+				add_env_template_to_exec_policy(modename_in_ruletree,
+					all_exec_policies[i])
 			end
                 end
         end
@@ -441,6 +572,9 @@ for m_index,m_name in pairs(all_modes) do
 	end
 	ruletree.catalog_set("fs_rules", modename_in_ruletree, ri)
 
+	ri = add_identity_rules(fs_mapping_rules, ri, m_name)
+	ruletree.catalog_set("identity_rules", modename_in_ruletree, ri)
+
 	ri = add_list_of_rules(reverse_fs_mapping_rules, "reverse "..m_name) -- add reverse  rules
 	if debug_messages_enabled then
 		print("-- Added ruleset rev.rules")
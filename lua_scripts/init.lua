@@ -16,15 +16,26 @@ debug_messages_enabled = sblib.debug_messages_enabled()
 --
 -- NOTE: the corresponding identifier for C is in include/sb2.h,
 -- see that file for description about differences
-sb2d_lua_c_interface_version = "301"
+sb2d_lua_c_interface_version = "306"
 
 -- Create the "vperm" catalog
---	vperm::inodestats is the binary tree, initially empty,
---	but the entry must be present.
+--	vperm::inodestat_devices is a binary tree of devices, each
+--	node points to the binary tree of inodestats of that device.
+--	Initially empty, but the entry must be present.
 --	all counters must be present and zero in the beginning.
-ruletree.catalog_set("vperm", "inodestats", 0)
+--	vperm::inodestat_filter is a bloom filter over (dev,ino) of
+--	the nodes in the tree (2^20 bits = 128kB)
+ruletree.catalog_set("vperm", "inodestat_devices", 0)
 ruletree.catalog_set("vperm", "num_active_inodestats",
 	ruletree.new_uint32(0))
+ruletree.catalog_set("vperm", "inodestat_filter",
+	ruletree.new_bloomfilter(1048576))
+
+-- exec::binary_info_cache caches the results of inspecting binaries
+-- before exec (ELF type, PT_INTERP, ..), shared by all processes
+-- of the session. 1024 entries, 192 bytes each.
+ruletree.catalog_set("exec", "binary_info_cache",
+	ruletree.new_binary_info_cache(1024))
 
 function do_file(filename)
 	if (debug_messages_enabled) then
@@ -174,6 +174,10 @@ function argvmods_to_ruletree(argvmods_mode_name, num_argvmods_rules, argvmods_t
 		k = k + 1
 	end
 	ruletree.catalog_set("argvmods", argvmods_mode_name, argvmods_rule_list_index)
+	-- hashed index by binary name, for fast lookups
+	ruletree.catalog_set("argvmods_index", argvmods_mode_name,
+		ruletree.add_exec_preprocessing_rule_index_to_ruletree(
+			argvmods_rule_list_index))
 end
 
 -- This function creates the old-style argvmods_*.lua files.
@@ -49,6 +49,10 @@ for m_index,m_name in pairs(all_modes) do
 		end
 		ruletree.catalog_set("exec_policy_selection", m_name,
 			epsrule_list_index)
+		-- index by the first component of the path
+		ruletree.catalog_set("exec_policy_selection_index", m_name,
+			ruletree.add_exec_policy_selection_rule_index_to_ruletree(
+				epsrule_list_index))
 	else
 		error("No exec policy selection table in "..config_file_name)
 	end
@@ -140,6 +140,9 @@ extern char *ruletree_translate_path(
 extern ruletree_object_offset_t ruletree_get_rule_list_offs(
 	int use_fwd_rules, const char **errormsgp);
 
+extern ruletree_object_offset_t ruletree_find_identity_rule(
+	const char *abs_virtual_path);
+
 extern ruletree_object_offset_t ruletree_get_mapping_requirements(
 	ruletree_object_offset_t rule_list_offs,
 	const path_mapping_context_t *ctx,
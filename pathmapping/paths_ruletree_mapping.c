@@ -251,6 +251,68 @@ ruletree_object_offset_t ruletree_get_rule_list_offs(
 	return(use_fwd_rules ? fwd_rule_list_offs : rev_rule_list_offs);
 }
 
+/* "identity_rules"/<mode> is a list of unconditional "force_orig_path"
+ * rules, which can't be shadowed by earlier rules (collected by
+ * add_rules_to_rule_tree.lua). Those map paths to themselves and
+ * symlinks are never followed, so the full path resolution can be
+ * skipped for clean absolute paths which match one of them.
+ * Returns the rule offset, or 0 if the path needs to be mapped normally.
+*/
+ruletree_object_offset_t ruletree_find_identity_rule(
+	const char *abs_virtual_path)
+{
+	static ruletree_object_offset_t identity_rule_list_offs = 0;
+	static int identity_rule_list_checked = 0;
+	const char	*cp;
+	size_t		path_len;
+	uint32_t	list_size;
+	uint32_t	i;
+
+	if (!identity_rule_list_checked) {
+		const char *modename = sbox_session_mode;
+
+		if (ruletree_to_memory() < 0) return(0);
+		if (!modename)
+			modename = ruletree_catalog_get_string("MODES", "#default");
+		if (modename)
+			identity_rule_list_offs = ruletree_catalog_get(
+				"identity_rules", modename);
+		identity_rule_list_checked = 1;
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"%s: identity rule list @%d", __func__,
+			identity_rule_list_offs);
+	}
+	if (!identity_rule_list_offs) return(0);
+
+	/* the path must be absolute and clean: no "//", "." or ".."
+	 * components and no trailing slash. */
+	if (!abs_virtual_path || (*abs_virtual_path != '/')) return(0);
+	for (cp = abs_virtual_path; *cp; cp++) {
+		if (*cp != '/') continue;
+		if ((cp[1] == '/') || (cp[1] == '\0')) return(0);
+		if (cp[1] == '.') {
+			if ((cp[2] == '/') || (cp[2] == '\0')) return(0);
+			if ((cp[2] == '.') &&
+			    ((cp[3] == '/') || (cp[3] == '\0'))) return(0);
+		}
+	}
+	path_len = cp - abs_virtual_path;
+
+	list_size = ruletree_objectlist_get_list_size(identity_rule_list_offs);
+	for (i = 0; i < list_size; i++) {
+		ruletree_object_offset_t rule_offs;
+		ruletree_fsrule_t	*rp;
+
+		rule_offs = ruletree_objectlist_get_item(identity_rule_list_offs, i);
+		rp = offset_to_ruletree_fsrule_ptr(rule_offs);
+		if (rp && (ruletree_test_path_match(abs_virtual_path,
+				path_len, rp) >= 0)) {
+			return(rule_offs);
+		}
+	}
+	return(0);
+}
+
 /* Find the rule and mapping requirements.
  * returns object offset if rule was found, zero if not found.
 */
@@ -37,6 +37,8 @@
 
 #include "libsb2.h"
 #include "exported.h"
+#include "rule_tree.h"
+#include "rule_tree_rpc.h"
 
 /* strchrnul(): Find the first occurrence of C in S or the final NUL byte.
  * This is not present on all systems, so we'll use our own version in sb2.
@@ -69,6 +71,9 @@ static int (*next_execve) (const char *filename, char *const argv [],
 
 int sb_next_execve(const char *file, char *const *argv, char *const *envp)
 {
+	int	ret;
+	int	e;
+
 	if (next_execve == NULL) {
 		next_execve = sbox_find_next_symbol(1, "execve");
 	}
@@ -96,6 +101,9 @@ int sb_next_execve(const char *file, char *const *argv, char *const *envp)
 		}
 	}
 
+	/* queued vperm updates must be visible to the new program */
+	ruletree_rpc__vperm_flush();
+
 	switch (restore_stack_before_exec) {
 	case 1:
 		SB_LOG(SB_LOGLEVEL_DEBUG, "EXEC: need to restore stack limit");
@@ -125,7 +133,13 @@ int sb_next_execve(const char *file, char *const *argv, char *const *envp)
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "EXEC: i_pid=%d file='%s'",
 		sb_log_initial_pid__, file);
-	return next_execve(file, argv, envp);
+	/* pass the rule tree fd to the new program (__SB2_RULETREE_FD) */
+	ruletree_set_exec_fd_inheritable(1);
+	ret = next_execve(file, argv, envp);
+	e = errno;
+	ruletree_set_exec_fd_inheritable(0);
+	errno = e;
+	return(ret);
 }
 
 static int (*next_posix_spawn) (pid_t* pid, const char *path,
@@ -138,6 +152,8 @@ int sb_next_posix_spawn(pid_t* pid, const char *path,
         const posix_spawnattr_t *attrp, char *const argv [],
         char *const envp[])
 {
+	int	ret;
+
 	if (next_posix_spawn == NULL) {
 		next_posix_spawn = sbox_find_next_symbol(1, "posix_spawn");
 	}
@@ -165,6 +181,9 @@ int sb_next_posix_spawn(pid_t* pid, const char *path,
 		}
 	}
 
+	/* queued vperm updates must be visible to the new program */
+	ruletree_rpc__vperm_flush();
+
 	switch (restore_stack_before_exec) {
 	case 1:
 		SB_LOG(SB_LOGLEVEL_DEBUG, "EXEC: need to restore stack limit");
@@ -194,7 +213,29 @@ int sb_next_posix_spawn(pid_t* pid, const char *path,
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "EXEC: i_pid=%d path='%s'",
 		sb_log_initial_pid__, path);
-	return next_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+
+	if (sb_posix_spawn_passes_ruletree_fd(file_actions)) {
+		/* pass the rule tree fd to the new program
+		 * (__SB2_RULETREE_FD) without touching FD_CLOEXEC
+		 * in this process; other threads may be forking. */
+		int	fd = ruletree_get_exec_fd();
+		posix_spawn_file_actions_t	fa;
+
+		if ((fd >= 0) &&
+		    (posix_spawn_file_actions_init(&fa) == 0)) {
+			if (posix_spawn_file_actions_adddup2(&fa, fd, fd) == 0) {
+				ret = next_posix_spawn(pid, path, &fa, attrp, argv, envp);
+				posix_spawn_file_actions_destroy(&fa);
+				return(ret);
+			}
+			posix_spawn_file_actions_destroy(&fa);
+		}
+	}
+	/* __SB2_RULETREE_FD was not added to the environment (see
+	 * prepare_envp_for_do_exec()), or the fd isn't valid anymore;
+	 * the child opens the rule tree by path */
+	ret = next_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+	return(ret);
 }
 
 
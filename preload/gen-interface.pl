@@ -13,6 +13,8 @@
 #   - list of exported symbols, to be used by "ld" when the shared
 #     library is created.
 #   - library function wrappers or gates (functions in C).
+#   - a table of pointers to the "next" functions, so that all
+#     of them can be resolved in one pass when the library is loaded.
 #
 # The specification file consists of lines, with two or more fields:
 #   - 1st field is a command (WRAP, GATE, EXPORT or LOGLEVEL)
@@ -1023,6 +1025,10 @@ sub create_call_to_gate_fn {
 
 my $wrappers_c_buffer = "";	# buffers contents of the generated ".c" file
 
+# buffers entries of the next-symbol table (all "*_next__" pointers),
+# including the preprocessor conditionals that surround them
+my $next_symbols_table_buffer = "";
+
 # buffers contents of the generated ".h" file
 my $h_file_include_check_macroname = uc($export_h_output_file)."__";
 $h_file_include_check_macroname =~ s/\W/_/g;
@@ -1366,6 +1372,11 @@ sub command_wrap_or_gate {
 	# to the table, used to create interface_functions_and_classes
 	# table at end.
 	$fn_to_classmasks{$fn_name} = $mods->{'class'};
+
+	# and the pointer to the next-symbol table, which is
+	# resolved in one pass by sbox_find_all_next_symbols()
+	$next_symbols_table_buffer .= "\t{\"$fn_name\", ".
+		"(void**)&$real_fn_pointer_name},\n";
 }
 
 # Handle the "EXPORT" command.
@@ -1454,6 +1465,12 @@ while ($line = <STDIN>) {
 
 		# Add the line to the output H file
 		$export_h_buffer .= "$src_comment\n";
+
+		# Preprocessor conditionals are needed in the
+		# next-symbol table, too
+		if ($line =~ m/^\s*#/) {
+			$next_symbols_table_buffer .= "$src_comment\n";
+		}
 	}
 
 	# replace multiple whitespaces by single spaces:
@@ -1517,13 +1534,19 @@ if(defined $wrappers_c_output_file) {
 			$fn_to_classmasks{$fnn}."},\n";
 	}
 	$interface_functions_and_classes .= "\t{NULL, 0},\n};\n";
+	my $next_symbols_table =
+		"next_symbol_table_entry_t ".
+		"next_symbols__".$interface_name."[] = {\n".
+		$next_symbols_table_buffer.
+		"\t{NULL, NULL},\n};\n";
 	write_output_file($wrappers_c_output_file,
 		$file_header_comment.
         '#include <config.h>'."\n\n".
         '#include "libsb2.h"'."\n".
 		$include_h_file.
 		$wrappers_c_buffer.
-		$interface_functions_and_classes);
+		$interface_functions_and_classes.
+		$next_symbols_table);
 }
 if(defined $export_h_output_file) {
 	write_output_file($export_h_output_file,
@@ -36,8 +36,11 @@
 #include <stdlib.h>
 #include <signal.h>
 
+#include <sb2_exectrace.h>
+
 #include "libsb2.h"
 #include "exported.h"
+#include "rule_tree_rpc.h"
 
 /* String vector contents to a single string for logging.
  * returns pointer to an allocated buffer, caller should free() it.
@@ -140,6 +143,42 @@ void *sbox_find_next_symbol(int log_enabled, const char *fn_name)
 	return(fn_ptr);
 }
 
+static int resolve_next_symbol_table(next_symbol_table_entry_t *tbl)
+{
+	int	num_resolved = 0;
+
+	for (; tbl->fn_name; tbl++) {
+		if (*tbl->fn_ptr_ptr) continue;
+		*tbl->fn_ptr_ptr = dlsym(RTLD_NEXT, tbl->fn_name);
+		/* Symbols that were not found are left NULL; the
+		 * interface function will try again and report
+		 * the error if it is ever called. */
+		(void)dlerror();
+		if (*tbl->fn_ptr_ptr) num_resolved++;
+	}
+	return(num_resolved);
+}
+
+/* Resolve all "next" functions in one pass, instead of doing
+ * a separate lookup when each interface function is called for
+ * the first time. This is called from the library constructor;
+ * the interface functions still check the pointers, because the
+ * constructor is not always the first thing that is executed.
+*/
+void sbox_find_all_next_symbols(void)
+{
+	static int	next_symbols_resolved = 0;
+	int		num_resolved;
+
+	if (next_symbols_resolved) return;
+	next_symbols_resolved = 1;
+
+	num_resolved = resolve_next_symbol_table(next_symbols__public);
+	num_resolved += resolve_next_symbol_table(next_symbols__private);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: resolved %d symbols",
+		__func__, num_resolved);
+}
+
 /* ----- EXPORTED from interface.master: ----- */
 char *sb2show__map_path2__(const char *binary_name, const char *mapping_mode, 
         const char *fn_name, const char *pathname, int *readonly)
@@ -189,6 +228,49 @@ char *sb2show__get_real_cwd__(const char *binary_name, const char *fn_name)
 	return(NULL);
 }
 
+/* called from sb2dctl. sb2d runs outside of the session, so
+ * the paths are mapped here before they are sent; with the
+ * default root directory ("/") the files are then looked up
+ * from the target root. */
+char *sb2__ruletree_rpc__vperm_import__(const char *manifest_path,
+	const char *root_dir)
+{
+	mapping_results_t	manifest_res;
+	mapping_results_t	root_res;
+	char			*msg = NULL;
+
+	if (!sb2_global_vars_initialized__) sb2_initialize_global_variables();
+
+	if (!manifest_path || (*manifest_path != '/') ||
+	    !root_dir || (*root_dir != '/')) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"%s: absolute paths are required", __func__);
+		return(NULL);
+	}
+
+	clear_mapping_results_struct(&manifest_res);
+	clear_mapping_results_struct(&root_res);
+	sbox_map_path(__func__, manifest_path, 0, &manifest_res,
+		SB2_INTERFACE_CLASS_OPEN);
+	sbox_map_path(__func__, root_dir, 0, &root_res,
+		SB2_INTERFACE_CLASS_STAT);
+	if (manifest_res.mres_result_path && root_res.mres_result_path) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: '%s' => '%s', '%s' => '%s'",
+			__func__, manifest_path, manifest_res.mres_result_path,
+			root_dir, root_res.mres_result_path);
+		msg = ruletree_rpc__vperm_import(
+			manifest_res.mres_result_path,
+			root_res.mres_result_path);
+	} else {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"%s: failed to map '%s' or '%s'", __func__,
+			manifest_path, root_dir);
+	}
+	free_mapping_results(&manifest_res);
+	free_mapping_results(&root_res);
+	return(msg);
+}
+
 /* ---- support functions for the generated interface: */
 
 /* returns true, if the "mode" parameter of fopen() (+friends)
@@ -235,6 +317,8 @@ char *sbox_orig_binary_name = NULL;
 char *sbox_active_exec_policy_name = NULL;
 char *sbox_mapping_method = NULL; /* optional */
 char *sbox_chroot_path = NULL; /* optional */
+char *sbox_inherited_ruletree_fd = NULL; /* optional */
+char *sbox_exec_trace_dir = NULL; /* optional */
 
 int sb2_global_vars_initialized__ = 0;
 
@@ -347,6 +431,15 @@ void sb2_initialize_global_variables(void)
 			cp = getenv("__SB2_CHROOT_PATH");
 			if (cp) sbox_chroot_path = strdup(cp);
 		}
+		if (!sbox_inherited_ruletree_fd) {
+			cp = getenv("__SB2_RULETREE_FD");
+			if (cp) sbox_inherited_ruletree_fd = strdup(cp);
+		}
+		if (!sbox_exec_trace_dir) {
+			/* optional variable */
+			cp = getenv("SBOX_SESSION_EXEC_TRACE_DIR");
+			if (cp) sbox_exec_trace_dir = strdup(cp);
+		}
 
 		if (sbox_session_dir) {
 			/* seems that we got it.. */
@@ -368,6 +461,9 @@ void sb2_initialize_global_variables(void)
 			if (getenv("SBOX_SIGTRAP"))
 				raise(SIGTRAP);
 
+			if (sbox_exec_trace_dir)
+				exec_trace_init(sbox_exec_trace_dir);
+
 			/* now when we know that the environment is
 			 * valid, it is time to change LD_PRELOAD and
 			 * LD_LIBRARY_PATH back to the values that the
@@ -99,6 +99,17 @@
 
 extern void *sbox_find_next_symbol(int log_enabled, const char *functname);
 
+/* table of all "*_next__" function pointers of the generated
+ * interface, created by gen-interface.pl */
+typedef struct {
+	const char	*fn_name;
+	void		**fn_ptr_ptr;
+} next_symbol_table_entry_t;
+extern next_symbol_table_entry_t next_symbols__public[];
+extern next_symbol_table_entry_t next_symbols__private[];
+
+extern void sbox_find_all_next_symbols(void);
+
 extern int fopen_mode_w_perm(const char *mode);
 extern int freopen_errno(FILE *stream);
 
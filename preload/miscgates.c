@@ -33,9 +33,11 @@
 #include <signal.h>
 
 #include <rule_tree.h>
+#include <sb2_exectrace.h>
 
 #include "libsb2.h"
 #include "exported.h"
+#include "rule_tree_rpc.h"
 
 #ifdef HAVE_FTS_H
 /* FIXME: why there was #if !defined(HAVE___OPENDIR2) around fts_open() ???? */
@@ -583,6 +585,7 @@ void exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	exec_trace_exit(status);
 	(real_exit_ptr)(status);
 }
 
@@ -598,6 +601,9 @@ void _exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	/* atexit handlers are not run; send queued vperm updates now */
+	ruletree_rpc__vperm_flush();
+	exec_trace_exit(status);
 	(real__exit_ptr)(status);
 }
 
@@ -614,6 +620,9 @@ void _Exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	/* atexit handlers are not run; send queued vperm updates now */
+	ruletree_rpc__vperm_flush();
+	exec_trace_exit(status);
 	(real__Exit_ptr)(status);
 }
 //void _Exit_gate() __attribute__ ((noreturn));
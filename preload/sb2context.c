@@ -201,6 +201,8 @@ struct sb2context *get_sb2context(void)
  * if the program uses multiple threads (unbelievable, but true!),
  * so this isn't really too useful. Lua initialization was
  * moved to get_sb2context_lua() because of this.
+ * But this is a good place to resolve the "next" functions
+ * of all interface functions at once.
 */
 #ifndef SB2_TESTER
 #ifdef __GNUC__
@@ -211,6 +213,7 @@ void sb2_preload_library_constructor(void)
 {
 	SB_LOG(SB_LOGLEVEL_DEBUG, "sb2_preload_library_constructor called");
 	sblog_init();
+	sbox_find_all_next_symbols();
 	SB_LOG(SB_LOGLEVEL_DEBUG, "sb2_preload_library_constructor: done");
 }
 
@@ -17,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
 
 #ifdef _GNU_SOURCE
 #undef _GNU_SOURCE
@@ -38,21 +39,231 @@
 #include "rule_tree.h"
 #include "libsb2.h"
 #include "exported.h"
+#include "sb2_stat.h"
 
 
+/* A sorted list of names, used for building the merged
+ * listing of a union directory in memory. */
+struct union_dir_names {
+	char	**udn_names;
+	int	udn_count;
+	int	udn_allocated;
+};
+
+static int add_union_dir_name(struct union_dir_names *udn, const char *name)
+{
+	if (udn->udn_count >= udn->udn_allocated) {
+		int	new_size = udn->udn_allocated ? udn->udn_allocated * 2 : 64;
+		char	**new_names;
+
+		new_names = realloc(udn->udn_names, new_size * sizeof(char*));
+		if (!new_names) return(-1);
+		udn->udn_names = new_names;
+		udn->udn_allocated = new_size;
+	}
+	if (!(udn->udn_names[udn->udn_count] = strdup(name))) return(-1);
+	udn->udn_count++;
+	return(0);
+}
+
+static int compare_union_dir_names(const void *a, const void *b)
+{
+	return(strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/* sort the names and drop duplicates */
+static void sort_union_dir_names(struct union_dir_names *udn)
+{
+	int	i, n;
+
+	if (udn->udn_count < 2) return;
+	qsort(udn->udn_names, udn->udn_count, sizeof(char*),
+		compare_union_dir_names);
+	for (i = 1, n = 1; i < udn->udn_count; i++) {
+		if (strcmp(udn->udn_names[i], udn->udn_names[n-1])) {
+			udn->udn_names[n++] = udn->udn_names[i];
+		} else {
+			free(udn->udn_names[i]);
+		}
+	}
+	udn->udn_count = n;
+}
+
+static void free_union_dir_names(struct union_dir_names *udn)
+{
+	int	i;
+
+	for (i = 0; i < udn->udn_count; i++)
+		free(udn->udn_names[i]);
+	if (udn->udn_names) free(udn->udn_names);
+	memset(udn, 0, sizeof(*udn));
+}
+
+/* read all names (except "." and "..") from a directory.
+ * returns -1 if the directory can't be opened */
+static int read_union_dir_names(const char *path, struct union_dir_names *udn)
+{
+	DIR *d;
+	struct dirent *de;
+
+	if ( (d = opendir_nomap_nolog(path)) == NULL )
+		return(-1);
+
+	while ( (de = readdir(d)) != NULL) { /* get one dirent at a time */
+		if (de->d_name[0] == '.') {
+			if (de->d_name[1] == '\0') continue;
+			if ((de->d_name[1] == '.') &&
+			    (de->d_name[2] == '\0')) continue;
+		}
+		if (add_union_dir_name(udn, de->d_name) < 0) {
+			closedir(d);
+			return(-1);
+		}
+	}
+	closedir(d);
+	return(0);
+}
+
+/* mkdir -p "<base>/<rel>". "base" must exist already.
+ * returns 0 if the directory exists when done, -1 if not. */
+static int union_dir_mkdir_p(const char *base, const char *rel)
+{
+	char	*path = NULL;
+	char	*cp;
+	int	ret = 0;
+
+	if (asprintf(&path, "%s/%s", base, rel) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "asprintf failed to allocate memory");
+		return(-1);
+	}
+	cp = path + strlen(base) + 1;
+	do {
+		cp = strchr(cp, '/');
+		if (cp) *cp = '\0'; /* temporarily terminate the string here */
+		SB_LOG(SB_LOGLEVEL_DEBUG, "prep_union_dir: mkdir(%s)", path);
+		if ((mkdir_nomap_nolog(path, 0700) < 0) && (errno != EEXIST)) {
+			SB_LOG(SB_LOGLEVEL_ERROR,
+				"prep_union_dir: mkdir(%s) failed, errno=%d",
+				path, errno);
+			ret = -1;
+			break;
+		}
+		if (cp) *cp++ = '/'; /* restore the slash, if there is more */
+	} while (cp);
+	free(path);
+	return(ret);
+}
+
+/* The "stamp" of a union directory records (dev,ino,size,mtime,ctime)
+ * of every source directory; if it still matches, the directory is
+ * up to date. Stamps are kept in a separate tree
+ * ("uniondirs/stamps/<slash_count>/<dir>"), so that they can't
+ * collide with union directories or their entries.
+ * returns an allocated string, and the newest ctime (seconds) of
+ * the source directories in *newest_ctimep. */
+static char *union_dir_stamp(const char **src_paths, int num_real_dir_entries,
+	time_t *newest_ctimep)
+{
+	char	*stamp = NULL;
+	size_t	stamp_size = 0;
+	FILE	*f;
+	int	i;
+
+	*newest_ctimep = 0;
+	if (!(f = open_memstream(&stamp, &stamp_size))) return(NULL);
+	for (i = 0; i < num_real_dir_entries; i++) {
+		struct stat64	statbuf;
+
+		if (real_stat64(src_paths[i], &statbuf) < 0) {
+			fprintf(f, "-\n");
+		} else {
+			fprintf(f, "%llu %llu %lld %lld.%09ld %lld.%09ld\n",
+				(unsigned long long)statbuf.st_dev,
+				(unsigned long long)statbuf.st_ino,
+				(long long)statbuf.st_size,
+				(long long)statbuf.st_mtim.tv_sec,
+				(long)statbuf.st_mtim.tv_nsec,
+				(long long)statbuf.st_ctim.tv_sec,
+				(long)statbuf.st_ctim.tv_nsec);
+			if (statbuf.st_ctim.tv_sec > *newest_ctimep)
+				*newest_ctimep = statbuf.st_ctim.tv_sec;
+		}
+	}
+	fclose(f);
+	return(stamp);
+}
+
+static int union_dir_stamp_matches(const char *stamp_path, const char *stamp)
+{
+	size_t	len = strlen(stamp);
+	char	*buf;
+	size_t	got = 0;
+	int	fd;
+	ssize_t	r;
+	int	matches;
+
+	fd = open_nomap_nolog(stamp_path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) return(0);
+	/* read one byte more than expected, to catch a longer file */
+	if (!(buf = malloc(len + 1))) {
+		close(fd);
+		return(0);
+	}
+	while (got < len + 1) {
+		r = read(fd, buf + got, len + 1 - got);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) break;
+		got += r;
+	}
+	close(fd);
+	matches = (got == len) && !memcmp(buf, stamp, len);
+	free(buf);
+	return(matches);
+}
+
+static void write_union_dir_stamp(const char *stamp_path, const char *stamp)
+{
+	size_t	len = strlen(stamp);
+	int	fd;
+
+	fd = creat_nomap(stamp_path, 0644);
+	if (fd < 0) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"prep_union_dir: failed to create %s", stamp_path);
+		return;
+	}
+	if (write(fd, stamp, len) != (ssize_t)len) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"prep_union_dir: failed to write %s", stamp_path);
+		close(fd);
+		unlink_nomap_nolog(stamp_path);
+		return;
+	}
+	close(fd);
+}
+
 /* returns an allocated string */
 /* FIXME: This should be somewhere else! it does not belong to this file. */
 char *prep_union_dir(const char *dst_path, const char **src_paths, int num_real_dir_entries)
 {
-	DIR *d = NULL;
-	struct dirent *de;
-	int count = 0;
-	int i;
-	char *udir_name;
+	struct union_dir_names merged;
+	struct union_dir_names existing;
+	int i, j;
 	char *cp;
 	int slash_count = 0;
 	char *mod_dst_path = NULL;
-	char *result_path;
+	char *result_path = NULL;
+	char *uniondirs_path = NULL;
+	char *rel_path = NULL;
+	char *stamp_path = NULL;
+	char *stamp = NULL;
+	time_t newest_ctime;
+	int num_created = 0;
+	int num_removed = 0;
+	int num_failed = 0;
+
+	memset(&merged, 0, sizeof(merged));
+	memset(&existing, 0, sizeof(existing));
 
 	if (num_real_dir_entries < 1) goto error_out;
 
@@ -71,82 +282,140 @@ char *prep_union_dir(const char *dst_path, const char **src_paths, int num_real_
 		if (*cp == '/') slash_count++;
 		cp++;
 	}
-	if (asprintf(&udir_name, "%s/uniondirs/%d", sbox_session_dir, slash_count) < 0)
-		goto asprint_failed_error_out;
-	SB_LOG(SB_LOGLEVEL_DEBUG, "prep_union_dir: mkdir(%s)", udir_name);
-	mkdir_nomap_nolog(udir_name, 0700);
-	free(udir_name);
-	
-	/* this is same as mkdir -p, effectively */
 	cp = mod_dst_path;
 	while(*cp == '/') *cp++ = '@'; /* replace leading slashes */
-	do {
-		if(cp && *cp) {
-			cp = strchr(cp, '/');
-			if (cp) *cp = '\0'; /* temporarily terminate the string here */
-		}
-		if (asprintf(&udir_name, "%s/uniondirs/%d/%s",
-			 sbox_session_dir, slash_count, mod_dst_path) < 0)
-				goto asprint_failed_error_out;
+
+	if (asprintf(&uniondirs_path, "%s/uniondirs", sbox_session_dir) < 0)
+			goto asprint_failed_error_out;
+	if (asprintf(&rel_path, "%d/%s", slash_count, mod_dst_path) < 0)
+			goto asprint_failed_error_out;
+	if (asprintf(&result_path, "%s/%s", uniondirs_path, rel_path) < 0)
+			goto asprint_failed_error_out;
+	if (asprintf(&stamp_path, "%s/stamps/%s", uniondirs_path, rel_path) < 0)
+			goto asprint_failed_error_out;
+
+	/* Nothing to do if the source directories haven't
+	 * changed since the union directory was last built. */
+	stamp = union_dir_stamp(src_paths, num_real_dir_entries, &newest_ctime);
+	if (!stamp) goto asprint_failed_error_out;
+	if (union_dir_stamp_matches(stamp_path, stamp)) {
 		SB_LOG(SB_LOGLEVEL_DEBUG,
-			"prep_union_dir: mkdir(%s)", udir_name);
-		mkdir_nomap_nolog(udir_name, 0700);
-		free(udir_name);
-		if (cp) *cp++ = '/'; /* restore the slash, if there is more */
-	} while(cp);
+			"prep_union_dir: %s is up to date", result_path);
+		goto done;
+	}
 
+	/* Build the merged, deduplicated listing in memory. */
 	for (i = 0; i < num_real_dir_entries; i++) {
-		const char *src_path = src_paths[i];
-
 		SB_LOG(SB_LOGLEVEL_DEBUG,
-			"prep_union_dir: src dir '%s'", src_path);
+			"prep_union_dir: src dir '%s'", src_paths[i]);
+		if (read_union_dir_names(src_paths[i], &merged) < 0)
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"prep_union_dir: can't open '%s'", src_paths[i]);
+	}
+	if (!merged.udn_count) goto error_out;
+	sort_union_dir_names(&merged);
 
-		if ( (d = opendir_nomap_nolog(src_path)) == NULL )
-			continue;
+	if (read_union_dir_names(result_path, &existing) < 0) {
+		/* Not created yet. */
+		if (union_dir_mkdir_p(uniondirs_path, rel_path) < 0)
+			goto error_out;
+	}
+	sort_union_dir_names(&existing);
 
-		SB_LOG(SB_LOGLEVEL_DEBUG,
-			"prep_union_dir: opened src dir '%s'", src_path);
+	/* Compare the merged listing to what has been materialized
+	 * already, and only create/remove the differences. Usually
+	 * nothing needs to be written. */
+	i = j = 0;
+	while ((i < merged.udn_count) || (j < existing.udn_count)) {
+		int	cmp;
+		char	*tmp_name;
+
+		if (i >= merged.udn_count) cmp = 1;
+		else if (j >= existing.udn_count) cmp = -1;
+		else cmp = strcmp(merged.udn_names[i], existing.udn_names[j]);
 
-		while ( (de = readdir(d)) != NULL) { /* get one dirent at a time */
+		if (cmp == 0) {
+			i++; j++;
+			continue;
+		}
+		if (asprintf(&tmp_name, "%s/%s", result_path,
+			(cmp < 0 ? merged.udn_names[i] : existing.udn_names[j])) < 0)
+				goto asprint_failed_error_out;
+		if (cmp < 0) {
 			int fd;
-			char *tmp_name;
 
-			if (de->d_name[0] == '.') {
-				if (de->d_name[1] == '\0') continue;
-				if ((de->d_name[1] == '.') &&
-				    (de->d_name[2] == '\0')) continue;
+			fd = creat_nomap(tmp_name, 0644);
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"prep_union_dir: create %s, fd=%d", tmp_name, fd);
+			if (fd >= 0) {
+				close(fd);
+				num_created++;
+			} else {
+				num_failed++;
 			}
-			if (asprintf(&tmp_name, "%s/uniondirs/%d/%s/%s",
-				sbox_session_dir, slash_count,
-				mod_dst_path, de->d_name) < 0) {
-					closedir(d);
-					goto asprint_failed_error_out;
-				}
+			i++;
+		} else {
+			/* gone from all source directories */
 			SB_LOG(SB_LOGLEVEL_DEBUG,
-				"prep_union_dir: tmp=%s", tmp_name);
+				"prep_union_dir: remove %s", tmp_name);
+			if ((unlink_nomap_nolog(tmp_name) < 0) && (errno != ENOENT))
+				num_failed++;
+			else
+				num_removed++;
+			j++;
+		}
+		free(tmp_name);
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"prep_union_dir: %d entries, %d created, %d removed, %d failed",
+		merged.udn_count, num_created, num_removed, num_failed);
 
-			fd = creat_nomap(tmp_name, 0644);
-			SB_LOG(SB_LOGLEVEL_DEBUG,
-				"prep_union_dir: fd=%d", fd);
-			close(fd);
+	/* Don't record the stamp if something failed (the next call
+	 * will try again), or if a source directory has been modified
+	 * so recently that a later change might not be visible in the
+	 * timestamps (the same clock tick). */
+	if (num_failed) {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"prep_union_dir: failed to update %d entries of %s",
+			num_failed, result_path);
+		unlink_nomap_nolog(stamp_path);
+	} else if (newest_ctime >= time(NULL) - 1) {
+		unlink_nomap_nolog(stamp_path);
+	} else {
+		char	*stamp_dir = strdup(rel_path);
+		char	*slash = stamp_dir ? strrchr(stamp_dir, '/') : NULL;
+		char	*stamps_path = NULL;
 
-			free(tmp_name);
-			count++;
-		}
-		closedir(d);
+		if (slash) *slash = '\0';
+		if (slash &&
+		    (asprintf(&stamps_path, "%s/stamps", uniondirs_path) >= 0) &&
+		    (union_dir_mkdir_p(uniondirs_path, "stamps") == 0) &&
+		    (union_dir_mkdir_p(stamps_path, stamp_dir) == 0))
+			write_union_dir_stamp(stamp_path, stamp);
+		free(stamps_path);
+		free(stamp_dir);
 	}
-	if (!count) goto error_out;
 
-	if (asprintf(&result_path, "%s/uniondirs/%d/%s",
-		sbox_session_dir, slash_count, mod_dst_path) < 0)
-			goto asprint_failed_error_out;
+    done:
+	free_union_dir_names(&merged);
+	free_union_dir_names(&existing);
 	free(mod_dst_path);
+	free(uniondirs_path);
+	free(rel_path);
+	free(stamp_path);
+	free(stamp);
 	return result_path;
 
     asprint_failed_error_out:
 	SB_LOG(SB_LOGLEVEL_ERROR, "asprintf failed to allocate memory");
     error_out:
+	free_union_dir_names(&merged);
+	free_union_dir_names(&existing);
 	if(mod_dst_path) free(mod_dst_path);
+	if(uniondirs_path) free(uniondirs_path);
+	if(rel_path) free(rel_path);
+	if(result_path) free(result_path);
+	if(stamp_path) free(stamp_path);
+	if(stamp) free(stamp);
 	return NULL;
 }
-
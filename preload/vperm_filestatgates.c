@@ -56,9 +56,14 @@ static void vperm_clear_all_if_virtualized(
 {
 	ruletree_inodestat_handle_t	handle;
 	inodesimu_t			istat_struct;
+	int				found;
 
 	ruletree_init_inodestat_handle(&handle, statbuf->st_dev, statbuf->st_ino);
-	if (ruletree_find_inodestat(&handle, &istat_struct) == 0) {
+	found = ruletree_inodestat_may_exist(&handle) &&
+		(ruletree_find_inodestat(&handle, &istat_struct) == 0);
+	found = ruletree_rpc__vperm_apply_queued_updates(statbuf->st_dev,
+		statbuf->st_ino, &istat_struct, found);
+	if (found) {
 		/* vperms exist for this inode */
 		if (istat_struct.inodesimu_active_fields != 0) {
 			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: clear dev=%llu ino=%llu", 
@@ -321,8 +326,8 @@ static void vperm_chown(
 	}
 
 	if (set_uid || set_gid) {
-		ruletree_rpc__vperm_set_ids((uint64_t)statbuf->st_dev,
-			(uint64_t)statbuf->st_ino, set_uid, owner, set_gid, group);
+		ruletree_rpc__vperm_set_ids(statbuf,
+			set_uid, owner, set_gid, group);
 	}
 	if (release_uid || release_gid) {
 		ruletree_rpc__vperm_release_ids((uint64_t)statbuf->st_dev,
@@ -516,8 +521,7 @@ static void vperm_chmod(
 	if (((statbuf->st_mode & ~(S_IFMT | S_ISUID | S_ISGID)) !=
 		    (virt_mode & ~(S_IFMT | S_ISUID | S_ISGID))) ||
 	    ((statbuf->st_mode & (S_ISUID | S_ISGID)) != suid_sgid_bits))
-		ruletree_rpc__vperm_set_mode((uint64_t)statbuf->st_dev,
-			(uint64_t)statbuf->st_ino, statbuf->st_mode,
+		ruletree_rpc__vperm_set_mode(statbuf,
 			virt_mode & ~(S_IFMT | S_ISUID | S_ISGID),
 			suid_sgid_bits & (S_ISUID | S_ISGID));
 	else
@@ -534,11 +538,19 @@ static int vperm_chmod_if_simulated_device(
 {
 	ruletree_inodestat_handle_t	handle;
 	inodesimu_t			istat_struct;
+	int				found;
 
 	ruletree_init_inodestat_handle(&handle, statbuf->st_dev, statbuf->st_ino);
-	if (ruletree_find_inodestat(&handle, &istat_struct) == 0) {
+	found = ruletree_inodestat_may_exist(&handle) &&
+		(ruletree_find_inodestat(&handle, &istat_struct) == 0);
+	found = ruletree_rpc__vperm_apply_queued_updates(statbuf->st_dev,
+		statbuf->st_ino, &istat_struct, found);
+	if (found) {
 		/* vperms exist for this inode */
-		if (istat_struct.inodesimu_active_fields & RULETREE_INODESTAT_SIM_DEVNODE) {
+		if ((istat_struct.inodesimu_active_fields & RULETREE_INODESTAT_SIM_DEVNODE) &&
+		    !ruletree_inodestat_is_stale(&istat_struct, statbuf->st_mode,
+			statbuf->st_ctim.tv_sec, statbuf->st_ctim.tv_nsec,
+			statbuf->st_size)) {
 			/* A simulated device; never set real mode for this,
 			 * real mode is 0000 intentionally.  */
 			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: set mode of simulated device", __func__);
@@ -844,8 +856,7 @@ static int vperm_mknod(
 	res = real_fstat64(dummy_dev_fd, &statbuf);
 	close_nomap_nolog(dummy_dev_fd);
 	if (res == 0) {
-		ruletree_rpc__vperm_set_dev_node((uint64_t)statbuf.st_dev,
-			(uint64_t)statbuf.st_ino, mode, (uint64_t)dev);
+		ruletree_rpc__vperm_set_dev_node(&statbuf, mode, (uint64_t)dev);
 	} else {
 		*result_errno_ptr = EPERM;
 		res = -1;
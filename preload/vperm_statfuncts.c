@@ -16,6 +16,7 @@
 #include <sb2_stat.h>
 #include <sb2_vperm.h>
 #include <rule_tree.h>
+#include <rule_tree_rpc.h>
 
 #include "libsb2.h"
 #include "exported.h"
@@ -133,22 +134,71 @@ static int i_virtualize_struct_stat_internal(
 	inodesimu_t      		istat_in_db;
 	uid_t				uf_uid;
 	gid_t				uf_gid;
+	mode_t				real_mode;
+	int64_t				real_ctime_sec;
+	uint32_t			real_ctime_nsec;
+	uint64_t			real_size;
+	int				found = 0;
 
 	ruletree_clear_inodestat_handle(&handle);
 	if (buf) {
 		ruletree_init_inodestat_handle(&handle, buf->st_dev, buf->st_ino);
+		real_mode = buf->st_mode;
+		real_ctime_sec = buf->st_ctim.tv_sec;
+		real_ctime_nsec = buf->st_ctim.tv_nsec;
+		real_size = buf->st_size;
 #ifdef HAVE_STATX
 	} else if (bufx) {
 		ruletree_init_inodestat_handle(&handle,
 			gnu_dev_makedev(bufx->stx_dev_major, bufx->stx_dev_minor),
 			bufx->stx_ino);
+		real_mode = bufx->stx_mode;
+		real_ctime_sec = bufx->stx_ctime.tv_sec;
+		real_ctime_nsec = bufx->stx_ctime.tv_nsec;
+		real_size = bufx->stx_size;
 #endif
 	} else {
 		ruletree_init_inodestat_handle(&handle, buf64->st_dev, buf64->st_ino);
+		real_mode = buf64->st_mode;
+		real_ctime_sec = buf64->st_ctim.tv_sec;
+		real_ctime_nsec = buf64->st_ctim.tv_nsec;
+		real_size = buf64->st_size;
 	}
 
-	if ((get_vperm_num_active_inodestats() > 0) &&
-	    (ruletree_find_inodestat(&handle, &istat_in_db) == 0)) {
+	if (get_vperm_num_active_inodestats() > 0) {
+		found = ruletree_inodestat_may_exist(&handle) &&
+			(ruletree_find_inodestat(&handle, &istat_in_db) == 0);
+		/* this process' own updates may still be in the queue */
+		found = ruletree_rpc__vperm_apply_queued_updates(
+			handle.rfh_dev, handle.rfh_ino, &istat_in_db, found);
+	}
+
+	if (found && ruletree_inodestat_is_stale(&istat_in_db, real_mode,
+			real_ctime_sec, real_ctime_nsec, real_size)) {
+		/* The inode has been reused or the file has been
+		 * modified outside of SB2 (this happens if the
+		 * inodestats were loaded from a snapshot) */
+		SB_LOG(SB_LOGLEVEL_NOTICE,
+			"%s/%s: stale inodestats (dev=%llu ino=%llu), cleared",
+			realfnname, __func__,
+			(unsigned long long)handle.rfh_dev,
+			(unsigned long long)handle.rfh_ino);
+		if (istat_in_db.inodesimu_active_fields != 0)
+			ruletree_rpc__vperm_clear(handle.rfh_dev, handle.rfh_ino);
+		found = 0;
+	} else if (found && (istat_in_db.inodesimu_active_fields != 0) &&
+		   ((istat_in_db.inodesimu_flags & RULETREE_INODESTAT_FLAG_RESTORED) ||
+		    !ruletree_inodestat_matches_real_id(&istat_in_db,
+			real_ctime_sec, real_ctime_nsec, real_size))) {
+		/* Verified a restored entry, or the file has been
+		 * modified in this session: Record the current
+		 * identity, so that the next session can recognize
+		 * the file. */
+		ruletree_rpc__vperm_set_real_id(handle.rfh_dev, handle.rfh_ino,
+			real_ctime_sec, real_ctime_nsec, real_size);
+	}
+
+	if (found) {
 		int set_uid_gid_of_unknown = vperm_set_owner_and_group_of_unknown_files(
 			&uf_uid, &uf_gid);
 
@@ -47,7 +47,9 @@ static struct vperm_uids_gids_s {
 	gid_t	v_unknown_file_group;
 
 	int	v_simulate_root_fs_permissions;
-} vperm_simulated_ids = {0, 0,0,0,0, 0,0,0,0, 0,0,0, 1};
+
+	int	v_write_behind_updates;
+} vperm_simulated_ids = {0, 0,0,0,0, 0,0,0,0, 0,0,0, 1, 0};
 
 static uid_t	v_real_euid = 0;
 static uid_t	v_real_egid = 0;
@@ -111,6 +113,12 @@ static void initialize_simulated_ids(void)
 		vperm_simulated_ids.v_simulate_root_fs_permissions = 0;
 	}
 
+	if (sbox_vperm_ids && (cp = strchr(sbox_vperm_ids, 'w'))) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: write-behind vperm updates",
+			__func__);
+		vperm_simulated_ids.v_write_behind_updates = 1;
+	}
+
 	vperm_simulated_ids.initialized = 1;
 }
 
@@ -157,6 +165,15 @@ int vperm_simulate_root_fs_permissions(void)
 	return(vperm_simulated_ids.v_simulate_root_fs_permissions);
 }
 
+/* nonzero if queued vperm updates don't need to be sent to sb2d
+ * before this process reads inodestats (see rule_tree_rpc_client.c) */
+int vperm_write_behind_updates(void)
+{
+	if (vperm_simulated_ids.initialized == 0)
+		initialize_simulated_ids();
+	return(vperm_simulated_ids.v_write_behind_updates);
+}
+
 int vperm_set_owner_and_group_of_unknown_files(uid_t *uidp, gid_t *gidp)
 {
 	if (uidp) *uidp = vperm_simulated_ids.v_unknown_file_owner;
@@ -189,7 +206,11 @@ char *vperm_export_ids_as_string_for_exec(const char *prefix,
 		 * (usually set from our "fakeroot" wrapper) */
 		const char *cp = strchr(user_vperm_request, '=');
 		cp = cp ? cp + 1 : user_vperm_request;
-		if (asprintf(&r, "%s%s", prefix, cp) < 0) return(NULL);
+		/* the write-behind mode is inherited, like in the
+		 * packed IDs below */
+		if (asprintf(&r, "%s%s%s", prefix, cp,
+		     ((vperm_simulated_ids.v_write_behind_updates &&
+		       !strchr(cp, 'w')) ? ",w" : "")) < 0) return(NULL);
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: user_vperm_request => '%s'",
 			__func__, r);
 		return(r);
@@ -216,7 +237,7 @@ char *vperm_export_ids_as_string_for_exec(const char *prefix,
 		ufbuf[0] = '\0';
 	}
 
-	if (asprintf(&r, "%su%d:%d:%d:%d,g%d:%d:%d:%d%s%s", prefix,
+	if (asprintf(&r, "%su%d:%d:%d:%d,g%d:%d:%d:%d%s%s%s", prefix,
 	     (int)vperm_simulated_ids.v_uid,
 	     (int)exec_euid,
 	     (int)new_saveduid,
@@ -226,7 +247,8 @@ char *vperm_export_ids_as_string_for_exec(const char *prefix,
 	     (int)new_savedgid,
 	     (int)vperm_simulated_ids.v_fsgid, /* FIXME: Is this ok or wrong? */
 	     ufbuf,
-	     ((vperm_simulated_ids.v_simulate_root_fs_permissions == 0) ? ",p" : "")) < 0)
+	     ((vperm_simulated_ids.v_simulate_root_fs_permissions == 0) ? ",p" : ""),
+	     (vperm_simulated_ids.v_write_behind_updates ? ",w" : "")) < 0)
 		return(NULL);
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: packed IDs => '%s'",
 		__func__, r);
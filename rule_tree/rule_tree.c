@@ -47,7 +47,14 @@ static struct ruletree_cxt_s {
 	int		rtree_ruletree_fd;
 	void		*rtree_ruletree_ptr;
 	ruletree_hdr_t	*rtree_ruletree_hdr_p;
-} ruletree_ctx = { NULL, -1, 0, NULL };
+
+	/* Clients: the rule tree file is kept open (read-only use,
+	 * close-on-exec) and passed to exec'd programs, see
+	 * ruletree_get_exec_fd_env_var() */
+	int		rtree_exec_fd;
+	uint64_t	rtree_exec_fd_dev;
+	uint64_t	rtree_exec_fd_ino;
+} ruletree_ctx = { NULL, -1, 0, NULL, -1, 0, 0 };
 
 /* =================== Rule tree primitives. =================== */
 
@@ -133,7 +140,8 @@ static int mmap_ruletree(ruletree_hdr_t *hdr)
 		PROT_READ | PROT_WRITE, MAP_SHARED,
 		ruletree_ctx.rtree_ruletree_fd, 0);
 
-	if (!ruletree_ctx.rtree_ruletree_ptr) {
+	if (ruletree_ctx.rtree_ruletree_ptr == MAP_FAILED) {
+		ruletree_ctx.rtree_ruletree_ptr = NULL;
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"Failed to mmap() ruletree");
 		return(-1);
@@ -200,6 +208,28 @@ int ruletree_get_min_client_socket_fd(void)
 	return(0);
 }
 
+/* For clients: keep the rule tree file open for exec'd programs,
+ * above the fds that applications normally use. */
+static void keep_ruletree_fd_for_exec(int fd)
+{
+	struct stat	sb;
+	int		min_fd = ruletree_get_min_client_socket_fd();
+
+	if ((min_fd > 0) && (fd < min_fd)) {
+		int new_fd = fcntl(fd, F_DUPFD_CLOEXEC, (long)min_fd);
+
+		close(fd);
+		fd = new_fd;
+	}
+	if ((fd < 0) || (fstat(fd, &sb) < 0)) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+	ruletree_ctx.rtree_exec_fd = fd;
+	ruletree_ctx.rtree_exec_fd_dev = sb.st_dev;
+	ruletree_ctx.rtree_exec_fd_ino = sb.st_ino;
+}
+
 /* For clients:
  * Attach the rule tree = map it to our memoryspace.
  * returns -1 if error, 0 if attached
@@ -232,15 +262,117 @@ int attach_ruletree(const char *ruletree_path, int keep_open)
 	if (mmap_ruletree(&hdr) < 0) return(-1);
 
 	if (!keep_open) {
-		close(ruletree_ctx.rtree_ruletree_fd);
+		keep_ruletree_fd_for_exec(ruletree_ctx.rtree_ruletree_fd);
 		ruletree_ctx.rtree_ruletree_fd = -1;
-		SB_LOG(SB_LOGLEVEL_DEBUG, "rule tree file has been closed.");
+		SB_LOG(SB_LOGLEVEL_DEBUG, "rule tree file is not writable.");
 	}
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "attach_ruletree() => OK");
 	return(0);
 }
 
+/* For clients:
+ * Attach the rule tree that was inherited from the process that
+ * executed this program: "fd_info" is the value of __SB2_RULETREE_FD,
+ * "fd,dev,ino,max_size,min_mmap_addr". The file is already open and
+ * the header values are known, so open() and read() are not needed.
+ * The fd is used only if it still refers to the same file.
+ * returns -1 if error, 0 if attached
+*/
+int attach_inherited_ruletree(const char *ruletree_path, const char *fd_info)
+{
+	ruletree_hdr_t		hdr;
+	int			fd;
+	unsigned long long	dev, ino, min_mmap_addr;
+	unsigned int		max_size;
+	struct stat		sb;
+
+	if (!ruletree_path || !fd_info) return(-1);
+	if (sscanf(fd_info, "%d,%llu,%llu,%u,%llx", &fd, &dev, &ino,
+	    &max_size, &min_mmap_addr) != 5) return(-1);
+	if ((fd < 0) || (fstat(fd, &sb) < 0) || !S_ISREG(sb.st_mode) ||
+	    ((uint64_t)sb.st_dev != dev) || ((uint64_t)sb.st_ino != ino)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"attach_inherited_ruletree: fd %d is not valid", fd);
+		return(-1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.rtree_max_size = max_size;
+	hdr.rtree_min_mmap_addr = min_mmap_addr;
+	ruletree_ctx.rtree_ruletree_fd = fd;
+	if ((mmap_ruletree(&hdr) < 0) ||
+	    (ruletree_ctx.rtree_ruletree_hdr_p->rtree_version != RULE_TREE_VERSION)) {
+		if (ruletree_ctx.rtree_ruletree_ptr)
+			munmap(ruletree_ctx.rtree_ruletree_ptr, max_size);
+		ruletree_ctx.rtree_ruletree_ptr = NULL;
+		ruletree_ctx.rtree_ruletree_hdr_p = NULL;
+		ruletree_ctx.rtree_ruletree_fd = -1;
+		return(-1);
+	}
+	ruletree_ctx.rtree_ruletree_fd = -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ruletree_ctx.rtree_exec_fd = fd;
+	ruletree_ctx.rtree_exec_fd_dev = dev;
+	ruletree_ctx.rtree_exec_fd_ino = ino;
+	ruletree_ctx.rtree_ruletree_path = strdup(ruletree_path);
+
+	SB_LOG(SB_LOGLEVEL_DEBUG, "attach_inherited_ruletree(%d) => OK", fd);
+	return(0);
+}
+
+/* For clients:
+ * Returns "__SB2_RULETREE_FD=..." for the environment of a program
+ * that is going to be executed, or NULL if the rule tree fd is not
+ * available (the application may have closed it). The string is
+ * allocated with "asprintf_fn" (exec_asprintf() in libsb2, so that
+ * it is released with the rest of the exec arena). See also
+ * ruletree_set_exec_fd_inheritable().
+*/
+char *ruletree_get_exec_fd_env_var(
+	int (*asprintf_fn)(char **strp, const char *fmt, ...))
+{
+	struct stat	sb;
+	char		*var = NULL;
+
+	if ((ruletree_ctx.rtree_exec_fd < 0) || !ruletree_ctx.rtree_ruletree_hdr_p)
+		return(NULL);
+	if ((fstat(ruletree_ctx.rtree_exec_fd, &sb) < 0) ||
+	    ((uint64_t)sb.st_dev != ruletree_ctx.rtree_exec_fd_dev) ||
+	    ((uint64_t)sb.st_ino != ruletree_ctx.rtree_exec_fd_ino)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"rule tree fd %d has been closed by the application",
+			ruletree_ctx.rtree_exec_fd);
+		ruletree_ctx.rtree_exec_fd = -1;
+		return(NULL);
+	}
+	if ((*asprintf_fn)(&var, "__SB2_RULETREE_FD=%d,%llu,%llu,%u,%llx",
+		ruletree_ctx.rtree_exec_fd,
+		(unsigned long long)ruletree_ctx.rtree_exec_fd_dev,
+		(unsigned long long)ruletree_ctx.rtree_exec_fd_ino,
+		ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size,
+		(unsigned long long)ruletree_ctx.rtree_ruletree_hdr_p->rtree_min_mmap_addr) < 0)
+		return(NULL);
+	return(var);
+}
+
+/* For clients: the fd that ruletree_get_exec_fd_env_var() refers to,
+ * or -1 */
+int ruletree_get_exec_fd(void)
+{
+	return(ruletree_ctx.rtree_exec_fd);
+}
+
+/* For clients: clear close-on-exec flag of the rule tree fd
+ * just before exec, and set it again if exec failed.
+ * This affects all threads of the process; don't use it for
+ * posix_spawn(), see sb_next_posix_spawn(). */
+void ruletree_set_exec_fd_inheritable(int inheritable)
+{
+	if (ruletree_ctx.rtree_exec_fd < 0) return;
+	fcntl(ruletree_ctx.rtree_exec_fd, F_SETFD, (inheritable ? 0 : FD_CLOEXEC));
+}
+
 /* =================== ints and booleans =================== */
 
 static uint32_t *ruletree_get_pointer_to_uint32_or_boolean(
@@ -345,6 +477,25 @@ ruletree_object_offset_t append_string_to_ruletree_file(const char *str)
 	return(location);
 }
 
+/* String hash for hashed indexes (32-bit FNV-1a). Indexes are
+ * created by sb2d and used by clients, so this must never change
+ * without changing RULE_TREE_VERSION. */
+uint32_t ruletree_string_hash_n(const char *str, size_t len)
+{
+	uint32_t	h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619U;
+	}
+	return(h);
+}
+
+uint32_t ruletree_string_hash(const char *str)
+{
+	return(ruletree_string_hash_n(str, strlen(str)));
+}
+
 /* =================== lists =================== */
 
 ruletree_object_offset_t ruletree_objectlist_create_list(uint32_t size)
@@ -431,6 +582,276 @@ uint32_t ruletree_objectlist_get_list_size(
 	return (listhdr->rtree_olist_size);
 }
 
+/* =================== bloom filters =================== */
+
+#define RULETREE_BLOOMFILTER_NUM_HASHES	3
+
+ruletree_object_offset_t ruletree_bloomfilter_create(uint32_t num_bits)
+{
+	ruletree_object_offset_t	location = 0;
+	ruletree_bloomfilter_t		bfhdr;
+	uint32_t			*a;
+	size_t				size_in_bytes;
+	ssize_t				wr_result;
+
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return (0);
+	if (ruletree_ctx.rtree_ruletree_fd < 0) return(0);
+
+	/* round up to a power of two, min. one word */
+	bfhdr.rtree_bf_num_bits = 32;
+	while (bfhdr.rtree_bf_num_bits < num_bits)
+		bfhdr.rtree_bf_num_bits <<= 1;
+
+	/* "append_struct_to_ruletree_file" will fill the magic & type */
+	location = append_struct_to_ruletree_file(&bfhdr, sizeof(bfhdr),
+		SB2_RULETREE_OBJECT_TYPE_BLOOMFILTER);
+	size_in_bytes = bfhdr.rtree_bf_num_bits / 8;
+	a = calloc(1, size_in_bytes);
+	wr_result = write(ruletree_ctx.rtree_ruletree_fd, a, size_in_bytes);
+	free(a);
+	if ((wr_result == -1) || ((size_t)wr_result < size_in_bytes)) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"Failed to append a bloom filter (%d bytes) to the rule tree",
+			(int)size_in_bytes);
+		location = 0; /* return error */
+	}
+	if (ruletree_ctx.rtree_ruletree_hdr_p)
+		ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size =
+			lseek(ruletree_ctx.rtree_ruletree_fd, 0, SEEK_END);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s(%u): location=%d", __func__,
+		bfhdr.rtree_bf_num_bits, location);
+	return(location);
+}
+
+/* 64-bit mixing function ("splitmix64" finalizer) */
+static uint64_t bloomfilter_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return(x);
+}
+
+/* Bit indexes are derived from two hash values
+ * (h1 + i*h2, "double hashing") */
+static void bloomfilter_hashes(uint64_t key1, uint64_t key2,
+	uint32_t *h1p, uint32_t *h2p)
+{
+	uint64_t	h = bloomfilter_mix(key1 ^ bloomfilter_mix(key2));
+
+	*h1p = (uint32_t)h;
+	*h2p = (uint32_t)(h >> 32) | 1;
+}
+
+static uint32_t *bloomfilter_bits(ruletree_object_offset_t bf_offs,
+	uint32_t *maskp)
+{
+	ruletree_bloomfilter_t	*bfhdr;
+
+	bfhdr = offset_to_ruletree_object_ptr(bf_offs,
+		SB2_RULETREE_OBJECT_TYPE_BLOOMFILTER);
+	if (!bfhdr) return(NULL);
+	*maskp = bfhdr->rtree_bf_num_bits - 1;
+	return((uint32_t*)((char*)bfhdr + sizeof(*bfhdr)));
+}
+
+void ruletree_bloomfilter_add(ruletree_object_offset_t bf_offs,
+	uint64_t key1, uint64_t key2)
+{
+	volatile uint32_t	*bits;
+	uint32_t	mask;
+	uint32_t	h1, h2;
+	int		i;
+
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return;
+	bits = bloomfilter_bits(bf_offs, &mask);
+	if (!bits) return;
+	bloomfilter_hashes(key1, key2, &h1, &h2);
+	for (i = 0; i < RULETREE_BLOOMFILTER_NUM_HASHES; i++) {
+		uint32_t bitnum = (h1 + i * h2) & mask;
+
+		bits[bitnum >> 5] |= (1U << (bitnum & 31));
+	}
+}
+
+/* returns 0 if (key1,key2) has definitely not been added to
+ * the filter, 1 if it may have been added. */
+int ruletree_bloomfilter_test(ruletree_object_offset_t bf_offs,
+	uint64_t key1, uint64_t key2)
+{
+	volatile uint32_t	*bits;
+	uint32_t	mask;
+	uint32_t	h1, h2;
+	int		i;
+
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return(1);
+	bits = bloomfilter_bits(bf_offs, &mask);
+	if (!bits) return(1);
+	bloomfilter_hashes(key1, key2, &h1, &h2);
+	for (i = 0; i < RULETREE_BLOOMFILTER_NUM_HASHES; i++) {
+		uint32_t bitnum = (h1 + i * h2) & mask;
+
+		if (!(bits[bitnum >> 5] & (1U << (bitnum & 31))))
+			return(0);
+	}
+	return(1);
+}
+
+/* =================== binary info cache =================== */
+
+ruletree_object_offset_t ruletree_binary_info_cache_create(uint32_t num_entries)
+{
+	ruletree_object_offset_t	location = 0;
+	ruletree_binary_info_cache_t	bichdr;
+	void				*a;
+	size_t				size_in_bytes;
+	ssize_t				wr_result;
+
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return (0);
+	if (ruletree_ctx.rtree_ruletree_fd < 0) return(0);
+
+	/* round up to a power of two, min. one set */
+	bichdr.rtree_bic_num_entries = RULETREE_BINARY_INFO_CACHE_WAYS;
+	while (bichdr.rtree_bic_num_entries < num_entries)
+		bichdr.rtree_bic_num_entries <<= 1;
+
+	/* "append_struct_to_ruletree_file" will fill the magic & type */
+	location = append_struct_to_ruletree_file(&bichdr, sizeof(bichdr),
+		SB2_RULETREE_OBJECT_TYPE_BINARY_INFO_CACHE);
+	size_in_bytes = bichdr.rtree_bic_num_entries *
+		sizeof(ruletree_binary_info_cache_entry_t);
+	a = calloc(1, size_in_bytes);
+	wr_result = write(ruletree_ctx.rtree_ruletree_fd, a, size_in_bytes);
+	free(a);
+	if ((wr_result == -1) || ((size_t)wr_result < size_in_bytes)) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"Failed to append a binary info cache (%d bytes) to the rule tree",
+			(int)size_in_bytes);
+		location = 0; /* return error */
+	}
+	if (ruletree_ctx.rtree_ruletree_hdr_p)
+		ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size =
+			lseek(ruletree_ctx.rtree_ruletree_fd, 0, SEEK_END);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s(%u): location=%d", __func__,
+		bichdr.rtree_bic_num_entries, location);
+	return(location);
+}
+
+static ruletree_object_offset_t	binary_info_cache = 0;
+
+/* returns a pointer to the first entry of the set where the key belongs */
+static ruletree_binary_info_cache_entry_t *binary_info_cache_set(
+	const ruletree_binary_info_cache_entry_t *key)
+{
+	ruletree_binary_info_cache_t	*bichdr;
+	uint32_t	num_sets;
+	uint32_t	set;
+
+	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return(NULL);
+
+	if (!binary_info_cache) {
+		binary_info_cache = ruletree_catalog_get(
+			"exec", "binary_info_cache");
+		if (!binary_info_cache) return(NULL);
+	}
+	bichdr = offset_to_ruletree_object_ptr(binary_info_cache,
+		SB2_RULETREE_OBJECT_TYPE_BINARY_INFO_CACHE);
+	if (!bichdr) return(NULL);
+	num_sets = bichdr->rtree_bic_num_entries /
+		RULETREE_BINARY_INFO_CACHE_WAYS;
+	set = (uint32_t)bloomfilter_mix(key->rbic_ino ^
+		bloomfilter_mix(key->rbic_dev)) & (num_sets - 1);
+	return((ruletree_binary_info_cache_entry_t*)((char*)bichdr +
+		sizeof(*bichdr)) + set * RULETREE_BINARY_INFO_CACHE_WAYS);
+}
+
+static int binary_info_cache_key_matches(
+	const ruletree_binary_info_cache_entry_t *a,
+	const ruletree_binary_info_cache_entry_t *b)
+{
+	return ((a->rbic_dev == b->rbic_dev) &&
+		(a->rbic_ino == b->rbic_ino) &&
+		(a->rbic_size == b->rbic_size) &&
+		(a->rbic_mtime_sec == b->rbic_mtime_sec) &&
+		(a->rbic_mtime_nsec == b->rbic_mtime_nsec) &&
+		(a->rbic_ctime_sec == b->rbic_ctime_sec) &&
+		(a->rbic_ctime_nsec == b->rbic_ctime_nsec));
+}
+
+/* in: the key fields of "entry".
+ * returns 1 and fills the rest of "entry" if found, 0 if not. */
+int ruletree_binary_info_cache_lookup(ruletree_binary_info_cache_entry_t *entry)
+{
+	ruletree_binary_info_cache_entry_t	*set;
+	ruletree_binary_info_cache_entry_t	copy;
+	int	i;
+
+	set = binary_info_cache_set(entry);
+	if (!set) return(0);
+
+	for (i = 0; i < RULETREE_BINARY_INFO_CACHE_WAYS; i++) {
+		uint32_t seq = __atomic_load_n(&set[i].rbic_seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1) continue; /* being updated */
+		memcpy(&copy, &set[i], sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&set[i].rbic_seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if (!copy.rbic_type) continue;
+		if (!binary_info_cache_key_matches(&copy, entry)) continue;
+
+		copy.rbic_pt_interp[sizeof(copy.rbic_pt_interp)-1] = '\0';
+		*entry = copy;
+		SB_LOG(SB_LOGLEVEL_NOISE, "%s: dev=%llu,ino=%llu found",
+			__func__, (unsigned long long)entry->rbic_dev,
+			(unsigned long long)entry->rbic_ino);
+		return(1);
+	}
+	return(0);
+}
+
+/* Add or replace an entry. Replaces an old version of the same file,
+ * or a free entry, or some entry of the set. If another process is
+ * updating the same entry, this one is silently dropped. */
+void ruletree_binary_info_cache_store(
+	const ruletree_binary_info_cache_entry_t *entry)
+{
+	ruletree_binary_info_cache_entry_t	*set;
+	ruletree_binary_info_cache_entry_t	*e = NULL;
+	uint32_t	seq;
+	int	i;
+
+	set = binary_info_cache_set(entry);
+	if (!set) return;
+
+	for (i = 0; i < RULETREE_BINARY_INFO_CACHE_WAYS; i++) {
+		if ((set[i].rbic_dev == entry->rbic_dev) &&
+		    (set[i].rbic_ino == entry->rbic_ino)) {
+			e = &set[i];
+			break;
+		}
+		if (!e && !set[i].rbic_type) e = &set[i];
+	}
+	if (!e) e = &set[entry->rbic_mtime_nsec % RULETREE_BINARY_INFO_CACHE_WAYS];
+
+	seq = __atomic_load_n(&e->rbic_seq, __ATOMIC_RELAXED);
+	if (seq & 1) return;
+	if (!__atomic_compare_exchange_n(&e->rbic_seq, &seq, seq + 1, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((char*)e + sizeof(e->rbic_seq), (const char*)entry +
+		sizeof(entry->rbic_seq), sizeof(*e) - sizeof(e->rbic_seq));
+
+	__atomic_store_n(&e->rbic_seq, seq + 2, __ATOMIC_RELEASE);
+	SB_LOG(SB_LOGLEVEL_NOISE, "%s: dev=%llu,ino=%llu stored",
+		__func__, (unsigned long long)entry->rbic_dev,
+		(unsigned long long)entry->rbic_ino);
+}
+
 /* =================== binary trees =================== */
 
 static ruletree_object_offset_t ruletree_create_bintree_entry(
@@ -640,7 +1061,73 @@ static uint64_t ino_to_key(uint64_t ino)
 	return(k ^ ino);
 }
 
-static ruletree_object_offset_t	inodestats_bintree_root = 0;
+/* The inodestats are stored in one binary tree per device:
+ * "vperm"/"inodestat_devices" is a binary tree keyed by (dev, 0); the
+ * value of each node is the root node of that device's inodestat tree,
+ * keyed by (ino_to_key(ino), dev). Usually there are only a few devices
+ * (target root, build directory, tools..), so the device is found
+ * quickly, and the lookup continues in a tree that only contains
+ * inodes of the same filesystem.
+ * Roots never change after they have been created; that's why they can
+ * be cached without locking. */
+static ruletree_object_offset_t	inodestat_devices_root = 0;
+static ruletree_object_offset_t	inodestats_filter = 0;
+
+static ruletree_object_offset_t get_inodestat_devices_root(void)
+{
+	if (!inodestat_devices_root)
+		inodestat_devices_root = ruletree_catalog_get(
+			"vperm", "inodestat_devices");
+	return(inodestat_devices_root);
+}
+
+/* returns root of the inodestat tree of "dev", or 0. If not found,
+ * *last_visited_node and *last_result tell where the device should
+ * be added. */
+static ruletree_object_offset_t find_inodestat_device_root(uint64_t dev,
+	ruletree_object_offset_t *last_visited_node, int *last_result)
+{
+	ruletree_object_offset_t	node_offs;
+	ruletree_bintree_t		*bintrp;
+
+	if (last_visited_node) *last_visited_node = 0;
+	if (last_result) *last_result = 0;
+	if (!get_inodestat_devices_root()) return(0);
+
+	node_offs = ruletree_find_bintree_entry(dev, 0,
+		inodestat_devices_root, last_visited_node, last_result);
+	if (!node_offs) return(0);
+	bintrp = offset_to_ruletree_object_ptr(node_offs,
+			SB2_RULETREE_OBJECT_TYPE_BINTREE);
+	if (!bintrp) return(0);
+	return(bintrp->rtree_bt_value);
+}
+
+/* "vperm"/"inodestat_filter" is a bloom filter over (dev,ino) of
+ * all inodes that have been added to the inodestats tree. sb2d adds
+ * the keys before the nodes become visible, so if the filter says no,
+ * there is no need to walk the tree.
+ * returns 0 if the inode is known not to have an inodestat node,
+ * 1 if it might have one (or if there is no filter) */
+int ruletree_inodestat_may_exist(
+	const ruletree_inodestat_handle_t *handle)
+{
+	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
+
+	if (!inodestats_filter) {
+		inodestats_filter = ruletree_catalog_get(
+			"vperm", "inodestat_filter");
+		if (!inodestats_filter) return(1);
+	}
+	if (ruletree_bloomfilter_test(inodestats_filter,
+		handle->rfh_ino, handle->rfh_dev)) return(1);
+
+	SB_LOG(SB_LOGLEVEL_NOISE,
+		"%s: dev=%lld,ino=%lld not in filter", __func__,
+			(long long)handle->rfh_dev,
+			(long long)handle->rfh_ino);
+	return(0);
+}
 
 /* in: "handle" contains the keys
  * out: istat_struct has been filled, if a matching node was found.
@@ -665,14 +1152,13 @@ int ruletree_find_inodestat(
 
 	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
 
-	if (!inodestats_bintree_root) {
-		inodestats_bintree_root = ruletree_catalog_get(
-			"vperm", "inodestats");
-		if (!inodestats_bintree_root) return(-1);
-	}
+	handle->rfh_dev_root = find_inodestat_device_root(handle->rfh_dev,
+		NULL, NULL);
+	if (!handle->rfh_dev_root) return(-1);
+
 	handle->rfh_offs = ruletree_find_bintree_entry(
 		ino_to_key(handle->rfh_ino), handle->rfh_dev,
-		inodestats_bintree_root, &handle->rfh_last_visited_node,
+		handle->rfh_dev_root, &handle->rfh_last_visited_node,
 		&handle->rfh_last_result);
 	if (!handle->rfh_offs) return(-1);
 		
@@ -690,9 +1176,9 @@ int ruletree_find_inodestat(
 
 /* set/add a inodestat structure to the binary tree.
  * ruletree_find_inodestat() must be called beforehand to 
- * fill "handle" (unless adding the very first node)
+ * fill "handle" (unless adding the very first node of the device)
  *
- * returns 0 or offset to new binary tree root. */
+ * returns 0 or offset to the new binary tree root of the device. */
 ruletree_object_offset_t ruletree_set_inodestat(
 	ruletree_inodestat_handle_t	*handle,
 	inodesimu_t			*istat_struct)
@@ -727,20 +1213,281 @@ ruletree_object_offset_t ruletree_set_inodestat(
 		return(0);
 	} else {
 		/* Add to the tree. */
-		ruletree_object_offset_t	bt_root;
+		ruletree_object_offset_t	istat_offs;
+		ruletree_object_offset_t	dev_root;
+		ruletree_object_offset_t	dev_node;
+		ruletree_object_offset_t	dt_last_visited_node;
+		int				dt_last_result;
 
 		SB_LOG(SB_LOGLEVEL_NOISE,
 			"ruletree_set_inodestat: add to tree");
-		handle->rfh_offs = ruletree_create_inodestat(istat_struct);
-		bt_root = ruletree_add_to_bintree_entry(handle->rfh_offs,
-			ino_to_key(handle->rfh_ino), handle->rfh_dev,
-			handle->rfh_last_visited_node, handle->rfh_last_result);
-		if (bt_root)
-			ruletree_catalog_set("vperm", "inodestats", bt_root);
-		return (bt_root);
+		if (!inodestats_filter)
+			inodestats_filter = ruletree_catalog_get(
+				"vperm", "inodestat_filter");
+		if (inodestats_filter)
+			ruletree_bloomfilter_add(inodestats_filter,
+				handle->rfh_ino, handle->rfh_dev);
+		istat_offs = ruletree_create_inodestat(istat_struct);
+
+		if (handle->rfh_dev_root) {
+			/* the device already has a tree */
+			ruletree_add_to_bintree_entry(istat_offs,
+				ino_to_key(handle->rfh_ino), handle->rfh_dev,
+				handle->rfh_last_visited_node,
+				handle->rfh_last_result);
+			handle->rfh_offs = istat_offs;
+			return(0);
+		}
+
+		/* First inode of this device: create the tree,
+		 * then make it visible in the device table. */
+		if (find_inodestat_device_root(handle->rfh_dev,
+			&dt_last_visited_node, &dt_last_result)) {
+			SB_LOG(SB_LOGLEVEL_ERROR,
+				"ruletree_set_inodestat: Internal error: "
+				"handle was not initialized");
+			return(0);
+		}
+		dev_root = ruletree_add_to_bintree_entry(istat_offs,
+			ino_to_key(handle->rfh_ino), handle->rfh_dev, 0, 0);
+		if (!dev_root) return(0);
+		dev_node = ruletree_add_to_bintree_entry(dev_root,
+			handle->rfh_dev, 0,
+			dt_last_visited_node, dt_last_result);
+		if (dev_node)
+			ruletree_catalog_set("vperm", "inodestat_devices", dev_node);
+		handle->rfh_offs = istat_offs;
+		handle->rfh_dev_root = dev_root;
+		return (dev_root);
 	}
 }
 
+static int compare_inodestat_keys(const void *a, const void *b)
+{
+	const inodesimu_t	*ia = a;
+	const inodesimu_t	*ib = b;
+	uint64_t		ka = ino_to_key(ia->inodesimu_ino);
+	uint64_t		kb = ino_to_key(ib->inodesimu_ino);
+
+	if (ia->inodesimu_dev != ib->inodesimu_dev)
+		return(ia->inodesimu_dev < ib->inodesimu_dev ? -1 : 1);
+	if (ka != kb) return(ka < kb ? -1 : 1);
+	return(0);
+}
+
+/* Add many inodestat structures at once. The array is sorted, and
+ * the structures of each device are added middle-first, so that the
+ * (unbalanced) binary trees stay balanced when they are built from
+ * scratch. Structures that already exist in the tree are not modified.
+ * Returns number of added structures. */
+uint32_t ruletree_add_inodestats(inodesimu_t *istats, uint32_t num_istats)
+{
+	struct range_s {
+		uint32_t	first;
+		uint32_t	end;
+	} *stack;
+	size_t		sp = 0;
+	uint32_t	num_added = 0;
+	uint32_t	dev_first;
+
+	if (num_istats == 0) return(0);
+	qsort(istats, num_istats, sizeof(*istats), compare_inodestat_keys);
+
+	/* depth of the stack is log2(num_istats) */
+	stack = malloc(64 * sizeof(*stack));
+	if (!stack) return(0);
+
+	for (dev_first = 0; dev_first < num_istats; ) {
+		uint32_t	dev_end = dev_first + 1;
+
+		while ((dev_end < num_istats) &&
+		       (istats[dev_end].inodesimu_dev ==
+			istats[dev_first].inodesimu_dev)) dev_end++;
+
+		stack[sp].first = dev_first;
+		stack[sp].end = dev_end;
+		sp++;
+		while (sp > 0) {
+			ruletree_inodestat_handle_t	handle;
+			inodesimu_t			istat_in_db;
+			uint32_t	first, end, mid;
+
+			sp--;
+			first = stack[sp].first;
+			end = stack[sp].end;
+			mid = first + (end - first) / 2;
+
+			ruletree_init_inodestat_handle(&handle,
+				istats[mid].inodesimu_dev, istats[mid].inodesimu_ino);
+			if (ruletree_find_inodestat(&handle, &istat_in_db) < 0) {
+				ruletree_set_inodestat(&handle, &istats[mid]);
+				num_added++;
+			}
+
+			if (mid + 1 < end) {
+				stack[sp].first = mid + 1;
+				stack[sp].end = end;
+				sp++;
+			}
+			if (first < mid) {
+				stack[sp].first = first;
+				stack[sp].end = mid;
+				sp++;
+			}
+		}
+		dev_first = dev_end;
+	}
+	free(stack);
+	return(num_added);
+}
+
+/* Walk over a binary tree. The trees may be unbalanced, so an
+ * explicit stack is used instead of recursion. Stops if "fn"
+ * returns nonzero; returns that value or 0. */
+static int walk_bintree(ruletree_object_offset_t root,
+	int (*fn)(ruletree_bintree_t *node, uint32_t depth, void *arg),
+	void *arg)
+{
+	struct bt_walk_s {
+		ruletree_object_offset_t	offs;
+		uint32_t			depth;
+	} *stack = NULL;
+	size_t	stack_size = 64;
+	size_t	sp = 0;
+	int	r = 0;
+
+	if (!root) return(0);
+	stack = malloc(stack_size * sizeof(*stack));
+	if (!stack) return(0);
+	stack[sp].offs = root;
+	stack[sp].depth = 1;
+	sp++;
+
+	while (sp > 0) {
+		ruletree_bintree_t	*bintrp;
+		uint32_t		depth;
+
+		sp--;
+		depth = stack[sp].depth;
+		bintrp = offset_to_ruletree_object_ptr(stack[sp].offs,
+				SB2_RULETREE_OBJECT_TYPE_BINTREE);
+		if (!bintrp) continue;
+
+		if ((r = fn(bintrp, depth, arg)) != 0) break;
+
+		if (sp + 2 > stack_size) {
+			struct bt_walk_s *new_stack;
+
+			new_stack = realloc(stack, 2 * stack_size * sizeof(*stack));
+			if (!new_stack) break;
+			stack = new_stack;
+			stack_size *= 2;
+		}
+		if (bintrp->rtree_bt_link_less) {
+			stack[sp].offs = bintrp->rtree_bt_link_less;
+			stack[sp].depth = depth + 1;
+			sp++;
+		}
+		if (bintrp->rtree_bt_link_more) {
+			stack[sp].offs = bintrp->rtree_bt_link_more;
+			stack[sp].depth = depth + 1;
+			sp++;
+		}
+	}
+	free(stack);
+	return(r);
+}
+
+static int usage_stats_inodestat_node(ruletree_bintree_t *node,
+	uint32_t depth, void *arg)
+{
+	ruletree_usage_stats_t	*stats = arg;
+	ruletree_inodestat_t	*fsptr;
+
+	if (depth > stats->rtus_inodestats_max_depth)
+		stats->rtus_inodestats_max_depth = depth;
+	fsptr = offset_to_ruletree_object_ptr(node->rtree_bt_value,
+			SB2_RULETREE_OBJECT_TYPE_INODESTAT);
+	if (fsptr) {
+		if (fsptr->rtree_inode_simu.inodesimu_active_fields)
+			stats->rtus_inodestats_live++;
+		else
+			stats->rtus_inodestats_dead++;
+	}
+	return(0);
+}
+
+static int usage_stats_device_node(ruletree_bintree_t *node,
+	uint32_t depth, void *arg)
+{
+	ruletree_usage_stats_t	*stats = arg;
+
+	(void)depth;
+	stats->rtus_inodestat_devices++;
+	walk_bintree(node->rtree_bt_value, usage_stats_inodestat_node, stats);
+	return(0);
+}
+
+/* Size of the rule tree, and a walk over the inodestats trees.
+ * max_depth is the depth of the deepest per-device tree. */
+void ruletree_get_usage_stats(ruletree_usage_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return;
+
+	stats->rtus_file_size = ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size;
+	stats->rtus_max_size = ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size;
+
+	walk_bintree(get_inodestat_devices_root(),
+		usage_stats_device_node, stats);
+}
+
+struct for_each_inodestat_s {
+	int		(*fn)(const inodesimu_t *istat, void *arg);
+	void		*arg;
+	uint32_t	num_visited;
+};
+
+static int for_each_inodestat_node(ruletree_bintree_t *node,
+	uint32_t depth, void *arg)
+{
+	struct for_each_inodestat_s	*fe = arg;
+	ruletree_inodestat_t		*fsptr;
+
+	(void)depth;
+	fsptr = offset_to_ruletree_object_ptr(node->rtree_bt_value,
+			SB2_RULETREE_OBJECT_TYPE_INODESTAT);
+	if (!fsptr) return(0);
+	fe->num_visited++;
+	return(fe->fn(&fsptr->rtree_inode_simu, fe->arg));
+}
+
+static int for_each_inodestat_device(ruletree_bintree_t *node,
+	uint32_t depth, void *arg)
+{
+	(void)depth;
+	return(walk_bintree(node->rtree_bt_value,
+		for_each_inodestat_node, arg));
+}
+
+/* Walk over all inodestats, one device at a time. */
+uint32_t ruletree_for_each_inodestat(
+	int (*fn)(const inodesimu_t *istat, void *arg), void *arg)
+{
+	struct for_each_inodestat_s	fe;
+
+	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return(0);
+
+	fe.fn = fn;
+	fe.arg = arg;
+	fe.num_visited = 0;
+	walk_bintree(get_inodestat_devices_root(),
+		for_each_inodestat_device, &fe);
+	return(fe.num_visited);
+}
+
 /* =================== catalogs =================== */
 
 static ruletree_object_offset_t ruletree_create_catalog_entry(
@@ -1259,8 +2006,12 @@ int ruletree_to_memory(void)
 			SB_LOG(SB_LOGLEVEL_ERROR,
 				"asprintf failed to create file name for rule tree");
 		} else {
-			attach_result = attach_ruletree(rule_tree_path,
-				0/*keep open*/);
+			if (sbox_inherited_ruletree_fd)
+				attach_result = attach_inherited_ruletree(
+					rule_tree_path, sbox_inherited_ruletree_fd);
+			if (attach_result < 0)
+				attach_result = attach_ruletree(rule_tree_path,
+					0/*keep open*/);
 			SB_LOG(SB_LOGLEVEL_DEBUG, "ruletree_to_memory: attach(%s) = %d",
 				rule_tree_path, attach_result);
 			free(rule_tree_path);
@@ -23,12 +23,21 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #include "mapping.h"
 #include "sb2.h"
 #include "libsb2.h"
 #include "rule_tree.h"
 #include "rule_tree_rpc.h"
+#include "sb2_vperm.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -110,8 +119,10 @@ static void cleanup_client_socket(void)
 
 static int create_client_socket(void)
 {
+#ifndef __linux__
 	socklen_t	client_addr_len;
 	size_t		sock_path_len;
+#endif
 	int		min_fd;
 
 	client_socket = socket(PF_UNIX, SOCK_DGRAM, 0);
@@ -137,6 +148,21 @@ static int create_client_socket(void)
 		}
 	}
 	client_pid = getpid();
+#ifdef __linux__
+	/* Autobind: binding with only the address family makes the kernel
+	 * pick a unique address in the abstract namespace. There is
+	 * nothing in the filesystem to create, chmod or clean up. */
+	memset(&client_address, 0, sizeof(client_address));
+	client_address.sun_family = AF_UNIX;
+	if (bind_nomap_nolog(client_socket, (struct sockaddr*)&client_address,
+		sizeof(sa_family_t)) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"ruletree_rpc: Failed to bind client socket");
+		goto error_out;
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "ruletree_rpc: client socket autobound");
+	return(0);
+#else
 	if (asprintf(&client_socket_path, "%s/sock/%d", sbox_session_dir, (int)client_pid) < 0) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"ruletree_rpc: asprintf failed");
@@ -177,6 +203,7 @@ static int create_client_socket(void)
 	/* client socket has been initialized. */
 	atexit(cleanup_client_socket);
 	return(0);
+#endif
 
    error_out:
 	cleanup_client_socket();
@@ -189,14 +216,209 @@ static int create_client_socket(void)
 */
 static pthread_mutex_t	client_socket_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* ----- shared-memory command queue (see rule_tree_rpc.h) ----- */
+
+static ruletree_cmdq_t	*cmdq = NULL;
+static int		cmdq_status = 0; /* 0 = not tried, 1 = ok, -1 = not available */
+
+#ifdef __linux__
+static int cmdq_futex_wait(volatile uint32_t *addr, uint32_t val, int timeout_sec)
+{
+	struct timespec	ts;
+
+	ts.tv_sec = timeout_sec;
+	ts.tv_nsec = 0;
+	return(syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0));
+}
+
+static void cmdq_futex_wake(volatile uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* called with client_socket_mutex locked */
+static void attach_cmdq(void)
+{
+	char		*path = NULL;
+	int		fd;
+	void		*p;
+	ruletree_cmdq_t	*q;
+
+	cmdq_status = -1;
+	if (!sbox_session_dir) return;
+	if (asprintf(&path, "%s/sb2d-cmdq", sbox_session_dir) < 0) return;
+	fd = open_nomap_nolog(path, O_CLOEXEC | O_RDWR);
+	if (fd < 0) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"ruletree_rpc: no command queue (%s)", path);
+		free(path);
+		return;
+	}
+	p = mmap(NULL, sizeof(ruletree_cmdq_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close_nomap_nolog(fd);
+	if (p == MAP_FAILED) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"ruletree_rpc: Failed to mmap command queue (%s)", path);
+		free(path);
+		return;
+	}
+	q = p;
+	if ((__atomic_load_n(&q->rcq_magic, __ATOMIC_ACQUIRE) != RULETREE_CMDQ_MAGIC) ||
+	    (q->rcq_protocol_version != RULETREE_RPC_PROTOCOL_VERSION) ||
+	    (q->rcq_num_slots != RULETREE_CMDQ_NUM_SLOTS)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"ruletree_rpc: command queue is not compatible (%s)", path);
+		munmap(p, sizeof(ruletree_cmdq_t));
+		free(path);
+		return;
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "ruletree_rpc: command queue = (%s)", path);
+	free(path);
+	cmdq = q;
+	cmdq_status = 1;
+}
+
+/* Returns 0 if the command was executed, -1 if the socket should be
+ * used instead (all slots are busy, or sb2d reclaimed the slot while
+ * this process was stopped) and -2 if sb2d has died. */
+static int cmdq_send_command_receive_reply(
+	ruletree_rpc_msg_command_t	*command,
+	size_t				command_size,
+	ruletree_rpc_msg_reply_t	*reply)
+{
+	ruletree_cmdq_slot_t	*slot = NULL;
+	uint32_t	start;
+	uint32_t	n;
+	uint32_t	claimed = 0;
+	uint32_t	gen;
+	uint32_t	expected;
+	uint32_t	state;
+	size_t		reply_size;
+
+	/* sb2d clears the magic number when it is shutting down */
+	if (__atomic_load_n(&cmdq->rcq_magic, __ATOMIC_ACQUIRE) !=
+	    RULETREE_CMDQ_MAGIC) return(-1);
+
+	start = __atomic_fetch_add(&cmdq->rcq_next_slot, 1, __ATOMIC_RELAXED);
+	for (n = 0; n < RULETREE_CMDQ_NUM_SLOTS; n++) {
+		uint32_t	i = (start + n) % RULETREE_CMDQ_NUM_SLOTS;
+
+		expected = __atomic_load_n(&cmdq->rcq_slots[i].rcqs_state,
+			__ATOMIC_RELAXED);
+		if (RULETREE_CMDQ_SLOT_STATE(expected) != RULETREE_CMDQ_SLOT_FREE)
+			continue;
+		claimed = RULETREE_CMDQ_SLOT_WORD(
+			RULETREE_CMDQ_SLOT_GEN(expected) + 1,
+			RULETREE_CMDQ_SLOT_CLAIMED);
+		if (__atomic_compare_exchange_n(&cmdq->rcq_slots[i].rcqs_state,
+			&expected, claimed, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			slot = &cmdq->rcq_slots[i];
+			break;
+		}
+	}
+	if (!slot) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"ruletree_rpc: command queue is full, using socket");
+		return(-1);
+	}
+
+	gen = RULETREE_CMDQ_SLOT_GEN(claimed);
+	command->rimc_message_protocol_version = RULETREE_RPC_PROTOCOL_VERSION;
+	memcpy(&slot->rcqs_command, command, command_size);
+	slot->rcqs_command_size = command_size;
+	expected = claimed;
+	if (!__atomic_compare_exchange_n(&slot->rcqs_state, &expected,
+		RULETREE_CMDQ_SLOT_WORD(gen, RULETREE_CMDQ_SLOT_READY), 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"ruletree_rpc: command queue slot was reclaimed, using socket");
+		return(-1);
+	}
+
+	__atomic_fetch_add(&cmdq->rcq_doorbell, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cmdq->rcq_server_sleeping, __ATOMIC_SEQ_CST))
+		cmdq_futex_wake(&cmdq->rcq_doorbell);
+
+	while ((state = __atomic_load_n(&slot->rcqs_state, __ATOMIC_ACQUIRE)) !=
+	       RULETREE_CMDQ_SLOT_WORD(gen, RULETREE_CMDQ_SLOT_DONE)) {
+		if ((RULETREE_CMDQ_SLOT_GEN(state) != gen) ||
+		    (RULETREE_CMDQ_SLOT_STATE(state) < RULETREE_CMDQ_SLOT_READY)) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"ruletree_rpc: command queue slot was reclaimed, using socket");
+			return(-1);
+		}
+		if ((cmdq_futex_wait(&slot->rcqs_state, state, 1) < 0) &&
+		    (errno == ETIMEDOUT) && cmdq->rcq_server_pid &&
+		    (kill(cmdq->rcq_server_pid, 0) < 0) && (errno == ESRCH)) {
+			SB_LOG(SB_LOGLEVEL_ERROR,
+				"ruletree_rpc: sb2d has disappeared");
+			cmdq_status = -1;
+			return(-2);
+		}
+	}
+
+	reply_size = slot->rcqs_reply_size;
+	if (reply_size > sizeof(*reply)) reply_size = sizeof(*reply);
+	memcpy(reply, &slot->rcqs_reply, reply_size);
+	/* if the slot was reclaimed while the reply was copied,
+	 * the copy may be garbage */
+	if (!__atomic_compare_exchange_n(&slot->rcqs_state, &state,
+		RULETREE_CMDQ_SLOT_WORD(gen, RULETREE_CMDQ_SLOT_FREE), 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"ruletree_rpc: command queue slot was reclaimed, using socket");
+		return(-1);
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"%s: Received reply type=%u", __func__, reply->hdr.rimr_message_type);
+	return(0);
+}
+#else /* !__linux__ */
+/* futexes are Linux-specific; always use the socket. */
+static void attach_cmdq(void)
+{
+	cmdq_status = -1;
+}
+
+static int cmdq_send_command_receive_reply(
+	ruletree_rpc_msg_command_t	*command,
+	size_t				command_size,
+	ruletree_rpc_msg_reply_t	*reply)
+{
+	(void)command;
+	(void)command_size;
+	(void)reply;
+	return(-1);
+}
+#endif
+
 static int send_command_receive_reply(
 	ruletree_rpc_msg_command_t	*command,
+	size_t				command_size,
 	ruletree_rpc_msg_reply_t	*reply)
 {
 	ssize_t	sent_msg_size;
 	ssize_t	received_msg_size;
 	int use_locking = 0;
 
+	if (cmdq_status == 0) {
+		if (pthread_library_is_available)
+			(*pthread_mutex_lock_fnptr)(&client_socket_mutex);
+		if (cmdq_status == 0) attach_cmdq();
+		if (pthread_library_is_available)
+			(*pthread_mutex_unlock_fnptr)(&client_socket_mutex);
+	}
+	if (cmdq_status > 0) {
+		switch (cmdq_send_command_receive_reply(command,
+				command_size, reply)) {
+		case 0: return(0);
+		case -2: return(-1);
+		}
+		/* else fall back to the socket */
+	}
+
 	if (pthread_library_is_available) {
 		use_locking = 1;
 		SB_LOG(SB_LOGLEVEL_NOISE, "Going to lock client_socket_mutex");
@@ -229,7 +451,7 @@ static int send_command_receive_reply(
 
 	command->rimc_message_protocol_version = RULETREE_RPC_PROTOCOL_VERSION;
 	/* FIXME: fill serial */
-	sent_msg_size = sendto_nomap_nolog(client_socket, command, sizeof(*command), 0,
+	sent_msg_size = sendto_nomap_nolog(client_socket, command, command_size, 0,
 		(struct sockaddr*)&server_address, server_addr_len);
 	if (sent_msg_size < 0) {
 		switch (errno) {
@@ -283,7 +505,8 @@ void ruletree_rpc__ping(void)
 		"ruletree_rpc: Sending command 'ping'");
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__PING;
-	send_command_receive_reply(&command, &reply);
+	send_command_receive_reply(&command,
+		RULETREE_RPC_COMMAND_SIZE(rimm_status), &reply);
 }
 
 /* called from sb2dctl */
@@ -303,7 +526,8 @@ char *ruletree_rpc__init2(void)
 	memset(&command, 0, sizeof(command));
 	memset(&reply, 0, sizeof(reply));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__INIT2;
-	if (send_command_receive_reply(&command, &reply) < 0) {
+	if (send_command_receive_reply(&command,
+		RULETREE_RPC_COMMAND_SIZE(rimm_status), &reply) < 0) {
 		return(strdup("RPC failed"));
 	}
 
@@ -329,115 +553,504 @@ char *sb2__ruletree_rpc__init2__(void)
 	return(ruletree_rpc__init2());
 }
 
-/* clear vperm info completely. */
-void ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino)
+/* Get runtime statistics from sb2d, returns a printable
+ * multi-line string (to be freed by the caller) */
+char *ruletree_rpc__stats(void)
 {
 	ruletree_rpc_msg_command_t	command;
 	ruletree_rpc_msg_reply_t	reply;
+	ruletree_rpc_stats_t		*st = &reply.msg.rimr_stats;
+	static const char *command_names[RULETREE_RPC_STATS_MAX_COMMAND+1] = {
+		"(unknown)", "ping", "setfileinfo", "releasefileinfo",
+		"clearfileinfo", "init2", "fileinfo_batch", "stats",
+		"vperm_import"
+	};
+	char	*buf = NULL;
+	size_t	buf_size = 0;
+	FILE	*fp;
+	int	i;
 
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"ruletree_rpc: Sending command 'stats'");
 	memset(&command, 0, sizeof(command));
-	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO;
-	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
-	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	send_command_receive_reply(&command, &reply);
+	memset(&reply, 0, sizeof(reply));
+	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__STATS;
+	if (send_command_receive_reply(&command,
+		RULETREE_RPC_COMMAND_SIZE(rimm_status), &reply) < 0)
+		return(NULL);
+	if (reply.hdr.rimr_message_type != RULETREE_RPC_MESSAGE_REPLY__OK) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"ruletree_rpc: stats failed (reply type %u)",
+			reply.hdr.rimr_message_type);
+		return(NULL);
+	}
+
+	fp = open_memstream(&buf, &buf_size);
+	if (!fp) return(NULL);
+	fprintf(fp, "commands:\n");
+	for (i = 1; i <= RULETREE_RPC_STATS_MAX_COMMAND; i++)
+		fprintf(fp, "  %-20s %llu\n", command_names[i],
+			(unsigned long long)st->rist_num_commands[i]);
+	fprintf(fp, "  %-20s %llu\n", command_names[0],
+		(unsigned long long)st->rist_num_commands[0]);
+	fprintf(fp, "  %-20s %llu\n", "(batched records)",
+		(unsigned long long)st->rist_num_batch_records);
+	fprintf(fp, "writer queue depth:    %u (max %u)\n",
+		st->rist_writer_queue_depth, st->rist_writer_queue_max_depth);
+	fprintf(fp, "latency (usec):        p50 <= %u, p90 <= %u, "
+		"p99 <= %u, max %u\n",
+		st->rist_latency_p50_usec, st->rist_latency_p90_usec,
+		st->rist_latency_p99_usec, st->rist_latency_max_usec);
+	fprintf(fp, "rule tree:             %u / %u bytes used (%u%%)\n",
+		st->rist_ruletree_file_size, st->rist_ruletree_max_size,
+		(st->rist_ruletree_max_size ?
+			(uint32_t)(100ULL * st->rist_ruletree_file_size /
+				st->rist_ruletree_max_size) : 0));
+	fprintf(fp, "inodestats:            %u live, %u dead, "
+		"%u devices, max depth %u\n",
+		st->rist_inodestats_live, st->rist_inodestats_dead,
+		st->rist_inodestat_devices, st->rist_inodestats_max_depth);
+	fclose(fp);
+	return(buf);
 }
 
-void ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
-	int set_uid, uint32_t uid, int set_gid, uint32_t gid)
+/* called from sb2dctl */
+char *sb2__ruletree_rpc__stats__(void)
+{
+	return(ruletree_rpc__stats());
+}
+
+/* Ask sb2d to import simulated ownerships and modes from a manifest
+ * file (see sb2d/vperm_import.c for the format). "manifest_path"
+ * must be an absolute path, the paths in the manifest are relative
+ * to "root_dir". Returns a printable summary, or NULL. */
+char *ruletree_rpc__vperm_import(const char *manifest_path,
+	const char *root_dir)
 {
 	ruletree_rpc_msg_command_t	command;
 	ruletree_rpc_msg_reply_t	reply;
+	size_t	manifest_len = strlen(manifest_path) + 1;
+	size_t	root_len = strlen(root_dir) + 1;
+
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"ruletree_rpc: Sending command 'vperm_import'");
+	if (manifest_len + root_len > RULETREE_RPC_VPERM_IMPORT_MAX_SIZE) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"ruletree_rpc: vperm_import: path is too long");
+		return(NULL);
+	}
+	memset(&command, 0, sizeof(command));
+	memset(&reply, 0, sizeof(reply));
+	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__VPERM_IMPORT;
+	memcpy(command.rim_message.rimm_vperm_import,
+		manifest_path, manifest_len);
+	memcpy(command.rim_message.rimm_vperm_import + manifest_len,
+		root_dir, root_len);
+	if (send_command_receive_reply(&command,
+		offsetof(ruletree_rpc_msg_command_t, rim_message) +
+		manifest_len + root_len, &reply) < 0)
+		return(NULL);
+
+	switch (reply.hdr.rimr_message_type) {
+	case RULETREE_RPC_MESSAGE_REPLY__MESSAGE:
+		reply.msg.rimr_str[sizeof(reply.msg.rimr_str)-1] = '\0';
+		return(strdup(reply.msg.rimr_str));
+	default:
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"ruletree_rpc: vperm_import failed (reply type %u)",
+			reply.hdr.rimr_message_type);
+		return(NULL);
+	}
+}
+
+
+/* ----- vperm updates -----
+ *
+ * By default, chown/chmod/mknod updates are sent to sb2d one by one
+ * and the caller waits for the reply, so other processes see the
+ * change as soon as the call has returned.
+ *
+ * Write-behind mode ("w" in SBOX_VPERM_IDS, "sb2 -w"): the updates
+ * are queued and sent as FILEINFO_BATCH messages, which saves a
+ * round trip per file when e.g. "chown -R" or an installer touches
+ * many files. sb2d processes the records in order, so the result is
+ * the same as if they had been sent separately. The queue is
+ * flushed when it becomes full, before fork, exec and posix_spawn,
+ * and at exit. It is not flushed when inodestats are read; instead,
+ * the queued records are applied on top of what was found from the
+ * tree (see ruletree_rpc__vperm_apply_queued_updates()), so the
+ * process still sees its own updates. Other processes see them
+ * later, and queued updates are lost if the process is killed by
+ * a signal.
+ *
+ * The queue belongs to the process that created it
+ * (fileinfo_batch_pid). fork() can't copy records: the queue is
+ * flushed and kept locked over fork (see the pthread_atfork()
+ * handlers). vfork() can't be wrapped, but a vfork()ed child shares
+ * the queue with the parent, whose calling thread is suspended until
+ * the child execs or exits: The child sends the parent's records
+ * before its own ones and before exec/_exit, exactly as the parent
+ * would have done. Records are never dropped.
+*/
+static ruletree_rpc_msg_command_t	fileinfo_batch;
+static pid_t				fileinfo_batch_pid = 0;
+static volatile uint32_t		fileinfo_batch_num_records = 0;
+static int				fileinfo_batch_hooks_registered = 0;
+static int				fileinfo_batch_write_behind = 0;
+
+/* Lock order: fileinfo_batch_mutex first, then client_socket_mutex */
+static pthread_mutex_t	fileinfo_batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void flush_fileinfo_batch_locked(void)
+{
+	ruletree_rpc_msg_reply_t	reply;
+	uint32_t	num_records = fileinfo_batch_num_records;
+	size_t		command_size;
+	uint32_t	i;
+
+	if (num_records == 0) return;
+
+	/* If this is a vfork()ed child, the records were queued by the
+	 * parent; send them anyway (see above) */
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"ruletree_rpc: Sending %u vperm updates", num_records);
+	fileinfo_batch.rimc_message_type =
+		RULETREE_RPC_MESSAGE_COMMAND__FILEINFO_BATCH;
+	fileinfo_batch.rim_message.rimm_fileinfo_batch.rimb_num_records =
+		num_records;
+	command_size = offsetof(ruletree_rpc_msg_command_t,
+		rim_message.rimm_fileinfo_batch.rimb_records) +
+		num_records * sizeof(ruletree_rpc_fileinfo_record_t);
+	fileinfo_batch_num_records = 0;
+
+	memset(&reply, 0, sizeof(reply));
+	if (send_command_receive_reply(&fileinfo_batch, command_size, &reply) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"ruletree_rpc: Failed to send %u vperm updates",
+			num_records);
+		return;
+	}
+	if (reply.hdr.rimr_message_type != RULETREE_RPC_MESSAGE_REPLY__OK) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"ruletree_rpc: vperm updates failed (reply type %u)",
+			reply.hdr.rimr_message_type);
+		return;
+	}
+	for (i = 0; i < num_records; i++) {
+		ruletree_rpc_fileinfo_record_t *rec =
+			&fileinfo_batch.rim_message.rimm_fileinfo_batch.rimb_records[i];
+
+		if (reply.msg.rimr_batch_status[i] != RULETREE_RPC_MESSAGE_REPLY__OK) {
+			SB_LOG(SB_LOGLEVEL_WARNING,
+				"ruletree_rpc: vperm update %u failed "
+				"(cmd=%u dev=%llu ino=%llu status=%u)",
+				i, rec->rimb_command,
+				(unsigned long long)rec->rimb_fileinfo.inodesimu_dev,
+				(unsigned long long)rec->rimb_fileinfo.inodesimu_ino,
+				reply.msg.rimr_batch_status[i]);
+		}
+	}
+}
+
+void ruletree_rpc__vperm_flush(void)
+{
+	/* unlocked check first; this is called from every stat() */
+	if (fileinfo_batch_num_records == 0) return;
+
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&fileinfo_batch_mutex);
+	flush_fileinfo_batch_locked();
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&fileinfo_batch_mutex);
+}
+
+static uint32_t get_num_queued_fileinfo_updates(void)
+{
+	return(fileinfo_batch_num_records);
+}
+
+/* pthread_atfork() handlers: flush, and keep the queue locked so
+ * that other threads can't add records that the child would inherit */
+static void fileinfo_batch_prepare_fork(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&fileinfo_batch_mutex);
+	flush_fileinfo_batch_locked();
+}
+
+static void fileinfo_batch_after_fork(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&fileinfo_batch_mutex);
+}
+
+static void queue_fileinfo_update(uint32_t cmd, const inodesimu_t *fileinfo)
+{
+	ruletree_rpc_fileinfo_record_t *rec;
+
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&fileinfo_batch_mutex);
+
+	if (!fileinfo_batch_hooks_registered) {
+		fileinfo_batch_hooks_registered = 1;
+		fileinfo_batch_write_behind = vperm_write_behind_updates();
+		if (fileinfo_batch_write_behind) {
+			set_vperm_pending_updates_fns(NULL,
+				get_num_queued_fileinfo_updates);
+			atexit(ruletree_rpc__vperm_flush);
+			pthread_atfork(fileinfo_batch_prepare_fork,
+				fileinfo_batch_after_fork,
+				fileinfo_batch_after_fork);
+		}
+	}
+	if (fileinfo_batch_pid != getpid()) {
+		/* A child, or the parent after a vfork()ed child has
+		 * used the queue: send the other process' records
+		 * first, then take over the (empty) queue. */
+		flush_fileinfo_batch_locked();
+		fileinfo_batch_pid = getpid();
+	}
+
+	rec = &fileinfo_batch.rim_message.rimm_fileinfo_batch.rimb_records[
+		fileinfo_batch_num_records];
+	memset(rec, 0, sizeof(*rec));
+	rec->rimb_command = cmd;
+	rec->rimb_fileinfo = *fileinfo;
+	fileinfo_batch_num_records++;
+
+	/* send it now, unless in write-behind mode */
+	if (!fileinfo_batch_write_behind ||
+	    (fileinfo_batch_num_records >= RULETREE_RPC_FILEINFO_BATCH_MAX))
+		flush_fileinfo_batch_locked();
+
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&fileinfo_batch_mutex);
+}
+
+/* Apply one queued record to "istat", the same way as sb2d will
+ * apply it to the tree (see ruletree_cmd_setfileinfo() etc. in sb2d).
+ * Returns nonzero if the inodestat exists after that. */
+static int apply_fileinfo_update(const ruletree_rpc_fileinfo_record_t *rec,
+	inodesimu_t *istat, int found)
+{
+	const inodesimu_t *upd = &rec->rimb_fileinfo;
+
+	switch (rec->rimb_command) {
+	case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+		if (!found) {
+			*istat = *upd;
+			return(1);
+		}
+		if ((istat->inodesimu_flags & RULETREE_INODESTAT_FLAG_RESTORED) &&
+		    (upd->inodesimu_flags & RULETREE_INODESTAT_FLAG_REAL_ID) &&
+		    !ruletree_inodestat_matches_real_id(istat,
+			upd->inodesimu_real_ctime_sec, upd->inodesimu_real_ctime_nsec,
+			upd->inodesimu_real_size)) {
+			/* stale; the old fields don't belong to this file */
+			memset(istat, 0, sizeof(*istat));
+			istat->inodesimu_dev = upd->inodesimu_dev;
+			istat->inodesimu_ino = upd->inodesimu_ino;
+		}
+		if (upd->inodesimu_real_ifmt)
+			istat->inodesimu_real_ifmt = upd->inodesimu_real_ifmt;
+		if (upd->inodesimu_flags & RULETREE_INODESTAT_FLAG_REAL_ID) {
+			istat->inodesimu_real_ctime_sec = upd->inodesimu_real_ctime_sec;
+			istat->inodesimu_real_ctime_nsec = upd->inodesimu_real_ctime_nsec;
+			istat->inodesimu_real_size = upd->inodesimu_real_size;
+			istat->inodesimu_flags = RULETREE_INODESTAT_FLAG_REAL_ID;
+		}
+		if (upd->inodesimu_active_fields & RULETREE_INODESTAT_SIM_UID) {
+			istat->inodesimu_uid = upd->inodesimu_uid;
+			istat->inodesimu_active_fields |= RULETREE_INODESTAT_SIM_UID;
+		}
+		if (upd->inodesimu_active_fields & RULETREE_INODESTAT_SIM_GID) {
+			istat->inodesimu_gid = upd->inodesimu_gid;
+			istat->inodesimu_active_fields |= RULETREE_INODESTAT_SIM_GID;
+		}
+		if (upd->inodesimu_active_fields &
+		    (RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID)) {
+			istat->inodesimu_mode = upd->inodesimu_mode;
+			istat->inodesimu_suidsgid = upd->inodesimu_suidsgid;
+			istat->inodesimu_active_fields &=
+				~(RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID);
+			istat->inodesimu_active_fields |=
+				(upd->inodesimu_active_fields &
+				 RULETREE_INODESTAT_SIM_SUIDSGID) |
+				RULETREE_INODESTAT_SIM_MODE;
+		}
+		if (upd->inodesimu_active_fields & RULETREE_INODESTAT_SIM_DEVNODE) {
+			istat->inodesimu_devmode = upd->inodesimu_devmode;
+			istat->inodesimu_rdev = upd->inodesimu_rdev;
+			istat->inodesimu_active_fields |= RULETREE_INODESTAT_SIM_DEVNODE;
+		}
+		return(1);
+	case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+		if (found)
+			istat->inodesimu_active_fields &= ~(upd->inodesimu_active_fields &
+				(RULETREE_INODESTAT_SIM_UID | RULETREE_INODESTAT_SIM_GID |
+				 RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID |
+				 RULETREE_INODESTAT_SIM_DEVNODE));
+		return(found);
+	case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+		if (found) istat->inodesimu_active_fields = 0;
+		return(found);
+	}
+	return(found);
+}
+
+/* Apply the queued updates of dev/ino to "istat", which was read from
+ * the tree ("found" is nonzero if it was found there).
+ * Returns nonzero if the inodestat exists after the updates. */
+int ruletree_rpc__vperm_apply_queued_updates(uint64_t dev, uint64_t ino,
+	inodesimu_t *istat, int found)
+{
+	uint32_t	i;
+
+	/* unlocked check first, like in ruletree_rpc__vperm_flush() */
+	if (fileinfo_batch_num_records == 0) return(found);
+
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&fileinfo_batch_mutex);
+	for (i = 0; i < fileinfo_batch_num_records; i++) {
+		ruletree_rpc_fileinfo_record_t *rec =
+			&fileinfo_batch.rim_message.rimm_fileinfo_batch.rimb_records[i];
+
+		if ((rec->rimb_fileinfo.inodesimu_dev == dev) &&
+		    (rec->rimb_fileinfo.inodesimu_ino == ino))
+			found = apply_fileinfo_update(rec, istat, found);
+	}
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&fileinfo_batch_mutex);
+	return(found);
+}
+
+/* clear vperm info completely. */
+void ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino)
+{
+	inodesimu_t	fileinfo;
+
+	memset(&fileinfo, 0, sizeof(fileinfo));
+	fileinfo.inodesimu_dev = dev;
+	fileinfo.inodesimu_ino = ino;
+	queue_fileinfo_update(RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO,
+		&fileinfo);
+}
+
+/* fill the key and the identity of the real file */
+static void init_fileinfo_from_real_stat(inodesimu_t *fileinfo,
+	const struct stat64 *real_st)
+{
+	memset(fileinfo, 0, sizeof(*fileinfo));
+	fileinfo->inodesimu_dev = real_st->st_dev;
+	fileinfo->inodesimu_ino = real_st->st_ino;
+	fileinfo->inodesimu_real_ifmt = real_st->st_mode & S_IFMT;
+	fileinfo->inodesimu_real_ctime_sec = real_st->st_ctim.tv_sec;
+	fileinfo->inodesimu_real_ctime_nsec = real_st->st_ctim.tv_nsec;
+	fileinfo->inodesimu_real_size = real_st->st_size;
+	fileinfo->inodesimu_flags = RULETREE_INODESTAT_FLAG_REAL_ID;
+}
+
+void ruletree_rpc__vperm_set_real_id(uint64_t dev, uint64_t ino,
+	int64_t ctime_sec, uint32_t ctime_nsec, uint64_t size)
+{
+	inodesimu_t	fileinfo;
+
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: dev=%llu ino=%llu", __func__,
+		(unsigned long long)dev, (unsigned long long)ino);
+	memset(&fileinfo, 0, sizeof(fileinfo));
+	fileinfo.inodesimu_dev = dev;
+	fileinfo.inodesimu_ino = ino;
+	fileinfo.inodesimu_real_ctime_sec = ctime_sec;
+	fileinfo.inodesimu_real_ctime_nsec = ctime_nsec;
+	fileinfo.inodesimu_real_size = size;
+	fileinfo.inodesimu_flags = RULETREE_INODESTAT_FLAG_REAL_ID;
+	queue_fileinfo_update(RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO,
+		&fileinfo);
+}
+
+void ruletree_rpc__vperm_set_ids(const struct stat64 *real_st,
+	int set_uid, uint32_t uid, int set_gid, uint32_t gid)
+{
+	inodesimu_t	fileinfo;
 
 	if (set_uid) 
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: uid=%d", __func__, uid);
 	if (set_gid) 
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: gid=%d", __func__, gid);
-	memset(&command, 0, sizeof(command));
-	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO;
-	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
-	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
+	init_fileinfo_from_real_stat(&fileinfo, real_st);
+	fileinfo.inodesimu_active_fields =
 		(set_uid ? RULETREE_INODESTAT_SIM_UID : 0) |
 		(set_gid ? RULETREE_INODESTAT_SIM_GID : 0);
-	command.rim_message.rimm_fileinfo.inodesimu_uid = uid;
-	command.rim_message.rimm_fileinfo.inodesimu_gid = gid;
-	send_command_receive_reply(&command, &reply);
+	fileinfo.inodesimu_uid = uid;
+	fileinfo.inodesimu_gid = gid;
+	queue_fileinfo_update(RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO,
+		&fileinfo);
 }
 
 void ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
 	int release_uid, int release_gid)
 {
-	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
+	inodesimu_t	fileinfo;
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: %s %s", __func__,
 		(release_uid?"rel.uid":""), (release_gid?"rel.gid":""));
-	memset(&command, 0, sizeof(command));
-	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO;
-	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
-	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
+	memset(&fileinfo, 0, sizeof(fileinfo));
+	fileinfo.inodesimu_dev = dev;
+	fileinfo.inodesimu_ino = ino;
+	fileinfo.inodesimu_active_fields =
 		(release_uid ? RULETREE_INODESTAT_SIM_UID : 0) |
 		(release_gid ? RULETREE_INODESTAT_SIM_GID : 0);
-	send_command_receive_reply(&command, &reply);
+	queue_fileinfo_update(RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO,
+		&fileinfo);
 }
 
-void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
-	mode_t real_mode, mode_t virt_mode, mode_t suid_sgid_bits)
+void ruletree_rpc__vperm_set_mode(const struct stat64 *real_st,
+	mode_t virt_mode, mode_t suid_sgid_bits)
 {
-	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
+	inodesimu_t	fileinfo;
+	mode_t		real_mode = real_st->st_mode;
 
-	memset(&command, 0, sizeof(command));
-	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO;
-	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
-	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	command.rim_message.rimm_fileinfo.inodesimu_mode = virt_mode;
-	command.rim_message.rimm_fileinfo.inodesimu_suidsgid = suid_sgid_bits;
+	init_fileinfo_from_real_stat(&fileinfo, real_st);
+	fileinfo.inodesimu_mode = virt_mode;
+	fileinfo.inodesimu_suidsgid = suid_sgid_bits;
 
 	if ((real_mode & ~(S_ISUID | S_ISGID)) != 
 	    (virt_mode & ~(S_ISUID | S_ISGID))) {
-		command.rim_message.rimm_fileinfo.inodesimu_active_fields |=
-			RULETREE_INODESTAT_SIM_MODE;
+		fileinfo.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_MODE;
 	}
 
 	if (suid_sgid_bits != (real_mode & (S_ISUID | S_ISGID))) {
-		command.rim_message.rimm_fileinfo.inodesimu_active_fields |=
-			RULETREE_INODESTAT_SIM_SUIDSGID;
+		fileinfo.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_SUIDSGID;
 	}
-	send_command_receive_reply(&command, &reply);
+	queue_fileinfo_update(RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO,
+		&fileinfo);
 }
 
 void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino)
 {
-	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
+	inodesimu_t	fileinfo;
 
-	memset(&command, 0, sizeof(command));
-	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO;
-	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
-	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
+	memset(&fileinfo, 0, sizeof(fileinfo));
+	fileinfo.inodesimu_dev = dev;
+	fileinfo.inodesimu_ino = ino;
+	fileinfo.inodesimu_active_fields =
 		RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID;
-	send_command_receive_reply(&command, &reply);
+	queue_fileinfo_update(RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO,
+		&fileinfo);
 }
 
-void ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
+void ruletree_rpc__vperm_set_dev_node(const struct stat64 *real_st,
         mode_t mode, uint64_t rdev)
 {
-	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
+	inodesimu_t	fileinfo;
 
-	memset(&command, 0, sizeof(command));
-	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO;
-	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
-	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
+	/* the real file is an empty regular file */
+	init_fileinfo_from_real_stat(&fileinfo, real_st);
+	fileinfo.inodesimu_active_fields =
 		RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_DEVNODE;
-	command.rim_message.rimm_fileinfo.inodesimu_mode = mode & (~S_IFMT);
-	command.rim_message.rimm_fileinfo.inodesimu_devmode = mode & S_IFMT;
-	command.rim_message.rimm_fileinfo.inodesimu_rdev = rdev;
-	send_command_receive_reply(&command, &reply);
+	fileinfo.inodesimu_mode = mode & (~S_IFMT);
+	fileinfo.inodesimu_devmode = mode & S_IFMT;
+	fileinfo.inodesimu_rdev = rdev;
+	queue_fileinfo_update(RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO,
+		&fileinfo);
 }
-
-
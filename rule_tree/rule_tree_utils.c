@@ -61,12 +61,33 @@ void dec_vperm_num_active_inodestats(void)
 	}
 }
 
+/* In the write-behind mode, clients queue vperm updates before
+ * sending them to sb2d. The queued updates are applied on top of the
+ * inodestats that are read from the tree, and counted here as if
+ * they were active already. A flush function can be set instead, if
+ * the queue must be sent before the inodestats are read. */
+static void (*vperm_pending_updates_flush_fn)(void) = NULL;
+static uint32_t (*vperm_num_pending_updates_fn)(void) = NULL;
+
+void set_vperm_pending_updates_fns(void (*flush_fn)(void),
+	uint32_t (*num_pending_fn)(void))
+{
+	vperm_pending_updates_flush_fn = flush_fn;
+	vperm_num_pending_updates_fn = num_pending_fn;
+}
+
 uint32_t get_vperm_num_active_inodestats(void)
 {
+	uint32_t	num_pending = 0;
+
+	if (vperm_pending_updates_flush_fn)
+		(*vperm_pending_updates_flush_fn)();
+	else if (vperm_num_pending_updates_fn)
+		num_pending = (*vperm_num_pending_updates_fn)();
 	if (!num_active_inodestats_offs) 
 		locate_status_variables_in_ruletree();
-	if (!num_active_inodestats_ptr) return(0);
+	if (!num_active_inodestats_ptr) return(num_pending);
 
-	return(*num_active_inodestats_ptr);
+	return(*num_active_inodestats_ptr + num_pending);
 }
 
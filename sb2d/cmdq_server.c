@@ -0,0 +1,314 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* sb2d, the rule tree server: the shared-memory command queue.
+ *
+ * Clients put commands to free slots of the queue and ring the
+ * doorbell (a futex); a separate thread of sb2d picks up the
+ * commands and passes them to ruletree_server_submit_job(), just like
+ * the socket loop does. The client is woken up when the reply is ready.
+ * See rule_tree_rpc.h for the layout of the queue.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "sb2_server.h"
+
+static ruletree_cmdq_t	*cmdq = NULL;
+
+#ifdef __linux__
+static pthread_t	cmdq_server_tid;
+static int		cmdq_server_running = 0;
+static volatile int	cmdq_server_stopping = 0;
+
+static int cmdq_futex_wait(volatile uint32_t *addr, uint32_t val, int timeout_sec)
+{
+	struct timespec	ts;
+
+	ts.tv_sec = timeout_sec;
+	ts.tv_nsec = 0;
+	return(syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0));
+}
+
+static void cmdq_futex_wake(volatile uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void create_cmdq(void)
+{
+	char	*path = NULL;
+	int	fd;
+	void	*p;
+
+	if (asprintf(&path, "%s/sb2d-cmdq", sbox_session_dir) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "cmdq: asprintf failed");
+		return;
+	}
+	unlink(path); /* remove old queue, if any. */
+	fd = open(path, O_CLOEXEC | O_RDWR | O_CREAT | O_EXCL,
+		S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "cmdq: Failed to create %s", path);
+		free(path);
+		return;
+	}
+	if (ftruncate(fd, sizeof(ruletree_cmdq_t)) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "cmdq: Failed to set size of %s", path);
+		goto error_out;
+	}
+	p = mmap(NULL, sizeof(ruletree_cmdq_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "cmdq: Failed to mmap %s", path);
+		goto error_out;
+	}
+	cmdq = p;
+	/* the file is all zeros => all slots are free. Clients
+	 * won't use the queue before the magic number is there. */
+	cmdq->rcq_protocol_version = RULETREE_RPC_PROTOCOL_VERSION;
+	cmdq->rcq_num_slots = RULETREE_CMDQ_NUM_SLOTS;
+	__atomic_store_n(&cmdq->rcq_magic, RULETREE_CMDQ_MAGIC, __ATOMIC_RELEASE);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "cmdq = (%s)", path);
+	close(fd);
+	free(path);
+	return;
+
+    error_out:
+	close(fd);
+	unlink(path);
+	free(path);
+}
+
+static void complete_cmdq_job(ruletree_server_job_t *job)
+{
+	ruletree_cmdq_slot_t	*slot = job->rsj_cmdq_slot;
+	uint32_t		state;
+
+	/* PROCESSING slots are never touched by others */
+	state = __atomic_load_n(&slot->rcqs_state, __ATOMIC_RELAXED);
+	slot->rcqs_reply_size = job->rsj_reply_size;
+	__atomic_store_n(&slot->rcqs_state,
+		RULETREE_CMDQ_SLOT_WORD(RULETREE_CMDQ_SLOT_GEN(state),
+			RULETREE_CMDQ_SLOT_DONE),
+		__ATOMIC_RELEASE);
+	cmdq_futex_wake(&slot->rcqs_state);
+	free(job);
+}
+
+/* Pass all commands that are waiting in the queue to
+ * ruletree_server_submit_job(). Returns number of commands. */
+static int cmdq_process_ready_slots(uint32_t *next_slotp)
+{
+	int	num_processed = 0;
+	uint32_t	n;
+
+	for (n = 0; n < RULETREE_CMDQ_NUM_SLOTS; n++) {
+		uint32_t	i = (*next_slotp + n) % RULETREE_CMDQ_NUM_SLOTS;
+		ruletree_cmdq_slot_t	*slot = &cmdq->rcq_slots[i];
+		uint32_t	expected;
+		uint32_t	gen;
+		ruletree_server_job_t	*job;
+
+		expected = __atomic_load_n(&slot->rcqs_state, __ATOMIC_RELAXED);
+		if (RULETREE_CMDQ_SLOT_STATE(expected) != RULETREE_CMDQ_SLOT_READY)
+			continue;
+		gen = RULETREE_CMDQ_SLOT_GEN(expected);
+		if (!__atomic_compare_exchange_n(&slot->rcqs_state, &expected,
+			RULETREE_CMDQ_SLOT_WORD(gen, RULETREE_CMDQ_SLOT_PROCESSING),
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+
+		SB_LOG(SB_LOGLEVEL_DEBUG, "cmdq: slot %u, generation %u",
+			i, gen);
+		if (slot->rcqs_command_size < offsetof(
+		    ruletree_rpc_msg_command_t, rim_message)) {
+			/* the client must get a reply */
+			SB_LOG(SB_LOGLEVEL_ERROR,
+				"cmdq: slot %u: short message (%u bytes)",
+				i, slot->rcqs_command_size);
+			memset(&slot->rcqs_reply.hdr, 0,
+				sizeof(slot->rcqs_reply.hdr));
+			slot->rcqs_reply.hdr.rimr_message_type =
+				RULETREE_RPC_MESSAGE_REPLY__FAILED;
+			slot->rcqs_reply_size = sizeof(slot->rcqs_reply.hdr);
+			__atomic_store_n(&slot->rcqs_state,
+				RULETREE_CMDQ_SLOT_WORD(gen, RULETREE_CMDQ_SLOT_DONE),
+				__ATOMIC_RELEASE);
+			cmdq_futex_wake(&slot->rcqs_state);
+			continue;
+		}
+		/* the buffers of the job are not used, the command
+		 * and the reply stay in the slot. */
+		job = malloc(sizeof(*job));
+		if (!job) {
+			SB_LOG(SB_LOGLEVEL_ERROR, "cmdq: Out of memory");
+			__atomic_store_n(&slot->rcqs_state,
+				RULETREE_CMDQ_SLOT_WORD(gen, RULETREE_CMDQ_SLOT_READY),
+				__ATOMIC_RELEASE);
+			break;
+		}
+		job->rsj_command = &slot->rcqs_command;
+		job->rsj_command_size = slot->rcqs_command_size;
+		if (job->rsj_command_size > sizeof(slot->rcqs_command))
+			job->rsj_command_size = sizeof(slot->rcqs_command);
+		job->rsj_reply = &slot->rcqs_reply;
+		job->rsj_complete = complete_cmdq_job;
+		job->rsj_cmdq_slot = slot;
+		ruletree_server_submit_job(job);
+		num_processed++;
+		*next_slotp = i + 1;
+	}
+	return(num_processed);
+}
+
+/* Free slots of clients that died (or were stopped) before they
+ * sent the command or before they picked up the reply: a slot is
+ * abandoned if it has stayed CLAIMED or DONE with the same generation
+ * for RULETREE_CMDQ_SLOT_TIMEOUT seconds. Process IDs are not used,
+ * because the clients may be in other PID namespaces. */
+static struct {
+	uint32_t	state;	/* the whole rcqs_state word */
+	time_t		since;
+} cmdq_slot_seen[RULETREE_CMDQ_NUM_SLOTS];
+
+static void cmdq_reclaim_abandoned_slots(void)
+{
+	struct timespec	now;
+	uint32_t	i;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) return;
+
+	for (i = 0; i < RULETREE_CMDQ_NUM_SLOTS; i++) {
+		ruletree_cmdq_slot_t	*slot = &cmdq->rcq_slots[i];
+		uint32_t	state = __atomic_load_n(&slot->rcqs_state,
+					__ATOMIC_ACQUIRE);
+
+		if ((RULETREE_CMDQ_SLOT_STATE(state) != RULETREE_CMDQ_SLOT_CLAIMED) &&
+		    (RULETREE_CMDQ_SLOT_STATE(state) != RULETREE_CMDQ_SLOT_DONE)) {
+			cmdq_slot_seen[i].state = state;
+			continue;
+		}
+		if (cmdq_slot_seen[i].state != state) {
+			/* new owner or new state, start the timer */
+			cmdq_slot_seen[i].state = state;
+			cmdq_slot_seen[i].since = now.tv_sec;
+			continue;
+		}
+		if (now.tv_sec - cmdq_slot_seen[i].since < RULETREE_CMDQ_SLOT_TIMEOUT)
+			continue;
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"cmdq: releasing slot %u, generation %u", i,
+			RULETREE_CMDQ_SLOT_GEN(state));
+		/* fails if the client got there first */
+		__atomic_compare_exchange_n(&slot->rcqs_state, &state,
+			RULETREE_CMDQ_SLOT_WORD(RULETREE_CMDQ_SLOT_GEN(state),
+				RULETREE_CMDQ_SLOT_FREE), 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+}
+
+static void *cmdq_server_thread(void *arg)
+{
+	uint32_t	next_slot = 0;
+
+	(void)arg;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "cmdq: server thread started");
+	while (!__atomic_load_n(&cmdq_server_stopping, __ATOMIC_ACQUIRE)) {
+		uint32_t doorbell = __atomic_load_n(&cmdq->rcq_doorbell,
+					__ATOMIC_SEQ_CST);
+
+		if (cmdq_process_ready_slots(&next_slot) > 0) continue;
+
+		/* Nothing to do. Clients check rcq_server_sleeping after
+		 * they have rung the doorbell, and the futex doesn't
+		 * sleep if the doorbell has been rung after it was read. */
+		__atomic_store_n(&cmdq->rcq_server_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&cmdq->rcq_doorbell, __ATOMIC_SEQ_CST) == doorbell) {
+			if ((cmdq_futex_wait(&cmdq->rcq_doorbell, doorbell, 1) < 0) &&
+			    (errno == ETIMEDOUT)) {
+				cmdq_reclaim_abandoned_slots();
+			}
+		}
+		__atomic_store_n(&cmdq->rcq_server_sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "cmdq: server thread stopped");
+	return(NULL);
+}
+
+void start_cmdq_server(void)
+{
+	if (!cmdq) return;
+
+	cmdq->rcq_server_pid = getpid();
+	if (pthread_create(&cmdq_server_tid, NULL, cmdq_server_thread, NULL) != 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"cmdq: Failed to create the server thread");
+		/* clients will use the socket */
+		cmdq->rcq_magic = 0;
+		return;
+	}
+	cmdq_server_running = 1;
+}
+
+/* Stop the server thread and pass the commands that are still
+ * waiting in the queue to ruletree_server_submit_job(). Called at
+ * shutdown, before stop_ruletree_writer(). */
+void stop_cmdq_server(void)
+{
+	uint32_t	next_slot = 0;
+
+	if (!cmdq_server_running) return;
+
+	/* new clients won't use the queue anymore */
+	__atomic_store_n(&cmdq->rcq_magic, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&cmdq_server_stopping, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&cmdq->rcq_doorbell, 1, __ATOMIC_SEQ_CST);
+	cmdq_futex_wake(&cmdq->rcq_doorbell);
+	pthread_join(cmdq_server_tid, NULL);
+	cmdq_server_running = 0;
+
+	while (cmdq_process_ready_slots(&next_slot) > 0)
+		;
+}
+
+#else /* !__linux__ */
+
+/* futexes are Linux-specific; clients will use the socket. */
+void create_cmdq(void)
+{
+}
+
+void start_cmdq_server(void)
+{
+}
+
+void stop_cmdq_server(void)
+{
+}
+
+#endif
@@ -47,6 +47,7 @@ char *sbox_orig_binary_name = "[sb2d]";
 
 char *sbox_active_exec_policy_name = "[sb2d]";
 char *sbox_mapping_method = "";
+char *sbox_inherited_ruletree_fd = NULL;
 
 int pthread_library_is_available = 0;
 pthread_t (*pthread_self_fnptr)(void) = NULL;
@@ -402,6 +402,84 @@ static int lua_sb_ruletree_new_boolean(lua_State *l)
 	return 1;
 }
 
+static int lua_sb_ruletree_new_bloomfilter(lua_State *l)
+{
+	int	n = lua_gettop(l);
+	ruletree_object_offset_t	bf_offs = 0;
+
+	if (n == 1) {
+		uint32_t	num_bits = lua_tointeger(l, 1);
+		bf_offs = ruletree_bloomfilter_create(num_bits);
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"%s(%u) => %d", __func__, num_bits, bf_offs);
+	} else {
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"%s => %d", __func__, bf_offs);
+	}
+	lua_pushnumber(l, bf_offs);
+	return 1;
+}
+
+static int lua_sb_ruletree_new_binary_info_cache(lua_State *l)
+{
+	int	n = lua_gettop(l);
+	ruletree_object_offset_t	bic_offs = 0;
+
+	if (n == 1) {
+		uint32_t	num_entries = lua_tointeger(l, 1);
+		bic_offs = ruletree_binary_info_cache_create(num_entries);
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"%s(%u) => %d", __func__, num_entries, bic_offs);
+	} else {
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"%s => %d", __func__, bic_offs);
+	}
+	lua_pushnumber(l, bic_offs);
+	return 1;
+}
+
+/* ruletree.add_exec_preprocessing_rule_index_to_ruletree(rule_list_offs)
+*/
+static int lua_sb_add_exec_preprocessing_rule_index_to_ruletree(lua_State *l)
+{
+	int	n = lua_gettop(l);
+	uint32_t index_location = 0;
+
+	if (n == 1) {
+		ruletree_object_offset_t  rule_list_offs = lua_tointeger(l, 1);
+
+		index_location = add_exec_preprocessing_rule_index_to_ruletree(
+			rule_list_offs);
+
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"lua_sb_add_exec_preprocessing_rule_index_to_ruletree %d => %d",
+			rule_list_offs, index_location);
+	}
+	lua_pushnumber(l, index_location);
+	return 1;
+}
+
+/* ruletree.add_exec_policy_selection_rule_index_to_ruletree(rule_list_offs)
+*/
+static int lua_sb_add_exec_policy_selection_rule_index_to_ruletree(lua_State *l)
+{
+	int	n = lua_gettop(l);
+	uint32_t index_location = 0;
+
+	if (n == 1) {
+		ruletree_object_offset_t  rule_list_offs = lua_tointeger(l, 1);
+
+		index_location = add_exec_policy_selection_rule_index_to_ruletree(
+			rule_list_offs);
+
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"lua_sb_add_exec_policy_selection_rule_index_to_ruletree %d => %d",
+			rule_list_offs, index_location);
+	}
+	lua_pushnumber(l, index_location);
+	return 1;
+}
+
 static int lua_sb_add_exec_policy_selection_rule_to_ruletree(lua_State *l)
 {
 	int	n = lua_gettop(l);
@@ -518,6 +596,8 @@ static const luaL_Reg reg[] =
 	{"new_string",			lua_sb_ruletree_new_string},
 	{"new_uint32",			lua_sb_ruletree_new_uint32},
 	{"new_boolean",			lua_sb_ruletree_new_boolean},
+	{"new_bloomfilter",		lua_sb_ruletree_new_bloomfilter},
+	{"new_binary_info_cache",	lua_sb_ruletree_new_binary_info_cache},
 
 	{"attach_ruletree",		lua_sb_attach_ruletree},
 
@@ -526,7 +606,9 @@ static const luaL_Reg reg[] =
 
 	/* exec rules */
 	{"add_exec_preprocessing_rule_to_ruletree",	lua_sb_add_exec_preprocessing_rule_to_ruletree},
+	{"add_exec_preprocessing_rule_index_to_ruletree",	lua_sb_add_exec_preprocessing_rule_index_to_ruletree},
 	{"add_exec_policy_selection_rule_to_ruletree",	lua_sb_add_exec_policy_selection_rule_to_ruletree},
+	{"add_exec_policy_selection_rule_index_to_ruletree",	lua_sb_add_exec_policy_selection_rule_index_to_ruletree},
 
 	/* Network rules */
 	{"add_net_rule_to_ruletree",	lua_sb_add_net_rule_to_ruletree},
@@ -34,28 +34,31 @@
 #include <sys/un.h>
 
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "sb2_server.h"
 
 
-static void ruletree_cmd_clearfileinfo(
-	ruletree_rpc_msg_command_t *command,
-	ruletree_rpc_msg_reply_t *reply)
+/* returns RULETREE_RPC_MESSAGE_REPLY__* */
+uint32_t ruletree_cmd_clearfileinfo(const inodesimu_t *fileinfo)
 {
         inodesimu_t			istat_in_db;
 	ruletree_inodestat_handle_t	handle;
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "clearfileinfo dev=%lld ino=%lld",
-		(long long)command->rim_message.rimm_fileinfo.inodesimu_dev,
-		(long long)command->rim_message.rimm_fileinfo.inodesimu_ino);
+		(long long)fileinfo->inodesimu_dev,
+		(long long)fileinfo->inodesimu_ino);
 
 	ruletree_init_inodestat_handle(&handle,
-		command->rim_message.rimm_fileinfo.inodesimu_dev,
-		command->rim_message.rimm_fileinfo.inodesimu_ino);
+		fileinfo->inodesimu_dev,
+		fileinfo->inodesimu_ino);
 
 	if (ruletree_find_inodestat(&handle, &istat_in_db) < 0) {
 		/* not found. */
 		SB_LOG(SB_LOGLEVEL_DEBUG, "clearfileinfo: not found");
+		return(RULETREE_RPC_MESSAGE_REPLY__OK);
 	} else {
 		/* found - update */
 
@@ -66,60 +69,88 @@ static void ruletree_cmd_clearfileinfo(
 			/* FIXME ###################### Check return value */
 			dec_vperm_num_active_inodestats();
 		}
-		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+		return(RULETREE_RPC_MESSAGE_REPLY__OK);
 	}
 }
 
-static void ruletree_cmd_setfileinfo(
-	ruletree_rpc_msg_command_t *command,
-	ruletree_rpc_msg_reply_t *reply)
+/* returns RULETREE_RPC_MESSAGE_REPLY__* */
+uint32_t ruletree_cmd_setfileinfo(const inodesimu_t *fileinfo)
 {
         inodesimu_t			istat_in_db;
 	ruletree_inodestat_handle_t	handle;
 
-	istat_in_db = command->rim_message.rimm_fileinfo;
+	istat_in_db = *fileinfo;
 	SB_LOG(SB_LOGLEVEL_DEBUG, "setfileinfo dev=%lld ino=%lld",
 		(long long)istat_in_db.inodesimu_dev,
 		(long long)istat_in_db.inodesimu_ino);
 
 	ruletree_init_inodestat_handle(&handle,
-		command->rim_message.rimm_fileinfo.inodesimu_dev,
-		command->rim_message.rimm_fileinfo.inodesimu_ino);
+		fileinfo->inodesimu_dev,
+		fileinfo->inodesimu_ino);
 
 	if (ruletree_find_inodestat(&handle, &istat_in_db) < 0) {
 		/* not found. */
 		SB_LOG(SB_LOGLEVEL_DEBUG, "setfileinfo: not found, set");
-		ruletree_set_inodestat(&handle, &command->rim_message.rimm_fileinfo);
+		istat_in_db = *fileinfo;
+		ruletree_set_inodestat(&handle, &istat_in_db);
 		/* FIXME ###################### Check return value */
 		inc_vperm_num_active_inodestats();
-		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+		return(RULETREE_RPC_MESSAGE_REPLY__OK);
 	} else {
 		/* found - update */
 		uint32_t prev_active_fields = istat_in_db.inodesimu_active_fields;
 
 		SB_LOG(SB_LOGLEVEL_DEBUG, "setfileinfo: found, update");
-		if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+		if ((istat_in_db.inodesimu_flags & RULETREE_INODESTAT_FLAG_RESTORED) &&
+		    (fileinfo->inodesimu_flags & RULETREE_INODESTAT_FLAG_REAL_ID) &&
+		    !ruletree_inodestat_matches_real_id(&istat_in_db,
+			fileinfo->inodesimu_real_ctime_sec,
+			fileinfo->inodesimu_real_ctime_nsec,
+			fileinfo->inodesimu_real_size)) {
+			/* restored from a snapshot, but the file has been
+			 * replaced after that. Don't keep any of the old
+			 * fields. */
+			SB_LOG(SB_LOGLEVEL_NOTICE,
+				"setfileinfo: stale inodestats (dev=%llu ino=%llu), reset",
+				(unsigned long long)fileinfo->inodesimu_dev,
+				(unsigned long long)fileinfo->inodesimu_ino);
+			memset(&istat_in_db, 0, sizeof(istat_in_db));
+			istat_in_db.inodesimu_dev = fileinfo->inodesimu_dev;
+			istat_in_db.inodesimu_ino = fileinfo->inodesimu_ino;
+		}
+		if (fileinfo->inodesimu_real_ifmt)
+			istat_in_db.inodesimu_real_ifmt = fileinfo->inodesimu_real_ifmt;
+		if (fileinfo->inodesimu_flags & RULETREE_INODESTAT_FLAG_REAL_ID) {
+			/* the client has seen the real file now */
+			istat_in_db.inodesimu_real_ctime_sec =
+				fileinfo->inodesimu_real_ctime_sec;
+			istat_in_db.inodesimu_real_ctime_nsec =
+				fileinfo->inodesimu_real_ctime_nsec;
+			istat_in_db.inodesimu_real_size = fileinfo->inodesimu_real_size;
+			istat_in_db.inodesimu_flags = RULETREE_INODESTAT_FLAG_REAL_ID;
+		}
+		if (fileinfo->inodesimu_active_fields &
 		    RULETREE_INODESTAT_SIM_UID) {
-        		istat_in_db.inodesimu_uid = command->rim_message.rimm_fileinfo.inodesimu_uid;
+        		istat_in_db.inodesimu_uid = fileinfo->inodesimu_uid;
         		istat_in_db.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_UID;
 			SB_LOG(SB_LOGLEVEL_DEBUG, "setfileinfo: found, set uid to %d",
 				istat_in_db.inodesimu_uid);
 		}
-		if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+		if (fileinfo->inodesimu_active_fields &
 		    RULETREE_INODESTAT_SIM_GID) {
-        		istat_in_db.inodesimu_gid = command->rim_message.rimm_fileinfo.inodesimu_gid;
+        		istat_in_db.inodesimu_gid = fileinfo->inodesimu_gid;
         		istat_in_db.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_GID;
 			SB_LOG(SB_LOGLEVEL_DEBUG, "setfileinfo: found, set gid to %d",
 				istat_in_db.inodesimu_gid);
 		}
-		if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+		if (fileinfo->inodesimu_active_fields &
 		    (RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID)) {
-        		istat_in_db.inodesimu_mode = command->rim_message.rimm_fileinfo.inodesimu_mode;
-        		istat_in_db.inodesimu_suidsgid = command->rim_message.rimm_fileinfo.inodesimu_suidsgid;
+        		istat_in_db.inodesimu_mode = fileinfo->inodesimu_mode;
+        		istat_in_db.inodesimu_suidsgid = fileinfo->inodesimu_suidsgid;
         		istat_in_db.inodesimu_active_fields &=
 				~(RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID);
         		istat_in_db.inodesimu_active_fields |=
-				command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+				fileinfo->inodesimu_active_fields &
 				(RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID);
         		istat_in_db.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_MODE;
 			SB_LOG(SB_LOGLEVEL_DEBUG,
@@ -127,10 +158,10 @@ static void ruletree_cmd_setfileinfo(
 				istat_in_db.inodesimu_mode,
 				istat_in_db.inodesimu_suidsgid);
 		}
-		if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+		if (fileinfo->inodesimu_active_fields &
 		    RULETREE_INODESTAT_SIM_DEVNODE) {
-        		istat_in_db.inodesimu_devmode = command->rim_message.rimm_fileinfo.inodesimu_devmode;
-        		istat_in_db.inodesimu_rdev = command->rim_message.rimm_fileinfo.inodesimu_rdev;
+        		istat_in_db.inodesimu_devmode = fileinfo->inodesimu_devmode;
+        		istat_in_db.inodesimu_rdev = fileinfo->inodesimu_rdev;
         		istat_in_db.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_DEVNODE;
 			SB_LOG(SB_LOGLEVEL_DEBUG, "setfileinfo: found, set device: 0%o, 0x%X",
 				istat_in_db.inodesimu_devmode,
@@ -144,54 +175,62 @@ static void ruletree_cmd_setfileinfo(
 			/* was present, but inactive and has now
 			 * been reactivated. */
 			inc_vperm_num_active_inodestats();
+		} else if ((prev_active_fields != 0) &&
+		    (istat_in_db.inodesimu_active_fields == 0)) {
+			/* a stale entry was reset */
+			dec_vperm_num_active_inodestats();
 		}
-		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+		return(RULETREE_RPC_MESSAGE_REPLY__OK);
 	}
 }
 
-static void ruletree_cmd_releasefileinfo(
-	ruletree_rpc_msg_command_t *command,
-	ruletree_rpc_msg_reply_t *reply)
+/* returns RULETREE_RPC_MESSAGE_REPLY__* */
+uint32_t ruletree_cmd_releasefileinfo(const inodesimu_t *fileinfo)
 {
         inodesimu_t			istat_in_db;
 	ruletree_inodestat_handle_t	handle;
 
-	istat_in_db = command->rim_message.rimm_fileinfo;
+	istat_in_db = *fileinfo;
 	SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo dev=%lld ino=%lld",
 		(long long)istat_in_db.inodesimu_dev,
 		(long long)istat_in_db.inodesimu_ino);
 
 	ruletree_init_inodestat_handle(&handle,
-		command->rim_message.rimm_fileinfo.inodesimu_dev,
-		command->rim_message.rimm_fileinfo.inodesimu_ino);
+		fileinfo->inodesimu_dev,
+		fileinfo->inodesimu_ino);
 
 	if (ruletree_find_inodestat(&handle, &istat_in_db) < 0) {
 		/* not found. don't have to do anything. */
 		SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo: not found");
-		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+		return(RULETREE_RPC_MESSAGE_REPLY__OK);
 	} else {
 		/* found - update */
 		uint32_t prev_active_fields = istat_in_db.inodesimu_active_fields;
 
-		if (command->rim_message.rimm_fileinfo.inodesimu_active_fields) {
+		if (fileinfo->inodesimu_active_fields) {
 			/* there is something active */
 			SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo: found, update");
-			if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+			if (fileinfo->inodesimu_active_fields &
 			    RULETREE_INODESTAT_SIM_UID) {
 				SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo: release uid");
 				istat_in_db.inodesimu_active_fields &= ~RULETREE_INODESTAT_SIM_UID;
 			}
-			if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+			if (fileinfo->inodesimu_active_fields &
 			    RULETREE_INODESTAT_SIM_GID) {
 				SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo: release gid");
 				istat_in_db.inodesimu_active_fields &= ~RULETREE_INODESTAT_SIM_GID;
 			}
-			if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+			if (fileinfo->inodesimu_active_fields &
 			    RULETREE_INODESTAT_SIM_MODE) {
 				SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo: found, release mode");
 				istat_in_db.inodesimu_active_fields &= ~RULETREE_INODESTAT_SIM_MODE;
 			}
-			if (command->rim_message.rimm_fileinfo.inodesimu_active_fields &
+			if (fileinfo->inodesimu_active_fields &
+			    RULETREE_INODESTAT_SIM_SUIDSGID) {
+				SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo: found, release suid/sgid");
+				istat_in_db.inodesimu_active_fields &= ~RULETREE_INODESTAT_SIM_SUIDSGID;
+			}
+			if (fileinfo->inodesimu_active_fields &
 			    RULETREE_INODESTAT_SIM_DEVNODE) {
 				SB_LOG(SB_LOGLEVEL_DEBUG, "releasefileinfo: found, release device node");
 				istat_in_db.inodesimu_active_fields &= ~RULETREE_INODESTAT_SIM_DEVNODE;
@@ -204,10 +243,211 @@ static void ruletree_cmd_releasefileinfo(
 			/* went to inactive state. */
 			dec_vperm_num_active_inodestats();
 		}
-		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+		return(RULETREE_RPC_MESSAGE_REPLY__OK);
 	}
 }
 
+/* ----- statistics -----
+ * Updated by several threads, always with atomic operations. */
+#define LATENCY_HISTOGRAM_BUCKETS	32	/* bucket N: < 2^N usec */
+
+static struct {
+	uint64_t	num_commands[RULETREE_RPC_STATS_MAX_COMMAND+1];
+	uint64_t	num_batch_records;
+	uint32_t	writer_queue_depth;
+	uint32_t	writer_queue_max_depth;
+	uint64_t	latency_histogram[LATENCY_HISTOGRAM_BUCKETS];
+	uint32_t	latency_max_usec;
+} server_stats;
+
+static void stats_count_command(const ruletree_rpc_msg_command_t *command)
+{
+	uint32_t	type = command->rimc_message_type;
+
+	if (type > RULETREE_RPC_STATS_MAX_COMMAND) type = 0;
+	__atomic_fetch_add(&server_stats.num_commands[type], 1, __ATOMIC_RELAXED);
+}
+
+static void stats_record_latency(const ruletree_server_job_t *job)
+{
+	struct timespec	now;
+	uint64_t	usec;
+	uint32_t	bucket = 0;
+	uint32_t	prev_max;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - job->rsj_received_at.tv_sec) * 1000000ULL +
+		(now.tv_nsec - job->rsj_received_at.tv_nsec) / 1000;
+	while ((bucket < LATENCY_HISTOGRAM_BUCKETS - 1) &&
+	       (usec >= (1ULL << bucket))) bucket++;
+	__atomic_fetch_add(&server_stats.latency_histogram[bucket], 1,
+		__ATOMIC_RELAXED);
+
+	if (usec > UINT32_MAX) usec = UINT32_MAX;
+	prev_max = __atomic_load_n(&server_stats.latency_max_usec, __ATOMIC_RELAXED);
+	while ((usec > prev_max) &&
+	       !__atomic_compare_exchange_n(&server_stats.latency_max_usec,
+			&prev_max, (uint32_t)usec, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* returns upper bound of the bucket that contains the percentile */
+static uint32_t stats_latency_percentile(const uint64_t *histogram,
+	uint64_t total, uint32_t percent)
+{
+	uint64_t	limit = (total * percent + 99) / 100;
+	uint64_t	sum = 0;
+	uint32_t	bucket;
+
+	if (total == 0) return(0);
+	for (bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++) {
+		sum += histogram[bucket];
+		if (sum >= limit) break;
+	}
+	if (bucket >= 31) return(UINT32_MAX);
+	return((uint32_t)1 << bucket);
+}
+
+static void ruletree_cmd_stats(ruletree_rpc_msg_reply_t *reply,
+	size_t *reply_sizep)
+{
+	ruletree_rpc_stats_t	*st = &reply->msg.rimr_stats;
+	ruletree_usage_stats_t	usage;
+	uint64_t	histogram[LATENCY_HISTOGRAM_BUCKETS];
+	uint64_t	total = 0;
+	uint32_t	i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i <= RULETREE_RPC_STATS_MAX_COMMAND; i++)
+		st->rist_num_commands[i] = __atomic_load_n(
+			&server_stats.num_commands[i], __ATOMIC_RELAXED);
+	st->rist_num_batch_records = __atomic_load_n(
+		&server_stats.num_batch_records, __ATOMIC_RELAXED);
+	st->rist_writer_queue_depth = __atomic_load_n(
+		&server_stats.writer_queue_depth, __ATOMIC_RELAXED);
+	st->rist_writer_queue_max_depth = __atomic_load_n(
+		&server_stats.writer_queue_max_depth, __ATOMIC_RELAXED);
+
+	for (i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+		histogram[i] = __atomic_load_n(&server_stats.latency_histogram[i],
+			__ATOMIC_RELAXED);
+		total += histogram[i];
+	}
+	st->rist_latency_p50_usec = stats_latency_percentile(histogram, total, 50);
+	st->rist_latency_p90_usec = stats_latency_percentile(histogram, total, 90);
+	st->rist_latency_p99_usec = stats_latency_percentile(histogram, total, 99);
+	st->rist_latency_max_usec = __atomic_load_n(
+		&server_stats.latency_max_usec, __ATOMIC_RELAXED);
+	if (st->rist_latency_p50_usec > st->rist_latency_max_usec)
+		st->rist_latency_p50_usec = st->rist_latency_max_usec;
+	if (st->rist_latency_p90_usec > st->rist_latency_max_usec)
+		st->rist_latency_p90_usec = st->rist_latency_max_usec;
+	if (st->rist_latency_p99_usec > st->rist_latency_max_usec)
+		st->rist_latency_p99_usec = st->rist_latency_max_usec;
+
+	/* this reads the rule tree while the writer may be adding
+	 * to it; that is safe, clients do the same. */
+	ruletree_get_usage_stats(&usage);
+	st->rist_ruletree_file_size = usage.rtus_file_size;
+	st->rist_ruletree_max_size = usage.rtus_max_size;
+	st->rist_inodestats_live = usage.rtus_inodestats_live;
+	st->rist_inodestats_dead = usage.rtus_inodestats_dead;
+	st->rist_inodestats_max_depth = usage.rtus_inodestats_max_depth;
+	st->rist_inodestat_devices = usage.rtus_inodestat_devices;
+
+	reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+	*reply_sizep = sizeof(ruletree_rpc_msg_reply_hdr_t) + sizeof(*st);
+}
+
+static void ruletree_cmd_fileinfo_batch(
+	ruletree_rpc_msg_command_t *command,
+	size_t command_size,
+	ruletree_rpc_msg_reply_t *reply,
+	size_t *reply_sizep)
+{
+	uint32_t	num_records;
+	uint32_t	i;
+
+	num_records = command->rim_message.rimm_fileinfo_batch.rimb_num_records;
+	if ((num_records > RULETREE_RPC_FILEINFO_BATCH_MAX) ||
+	    (command_size < offsetof(ruletree_rpc_msg_command_t,
+			rim_message.rimm_fileinfo_batch.rimb_records) +
+		num_records * sizeof(ruletree_rpc_fileinfo_record_t))) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"fileinfo_batch: bad message (%u records, %d bytes)",
+			num_records, (int)command_size);
+		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__FAILED;
+		return;
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "fileinfo_batch: %u records", num_records);
+	__atomic_fetch_add(&server_stats.num_batch_records, num_records,
+		__ATOMIC_RELAXED);
+
+	for (i = 0; i < num_records; i++) {
+		ruletree_rpc_fileinfo_record_t *rec =
+			&command->rim_message.rimm_fileinfo_batch.rimb_records[i];
+		uint32_t status;
+
+		switch (rec->rimb_command) {
+		case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+			status = ruletree_cmd_setfileinfo(&rec->rimb_fileinfo);
+			break;
+		case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+			status = ruletree_cmd_releasefileinfo(&rec->rimb_fileinfo);
+			break;
+		case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+			status = ruletree_cmd_clearfileinfo(&rec->rimb_fileinfo);
+			break;
+		default:
+			status = RULETREE_RPC_MESSAGE_REPLY__UNKNOWNCMD;
+		}
+		reply->msg.rimr_batch_status[i] = status;
+	}
+	reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+	*reply_sizep = sizeof(ruletree_rpc_msg_reply_hdr_t) + num_records;
+}
+
+static void ruletree_cmd_vperm_import(
+	ruletree_rpc_msg_command_t *command,
+	size_t command_size,
+	ruletree_rpc_msg_reply_t *reply,
+	size_t *reply_sizep)
+{
+	const char	*args = command->rim_message.rimm_vperm_import;
+	size_t		args_size;
+	const char	*manifest_path;
+	const char	*root_dir;
+	char		*result;
+
+	/* two NUL-terminated strings */
+	args_size = command_size - offsetof(ruletree_rpc_msg_command_t,
+		rim_message.rimm_vperm_import);
+	if ((command_size < offsetof(ruletree_rpc_msg_command_t,
+			rim_message.rimm_vperm_import)) ||
+	    (args_size > RULETREE_RPC_VPERM_IMPORT_MAX_SIZE) ||
+	    !memchr(args, '\0', args_size) ||
+	    !memchr(args + strlen(args) + 1, '\0',
+		args_size - strlen(args) - 1)) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"vperm_import: bad message (%d bytes)", (int)command_size);
+		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__FAILED;
+		return;
+	}
+	manifest_path = args;
+	root_dir = args + strlen(args) + 1;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "vperm_import: %s, root=%s",
+		manifest_path, root_dir);
+
+	result = vperm_import_manifest(manifest_path, root_dir);
+	snprintf(reply->msg.rimr_str, sizeof(reply->msg.rimr_str), "%s",
+		(result ? result : "No result"));
+	free(result);
+	reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__MESSAGE;
+	*reply_sizep = sizeof(ruletree_rpc_msg_reply_hdr_t) +
+		strlen(reply->msg.rimr_str) + 1;
+}
+
 static void ruletree_cmd_init2(ruletree_rpc_msg_reply_t *reply)
 {
 	char *result;
@@ -218,62 +458,274 @@ static void ruletree_cmd_init2(ruletree_rpc_msg_reply_t *reply)
 	reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__MESSAGE;
 }
 
+/* Minimum size of a command of type "type". FILEINFO_BATCH and
+ * VPERM_IMPORT are variable-length, their handlers check the rest. */
+static size_t ruletree_command_min_size(uint32_t type)
+{
+	switch (type) {
+	case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+	case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+	case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+		return(RULETREE_RPC_COMMAND_SIZE(rimm_fileinfo));
+	}
+	return(offsetof(ruletree_rpc_msg_command_t, rim_message));
+}
+
+/* Execute one command. Commands that modify the rule tree
+ * must be executed only by the writer thread (see below). */
+static void ruletree_handle_command(
+	ruletree_rpc_msg_command_t *command,
+	size_t command_size,
+	ruletree_rpc_msg_reply_t *reply,
+	size_t *reply_sizep)
+{
+	*reply_sizep = sizeof(ruletree_rpc_msg_reply_hdr_t);
+	if (command->rimc_message_protocol_version !=
+		RULETREE_RPC_PROTOCOL_VERSION) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, 
+			"wrong protocol version %d",
+				command->rimc_message_protocol_version);
+		reply->hdr.rimr_message_type =
+			RULETREE_RPC_MESSAGE_REPLY__PROTOVRSERR;
+	} else if (command_size <
+		   ruletree_command_min_size(command->rimc_message_type)) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"command %d is too short (%d bytes)",
+			command->rimc_message_type, (int)command_size);
+		reply->hdr.rimr_message_type =
+			RULETREE_RPC_MESSAGE_REPLY__FAILED;
+	} else {
+		SB_LOG(SB_LOGLEVEL_DEBUG, 
+			"got command %d", command->rimc_message_type);
+		switch (command->rimc_message_type) {
+		case RULETREE_RPC_MESSAGE_COMMAND__PING:
+			reply->hdr.rimr_message_type =
+				RULETREE_RPC_MESSAGE_REPLY__OK;
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__INIT2:
+			ruletree_cmd_init2(reply);
+			*reply_sizep = sizeof(ruletree_rpc_msg_reply_hdr_t) +
+				strlen(reply->msg.rimr_str) + 1;
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+			reply->hdr.rimr_message_type =
+				ruletree_cmd_setfileinfo(
+				    &command->rim_message.rimm_fileinfo);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+			reply->hdr.rimr_message_type =
+				ruletree_cmd_releasefileinfo(
+				    &command->rim_message.rimm_fileinfo);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+			reply->hdr.rimr_message_type =
+				ruletree_cmd_clearfileinfo(
+				    &command->rim_message.rimm_fileinfo);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__FILEINFO_BATCH:
+			ruletree_cmd_fileinfo_batch(command,
+				command_size, reply, reply_sizep);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__STATS:
+			ruletree_cmd_stats(reply, reply_sizep);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__VPERM_IMPORT:
+			ruletree_cmd_vperm_import(command,
+				command_size, reply, reply_sizep);
+			break;
+
+		default:
+			reply->hdr.rimr_message_type =
+				RULETREE_RPC_MESSAGE_REPLY__UNKNOWNCMD;
+		}
+	}
+	reply->hdr.rimr_message_protocol_version = command->rimc_message_protocol_version;
+	reply->hdr.rimr_message_serial = command->rimc_message_serial;
+}
+
+/* Commands that don't modify the rule tree. These are executed
+ * immediately by the thread that received them, so they are never
+ * stuck behind a long command (e.g. INIT2). Malformed commands
+ * get their error reply the same way. */
+static int ruletree_command_is_readonly(const ruletree_rpc_msg_command_t *command)
+{
+	if (command->rimc_message_protocol_version !=
+		RULETREE_RPC_PROTOCOL_VERSION) return(1);
+
+	switch (command->rimc_message_type) {
+	case RULETREE_RPC_MESSAGE_COMMAND__INIT2:
+	case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+	case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+	case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+	case RULETREE_RPC_MESSAGE_COMMAND__FILEINFO_BATCH:
+	case RULETREE_RPC_MESSAGE_COMMAND__VPERM_IMPORT:
+		return(0);
+	}
+	return(1);
+}
+
+/* ----- the writer thread -----
+ * All modifications to the rule tree are done by one thread.
+ * Jobs are queued by the socket loop and by the command queue thread
+ * (cmdq_server.c); the writer takes everything that is in the queue
+ * at once and executes the jobs in the order they arrived.
+*/
+static pthread_mutex_t	writer_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	writer_queue_cond = PTHREAD_COND_INITIALIZER;
+static ruletree_server_job_t	*writer_queue_first = NULL;
+static ruletree_server_job_t	*writer_queue_last = NULL;
+static pthread_t		writer_tid;
+static int			writer_running = 0;
+static int			writer_stopping = 0;	/* protected by the mutex */
+
+static void *ruletree_writer_thread(void *arg)
+{
+	(void)arg;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "writer thread started");
+	while (1) {
+		ruletree_server_job_t	*jobs;
+		int			num_jobs = 0;
+
+		pthread_mutex_lock(&writer_queue_mutex);
+		while (!writer_queue_first && !writer_stopping)
+			pthread_cond_wait(&writer_queue_cond, &writer_queue_mutex);
+		if (!writer_queue_first) {
+			/* stopping, and the queue has been drained */
+			pthread_mutex_unlock(&writer_queue_mutex);
+			break;
+		}
+		jobs = writer_queue_first;
+		writer_queue_first = writer_queue_last = NULL;
+		pthread_mutex_unlock(&writer_queue_mutex);
+
+		while (jobs) {
+			ruletree_server_job_t	*job = jobs;
+
+			jobs = job->rsj_next;
+			ruletree_handle_command(job->rsj_command,
+				job->rsj_command_size, job->rsj_reply,
+				&job->rsj_reply_size);
+			stats_record_latency(job);
+			(*job->rsj_complete)(job);
+			__atomic_fetch_sub(&server_stats.writer_queue_depth, 1,
+				__ATOMIC_RELAXED);
+			num_jobs++;
+		}
+		SB_LOG(SB_LOGLEVEL_DEBUG, "writer: %d jobs done", num_jobs);
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "writer thread stopped");
+	return(NULL);
+}
+
+static void start_ruletree_writer(void)
+{
+	if (pthread_create(&writer_tid, NULL, ruletree_writer_thread, NULL) != 0) {
+		fprintf(stderr, "%s: Fatal: Failed to create writer thread\n",
+			progname);
+		exit(1);
+	}
+	writer_running = 1;
+}
+
+/* Execute the jobs that are still in the queue, and stop the writer.
+ * Called at shutdown, after ruletree_server() has returned and the
+ * command queue thread has been stopped; nothing modifies the tree
+ * after this. */
+void stop_ruletree_writer(void)
+{
+	if (!writer_running) return;
+
+	pthread_mutex_lock(&writer_queue_mutex);
+	writer_stopping = 1;
+	pthread_cond_signal(&writer_queue_cond);
+	pthread_mutex_unlock(&writer_queue_mutex);
+	pthread_join(writer_tid, NULL);
+	writer_running = 0;
+}
+
+/* Execute a command, or queue it for the writer thread.
+ * job->rsj_complete() is called when the reply is ready. */
+void ruletree_server_submit_job(ruletree_server_job_t *job)
+{
+	uint32_t	depth;
+	uint32_t	prev_max;
+
+	clock_gettime(CLOCK_MONOTONIC, &job->rsj_received_at);
+	stats_count_command(job->rsj_command);
+
+	if (ruletree_command_is_readonly(job->rsj_command)) {
+		ruletree_handle_command(job->rsj_command,
+			job->rsj_command_size, job->rsj_reply,
+			&job->rsj_reply_size);
+		stats_record_latency(job);
+		(*job->rsj_complete)(job);
+		return;
+	}
+
+	depth = __atomic_add_fetch(&server_stats.writer_queue_depth, 1,
+		__ATOMIC_RELAXED);
+	prev_max = __atomic_load_n(&server_stats.writer_queue_max_depth,
+		__ATOMIC_RELAXED);
+	while ((depth > prev_max) &&
+	       !__atomic_compare_exchange_n(&server_stats.writer_queue_max_depth,
+			&prev_max, depth, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	job->rsj_next = NULL;
+	pthread_mutex_lock(&writer_queue_mutex);
+	if (writer_queue_last) writer_queue_last->rsj_next = job;
+	else writer_queue_first = job;
+	writer_queue_last = job;
+	pthread_cond_signal(&writer_queue_cond);
+	pthread_mutex_unlock(&writer_queue_mutex);
+}
+
+/* ----- the socket loop ----- */
+
+static void complete_socket_job(ruletree_server_job_t *job)
+{
+	send_reply_to_client(&job->rsj_client_address,
+		job->rsj_client_addr_len, job->rsj_reply, job->rsj_reply_size);
+	free(job);
+}
+
 void ruletree_server(void)
 {
-	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
-	struct sockaddr_un		client_address;
+	ruletree_server_job_t	*job = NULL;
+
+	start_ruletree_writer();
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "Entering server loop");
 	while (1) {
 		int	r;
-		size_t	reply_size = sizeof(ruletree_rpc_msg_reply_hdr_t);
+
+		if (!job) {
+			job = calloc(1, sizeof(*job));
+			if (!job) {
+				SB_LOG(SB_LOGLEVEL_ERROR,
+					"%s: Out of memory", progname);
+				return;
+			}
+		}
 
 		SB_LOG(SB_LOGLEVEL_DEBUG, "get message");
-		r = receive_command_from_server_socket(&client_address, &command);
+		r = receive_command_from_server_socket(
+			&job->rsj_client_address, &job->rsj_client_addr_len,
+			&job->rsj_command_buf, &job->rsj_command_size);
 		switch (r) {
 		case RPC_COMMAND_RECEIVED:
-			if (command.rimc_message_protocol_version !=
-				RULETREE_RPC_PROTOCOL_VERSION) {
-				SB_LOG(SB_LOGLEVEL_DEBUG, 
-					"wrong protocol version %d",
-						command.rimc_message_protocol_version);
-			} else {
-				SB_LOG(SB_LOGLEVEL_DEBUG, 
-					"got command %d", command.rimc_message_type);
-				switch (command.rimc_message_type) {
-				case RULETREE_RPC_MESSAGE_COMMAND__PING:
-					reply.hdr.rimr_message_type =
-						RULETREE_RPC_MESSAGE_REPLY__OK;
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__INIT2:
-					ruletree_cmd_init2(&reply);
-					reply_size = sizeof(ruletree_rpc_msg_reply_hdr_t) +
-						strlen(reply.msg.rimr_str) + 1;
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
-					ruletree_cmd_setfileinfo(&command,&reply);
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
-					ruletree_cmd_releasefileinfo(&command,&reply);
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
-					ruletree_cmd_clearfileinfo(&command,&reply);
-					break;
-
-				default:
-					reply.hdr.rimr_message_type =
-						RULETREE_RPC_MESSAGE_REPLY__UNKNOWNCMD;
-				}
-			}
-			reply.hdr.rimr_message_protocol_version = command.rimc_message_protocol_version;
-			reply.hdr.rimr_message_serial = command.rimc_message_serial;
-
-			send_reply_to_client(&client_address, &reply, reply_size);
+			job->rsj_command = &job->rsj_command_buf;
+			job->rsj_reply = &job->rsj_reply_buf;
+			job->rsj_complete = complete_socket_job;
+			ruletree_server_submit_job(job);
+			job = NULL;
 			break;
 		case RECEIVE_FAILED_TRY_AGAIN:
 			SB_LOG(SB_LOGLEVEL_DEBUG,
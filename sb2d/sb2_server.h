@@ -18,13 +18,61 @@ extern char *execute_init2_script(void);
 
 extern void create_server_socket(void);
 extern void ruletree_server(void);
+extern void stop_ruletree_writer(void);
+
+/* A command that has been received from a client, and the reply to it.
+ * Jobs from the socket use the buffers in the job itself; jobs from
+ * the command queue point to the slot in shared memory. */
+typedef struct ruletree_server_job_s ruletree_server_job_t;
+struct ruletree_server_job_s {
+	ruletree_server_job_t		*rsj_next;	/* writer queue */
+
+	ruletree_rpc_msg_command_t	*rsj_command;
+	size_t				rsj_command_size;
+	ruletree_rpc_msg_reply_t	*rsj_reply;
+	size_t				rsj_reply_size;
+
+	/* called when the reply is ready; sends the reply
+	 * and releases the job */
+	void				(*rsj_complete)(ruletree_server_job_t *job);
+	void				*rsj_cmdq_slot;
+
+	struct timespec			rsj_received_at;	/* for stats */
+
+	struct sockaddr_un		rsj_client_address;
+	socklen_t			rsj_client_addr_len;
+	ruletree_rpc_msg_command_t	rsj_command_buf;
+	ruletree_rpc_msg_reply_t	rsj_reply_buf;
+};
+
+extern void ruletree_server_submit_job(ruletree_server_job_t *job);
+
+/* cmdq_server.c */
+extern void create_cmdq(void);
+extern void start_cmdq_server(void);
+extern void stop_cmdq_server(void);
+
+/* ruletree_server.c: vperm commands, return RULETREE_RPC_MESSAGE_REPLY__* */
+extern uint32_t ruletree_cmd_setfileinfo(const inodesimu_t *fileinfo);
+extern uint32_t ruletree_cmd_releasefileinfo(const inodesimu_t *fileinfo);
+extern uint32_t ruletree_cmd_clearfileinfo(const inodesimu_t *fileinfo);
+
+/* vperm_import.c */
+extern char *vperm_import_manifest(const char *manifest_path,
+	const char *root_dir);
+
+/* vperm_snapshot.c */
+extern int vperm_snapshot_load(const char *path, const char *target_root);
+extern int vperm_snapshot_save(const char *path, const char *target_root);
 
 extern void send_reply_to_client(struct sockaddr_un *client_address,
+	socklen_t client_addr_len,
 	ruletree_rpc_msg_reply_t *reply,
 	size_t reply_size);
 
 extern int receive_command_from_server_socket(struct sockaddr_un *client_address,
-	ruletree_rpc_msg_command_t *command);
+	socklen_t *client_addr_lenp,
+	ruletree_rpc_msg_command_t *command, size_t *command_sizep);
 /* return codes from receive_command_from_server_socket(): */
 #define RPC_COMMAND_RECEIVED		1
 #define RECEIVE_FAILED_TRY_AGAIN	2
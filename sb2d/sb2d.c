@@ -239,6 +239,8 @@ int main(int argc, char *argv[])
 	uint32_t max_size = 16*1024*1024; /* default 16MB */
 	uint64_t min_mmap_addr = 0;
 	int	min_client_socket_fd = 279;
+	char	*vperm_snapshot_path = NULL;
+	char	*target_root = NULL;
 
 	progname = argv[0];
 
@@ -253,7 +255,7 @@ int main(int argc, char *argv[])
 	assert(sizeof(uint32_t) >= sizeof(gid_t));
 	assert(sizeof(uint32_t) >= sizeof(mode_t));
 
-	while ((opt = getopt(argc, argv, "d:l:s:p:nfS:M:F:")) != -1) {
+	while ((opt = getopt(argc, argv, "d:l:s:p:nfS:M:F:P:T:")) != -1) {
 		switch (opt) {
 		case 'd':
 			debug_level = strdup(optarg);
@@ -282,6 +284,12 @@ int main(int argc, char *argv[])
 		case 'F':
 			min_client_socket_fd = parse_num(optarg);
 			break;
+		case 'P': /* vperm snapshot file */
+			vperm_snapshot_path = strdup(optarg);
+			break;
+		case 'T': /* target root; identity of the vperm snapshot */
+			target_root = strdup(optarg);
+			break;
 		default:
 			fprintf(stderr, "Illegal option\n");
 			exit(1);
@@ -319,12 +327,16 @@ int main(int argc, char *argv[])
 
 	initialize_lua();
 
+	if (vperm_snapshot_path)
+		vperm_snapshot_load(vperm_snapshot_path, target_root);
+
 	/* ----- Server ----- */
 	if (start_server) {
 		pid_t worker_pid;
 
 		SB_LOG(SB_LOGLEVEL_DEBUG, "Initializing server");
 		create_server_socket();
+		create_cmdq();
 
 		/* Write PID to a file */
 		if (backgroud_server) {
@@ -341,7 +353,16 @@ int main(int argc, char *argv[])
 		/* enter the server loop. 
 		 * ruletree_server() returns when the socket has been
 		 * deleted and it is time to shut down. */
+		start_cmdq_server();
 		ruletree_server();
+
+		/* execute everything that is still in the queues
+		 * before the snapshot is taken */
+		stop_cmdq_server();
+		stop_ruletree_writer();
+
+		if (vperm_snapshot_path)
+			vperm_snapshot_save(vperm_snapshot_path, target_root);
 	}
 	return(0);
 }
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <stddef.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -24,6 +25,7 @@
 #include <sys/un.h>
 
 #include <sys/inotify.h>
+#include <sys/epoll.h>
 
 #include "sb2_server.h"
 
@@ -32,6 +34,7 @@ static socklen_t	server_addr_len;
 static int server_socket = -1;
 static int inotify_fd = -1;
 static int inotify_server_sock_dir_wd = -1;
+static int epoll_fd = -1;
 static char *server_sock_dir = NULL;
 
 static void initialize_server_address(void)
@@ -64,6 +67,19 @@ static void initialize_server_address(void)
 	free(sock_path);
 }
 
+static void add_fd_to_epoll_set(int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		fprintf(stderr, "%s: Fatal: epoll_ctl failed\n", progname);
+		exit(1);
+	}
+}
+
 void create_server_socket(void)
 {
 	server_socket = socket(PF_UNIX, SOCK_DGRAM, 0);
@@ -92,94 +108,132 @@ void create_server_socket(void)
 		server_sock_dir, IN_DELETE);
 	SB_LOG(SB_LOGLEVEL_DEBUG, "inotify_fd = %d, inotify_server_sock_dir_wd = %d",
 		inotify_fd, inotify_server_sock_dir_wd);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fprintf(stderr, "%s: Fatal: epoll_create1 failed\n", progname);
+		exit(1);
+	}
+	add_fd_to_epoll_set(server_socket);
+	add_fd_to_epoll_set(inotify_fd);
 }
 
 void send_reply_to_client(struct sockaddr_un *client_address,
+	socklen_t client_addr_len,
 	ruletree_rpc_msg_reply_t *reply,
 	size_t reply_size)
 {
 	ssize_t	sent_msg_size;
 
 	sent_msg_size = sendto(server_socket, reply, reply_size, 0,
-		client_address,
-		sizeof(sa_family_t) + strlen(client_address->sun_path) + 1);
-	SB_LOG(SB_LOGLEVEL_DEBUG, "sendto => %d (%s)",
-		(int)sent_msg_size, client_address->sun_path);
+		client_address, client_addr_len);
+	/* clients use autobound addresses in the abstract namespace
+	 * (sun_path starts with a '\0') */
+	SB_LOG(SB_LOGLEVEL_DEBUG, "sendto => %d (%s%s)",
+		(int)sent_msg_size,
+		(client_address->sun_path[0] ? "" : "@"),
+		(client_address->sun_path[0] ? client_address->sun_path :
+			client_address->sun_path + 1));
 }
 
-int receive_command_from_server_socket(struct sockaddr_un *client_address,
-	ruletree_rpc_msg_command_t *command)
+static int handle_inotify_events(void)
 {
-	ssize_t	received_msg_size;
-	socklen_t addrlen = sizeof(struct sockaddr_un);
-	fd_set in_set;
-	int selected;
-
-	FD_ZERO(&in_set);
-	FD_SET(server_socket, &in_set);
-	FD_SET(inotify_fd, &in_set);
-
-	selected = select((server_socket < inotify_fd) ? (inotify_fd + 1) : (server_socket + 1),
-		&in_set, NULL, NULL, NULL);
-	if (selected <= 0) {
-		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: select returned %d?",
-			__func__, selected);
-		if (selected < 0) return(-2);
-		return(RECEIVE_FAILED_TRY_AGAIN);
-	}
-
-	SB_LOG(SB_LOGLEVEL_DEBUG, "select => %d", selected);
-
-	if (FD_ISSET(server_socket, &in_set)) {
-		received_msg_size = recvfrom(server_socket, command, sizeof(*command), 0,
-			(struct sockaddr*)client_address, &addrlen);
-		SB_LOG(SB_LOGLEVEL_DEBUG, "recvfrom => %d (%s)", 
-			(int)received_msg_size, client_address->sun_path);
-		if (received_msg_size <= 0) {
-			perror(progname);
-			return (RECEIVE_FAILED_TRY_AGAIN);
-		}
-		/* FIXME: If message is too small... */
-		return(RPC_COMMAND_RECEIVED);
-	}
-	if (FD_ISSET(inotify_fd, &in_set)) {
-		char eventbuf[50 * (sizeof(struct inotify_event) + 30)];
-		int eb_len, event_idx;
-
-		SB_LOG(SB_LOGLEVEL_DEBUG, "I've been inotified");
-		eb_len = read(inotify_fd, eventbuf, sizeof(eventbuf));
-		if (eb_len < 0) {
-			SB_LOG(SB_LOGLEVEL_ERROR,
-				"%s: Failed to receive inotify events",
-				progname);
-		} else for (event_idx = 0; event_idx < eb_len;) {
-			struct inotify_event *ie = (struct inotify_event*)(eventbuf+event_idx);
-
-			if (ie->wd != inotify_server_sock_dir_wd) {
-				fprintf(stderr, "%s: Warning: received inotify "
-					"event for an unknown descriptor\n", progname);
-			} else {
-				if (ie->mask & IN_DELETE) {
-					/* normally this does not happen (see comment
-					 * above) but if the delete events start
-					 * to work someday... */
-					SB_LOG(SB_LOGLEVEL_DEBUG, "%s: deleted = '%s'",
+	char eventbuf[50 * (sizeof(struct inotify_event) + 30)];
+	int eb_len, event_idx;
+
+	SB_LOG(SB_LOGLEVEL_DEBUG, "I've been inotified");
+	eb_len = read(inotify_fd, eventbuf, sizeof(eventbuf));
+	if (eb_len < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"%s: Failed to receive inotify events",
+			progname);
+	} else for (event_idx = 0; event_idx < eb_len;) {
+		struct inotify_event *ie = (struct inotify_event*)(eventbuf+event_idx);
+
+		if (ie->wd != inotify_server_sock_dir_wd) {
+			fprintf(stderr, "%s: Warning: received inotify "
+				"event for an unknown descriptor\n", progname);
+		} else {
+			if (ie->mask & IN_DELETE) {
+				/* normally this does not happen (see comment
+				 * above) but if the delete events start
+				 * to work someday... */
+				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: deleted = '%s'",
+					__func__, ie->name);
+				if (!strcmp(ie->name, "ssock")) {
+					SB_LOG(SB_LOGLEVEL_DEBUG,
+						"%s: server socket has been deleted.",
 						__func__, ie->name);
-					if (!strcmp(ie->name, "ssock")) {
-						SB_LOG(SB_LOGLEVEL_DEBUG,
-							"%s: server socket has been deleted.",
-							__func__, ie->name);
-						return(SOCKET_DELETED);
-					}
-				} else {
-					SB_LOG(SB_LOGLEVEL_WARNING,
-						"%s: Warning: received unexpected inotify "
-						"event, mask=0x%X\n", progname, ie->mask);
+					return(SOCKET_DELETED);
 				}
+			} else {
+				SB_LOG(SB_LOGLEVEL_WARNING,
+					"%s: Warning: received unexpected inotify "
+					"event, mask=0x%X\n", progname, ie->mask);
 			}
-			event_idx += sizeof(struct inotify_event) + ie->len;
 		}
+		event_idx += sizeof(struct inotify_event) + ie->len;
 	}
 	return(RECEIVE_FAILED_TRY_AGAIN);
 }
 
+/* Receive one command. The socket is drained with non-blocking
+ * reads; epoll is used to wait only when there is nothing to read. */
+int receive_command_from_server_socket(struct sockaddr_un *client_address,
+	socklen_t *client_addr_lenp,
+	ruletree_rpc_msg_command_t *command, size_t *command_sizep)
+{
+	while (1) {
+		ssize_t	received_msg_size;
+		socklen_t addrlen = sizeof(struct sockaddr_un);
+		struct epoll_event events[2];
+		int num_events;
+		int i;
+
+		/* abstract addresses are not NUL-terminated */
+		memset(client_address, 0, sizeof(*client_address));
+		received_msg_size = recvfrom(server_socket, command, sizeof(*command),
+			MSG_DONTWAIT, (struct sockaddr*)client_address, &addrlen);
+		if (received_msg_size > 0) {
+			SB_LOG(SB_LOGLEVEL_DEBUG, "recvfrom => %d (%s%s)", 
+				(int)received_msg_size,
+				(client_address->sun_path[0] ? "" : "@"),
+				(client_address->sun_path[0] ? client_address->sun_path :
+					client_address->sun_path + 1));
+			/* the header is needed even for an error reply;
+			 * handlers check the size of the payload */
+			if (received_msg_size < (ssize_t)offsetof(
+			    ruletree_rpc_msg_command_t, rim_message)) {
+				SB_LOG(SB_LOGLEVEL_ERROR,
+					"Dropped a short message (%d bytes)",
+					(int)received_msg_size);
+				continue;
+			}
+			*command_sizep = received_msg_size;
+			*client_addr_lenp = addrlen;
+			return(RPC_COMMAND_RECEIVED);
+		}
+		if ((received_msg_size < 0) && (errno != EAGAIN) &&
+		    (errno != EWOULDBLOCK) && (errno != EINTR)) {
+			perror(progname);
+			return (RECEIVE_FAILED_TRY_AGAIN);
+		}
+
+		num_events = epoll_wait(epoll_fd, events,
+			sizeof(events)/sizeof(events[0]), -1);
+		if (num_events < 0) {
+			if (errno == EINTR) continue;
+			SB_LOG(SB_LOGLEVEL_ERROR, "%s: epoll_wait failed",
+				__func__);
+			return(-2);
+		}
+		SB_LOG(SB_LOGLEVEL_NOISE, "epoll_wait => %d", num_events);
+
+		for (i = 0; i < num_events; i++) {
+			if (events[i].data.fd != inotify_fd) continue;
+			if (handle_inotify_events() == SOCKET_DELETED)
+				return(SOCKET_DELETED);
+		}
+		/* the socket, if it is readable, is read in the next round. */
+	}
+}
@@ -0,0 +1,303 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* sb2d, the rule tree server: bulk import of simulated ownerships
+ * and modes ("sb2dctl vperm-import").
+ *
+ * The manifest is a text file, one file per line:
+ *	path uid gid mode
+ * uid and gid are numeric, mode is octal (permission bits only;
+ * the file type is taken from the real file). "-" can be used for
+ * values that should not be changed. The path may contain spaces,
+ * the last three fields are the values. Empty lines and lines that
+ * start with '#' are ignored.
+ *
+ * Every file is lstat()ed (root_dir + path) and compared to the
+ * manifest, like vperm_chown() and vperm_chmod() do in libsb2: each
+ * of UID, GID, the permission bits and the SUID/SGID bits is
+ * simulated if it differs from the real file, and released if not.
+ * sb2d runs outside of the session, so both paths must be real
+ * (host) paths; inside a session, libsb2 maps them before they
+ * are sent (see sb2__ruletree_rpc__vperm_import__()), so the root
+ * directory then defaults to the target root ("/").
+ * Existing inodestats are updated one by one, and new ones are added
+ * with one call to ruletree_add_inodestats(), which builds a balanced
+ * tree. This is executed by the writer thread.
+ * If the same file is listed more than once, the last line wins.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sb2_server.h"
+
+/* parse the last whitespace-separated field of line[0..*lenp),
+ * and remove it from the line. Returns 0 if OK, 1 if the
+ * field was "-", -1 if error. */
+static int cut_last_field(char *line, size_t *lenp, int base,
+	unsigned long *valp)
+{
+	size_t	end = *lenp;
+	size_t	start;
+	char	*endp;
+
+	while ((end > 0) && isspace((unsigned char)line[end-1])) end--;
+	start = end;
+	while ((start > 0) && !isspace((unsigned char)line[start-1])) start--;
+	if (start == end) return(-1);
+	*lenp = start;
+	line[end] = '\0';
+	if (!strcmp(line + start, "-")) return(1);
+	errno = 0;
+	*valp = strtoul(line + start, &endp, base);
+	if (errno || *endp) return(-1);
+	return(0);
+}
+
+/* parse one line of the manifest. The path is terminated in place.
+ * Returns 0 if OK, 1 if empty/comment line, -1 if error. */
+static int parse_manifest_line(char *line, char **pathp,
+	int *set_uidp, uint32_t *uidp,
+	int *set_gidp, uint32_t *gidp,
+	int *set_modep, uint32_t *modep)
+{
+	size_t		len = strlen(line);
+	unsigned long	val;
+	int		r;
+
+	while ((len > 0) && isspace((unsigned char)line[len-1])) len--;
+	line[len] = '\0';
+	if ((len == 0) || (line[0] == '#')) return(1);
+
+	r = cut_last_field(line, &len, 8, &val);
+	if (r < 0) return(-1);
+	*set_modep = !r;
+	*modep = val & 07777;
+
+	r = cut_last_field(line, &len, 10, &val);
+	if (r < 0) return(-1);
+	*set_gidp = !r;
+	*gidp = val;
+
+	r = cut_last_field(line, &len, 10, &val);
+	if (r < 0) return(-1);
+	*set_uidp = !r;
+	*uidp = val;
+
+	while ((len > 0) && isspace((unsigned char)line[len-1])) len--;
+	if (len == 0) return(-1);
+	line[len] = '\0';
+	*pathp = line;
+	return(0);
+}
+
+struct new_istat_s {
+	inodesimu_t	ni_istat;
+	uint32_t	ni_line;
+};
+
+static int compare_new_istats(const void *a, const void *b)
+{
+	const struct new_istat_s *na = a;
+	const struct new_istat_s *nb = b;
+
+	if (na->ni_istat.inodesimu_dev != nb->ni_istat.inodesimu_dev)
+		return(na->ni_istat.inodesimu_dev < nb->ni_istat.inodesimu_dev ? -1 : 1);
+	if (na->ni_istat.inodesimu_ino != nb->ni_istat.inodesimu_ino)
+		return(na->ni_istat.inodesimu_ino < nb->ni_istat.inodesimu_ino ? -1 : 1);
+	return(na->ni_line < nb->ni_line ? -1 : (na->ni_line > nb->ni_line));
+}
+
+/* Add the new inodestats to the tree. If the same inode is listed
+ * more than once (hard links), the last line wins. */
+static uint32_t add_new_istats(struct new_istat_s *new_istats, uint32_t num_new)
+{
+	inodesimu_t	*istats;
+	uint32_t	num_istats = 0;
+	uint32_t	num_added;
+	uint32_t	i;
+
+	istats = malloc(num_new * sizeof(*istats));
+	if (!istats) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "vperm_import: Out of memory");
+		return(0);
+	}
+	qsort(new_istats, num_new, sizeof(*new_istats), compare_new_istats);
+	for (i = 0; i < num_new; i++) {
+		if ((i + 1 < num_new) &&
+		    (new_istats[i].ni_istat.inodesimu_dev ==
+		     new_istats[i+1].ni_istat.inodesimu_dev) &&
+		    (new_istats[i].ni_istat.inodesimu_ino ==
+		     new_istats[i+1].ni_istat.inodesimu_ino)) continue;
+		istats[num_istats++] = new_istats[i].ni_istat;
+	}
+	num_added = ruletree_add_inodestats(istats, num_istats);
+	for (i = 0; i < num_added; i++)
+		inc_vperm_num_active_inodestats();
+	free(istats);
+	return(num_added);
+}
+
+/* Returns a summary of the import (to be freed by the caller) */
+char *vperm_import_manifest(const char *manifest_path, const char *root_dir)
+{
+	FILE		*f;
+	char		*line = NULL;
+	size_t		line_size = 0;
+	char		*path = NULL;
+	struct new_istat_s	*new_istats = NULL;
+	uint32_t	num_new = 0;
+	uint32_t	max_new = 0;
+	uint32_t	num_lines = 0;
+	uint32_t	num_errors = 0;
+	uint32_t	num_updated = 0;
+	uint32_t	num_added = 0;
+	char		*result = NULL;
+
+	f = fopen(manifest_path, "r");
+	if (!f) {
+		if (asprintf(&result, "Failed to open %s (%s)",
+			manifest_path, strerror(errno)) < 0) return(NULL);
+		return(result);
+	}
+	if (!strcmp(root_dir, "/")) root_dir = "";
+
+	while (getline(&line, &line_size, f) >= 0) {
+		char				*mpath;
+		int				set_uid, set_gid, set_mode;
+		uint32_t			uid, gid, mode;
+		struct stat			sb;
+		inodesimu_t			istat;
+		inodesimu_t			istat_in_db;
+		ruletree_inodestat_handle_t	handle;
+		uint32_t			release_fields = 0;
+
+		num_lines++;
+		switch (parse_manifest_line(line, &mpath, &set_uid, &uid,
+			&set_gid, &gid, &set_mode, &mode)) {
+		case 0:
+			break;
+		case 1:
+			continue;
+		default:
+			SB_LOG(SB_LOGLEVEL_WARNING,
+				"vperm_import: %s:%u: syntax error",
+				manifest_path, num_lines);
+			num_errors++;
+			continue;
+		}
+
+		free(path);
+		path = NULL;
+		if ((asprintf(&path, "%s%s%s", root_dir,
+			(mpath[0] == '/' ? "" : "/"), mpath) < 0) ||
+		    (lstat(path, &sb) < 0)) {
+			SB_LOG(SB_LOGLEVEL_WARNING,
+				"vperm_import: %s:%u: can't stat %s",
+				manifest_path, num_lines, (path ? path : mpath));
+			num_errors++;
+			continue;
+		}
+
+		memset(&istat, 0, sizeof(istat));
+		istat.inodesimu_dev = sb.st_dev;
+		istat.inodesimu_ino = sb.st_ino;
+		istat.inodesimu_real_ifmt = sb.st_mode & S_IFMT;
+		istat.inodesimu_real_ctime_sec = sb.st_ctim.tv_sec;
+		istat.inodesimu_real_ctime_nsec = sb.st_ctim.tv_nsec;
+		istat.inodesimu_real_size = sb.st_size;
+		istat.inodesimu_flags = RULETREE_INODESTAT_FLAG_REAL_ID;
+		if (set_uid) {
+			istat.inodesimu_uid = uid;
+			if (sb.st_uid != uid)
+				istat.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_UID;
+			else
+				release_fields |= RULETREE_INODESTAT_SIM_UID;
+		}
+		if (set_gid) {
+			istat.inodesimu_gid = gid;
+			if (sb.st_gid != gid)
+				istat.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_GID;
+			else
+				release_fields |= RULETREE_INODESTAT_SIM_GID;
+		}
+		if (set_mode) {
+			/* the permission bits and the SUID/SGID bits are
+			 * separate fields, like in ruletree_rpc__vperm_set_mode() */
+			istat.inodesimu_mode = mode & ~(S_ISUID | S_ISGID);
+			istat.inodesimu_suidsgid = mode & (S_ISUID | S_ISGID);
+			if ((sb.st_mode & 07777 & ~(S_ISUID | S_ISGID)) !=
+			    (mode & ~(S_ISUID | S_ISGID)))
+				istat.inodesimu_active_fields |=
+					RULETREE_INODESTAT_SIM_MODE;
+			else
+				release_fields |= RULETREE_INODESTAT_SIM_MODE;
+			if ((sb.st_mode & (S_ISUID | S_ISGID)) !=
+			    (mode & (S_ISUID | S_ISGID)))
+				istat.inodesimu_active_fields |=
+					RULETREE_INODESTAT_SIM_SUIDSGID;
+			else
+				release_fields |= RULETREE_INODESTAT_SIM_SUIDSGID;
+		}
+
+		ruletree_init_inodestat_handle(&handle, sb.st_dev, sb.st_ino);
+		if (ruletree_find_inodestat(&handle, &istat_in_db) == 0) {
+			/* already known; update it as if the changes
+			 * came from clients. */
+			if (istat.inodesimu_active_fields)
+				ruletree_cmd_setfileinfo(&istat);
+			if (release_fields) {
+				istat.inodesimu_active_fields = release_fields;
+				ruletree_cmd_releasefileinfo(&istat);
+			}
+			num_updated++;
+			continue;
+		}
+		if (!istat.inodesimu_active_fields) continue;
+
+		if (num_new >= max_new) {
+			struct new_istat_s	*p;
+
+			max_new = (max_new ? 2 * max_new : 1024);
+			p = realloc(new_istats, max_new * sizeof(*new_istats));
+			if (!p) {
+				SB_LOG(SB_LOGLEVEL_ERROR,
+					"vperm_import: Out of memory");
+				num_errors++;
+				break;
+			}
+			new_istats = p;
+		}
+		new_istats[num_new].ni_istat = istat;
+		new_istats[num_new].ni_line = num_lines;
+		num_new++;
+	}
+	fclose(f);
+	free(line);
+	free(path);
+
+	if (num_new > 0)
+		num_added = add_new_istats(new_istats, num_new);
+	free(new_istats);
+
+	SB_LOG(SB_LOGLEVEL_INFO,
+		"vperm_import %s: %u lines, %u added, %u updated, %u errors",
+		manifest_path, num_lines, num_added, num_updated, num_errors);
+	if (asprintf(&result, "%u lines: %u added, %u updated, %u errors%s",
+		num_lines, num_added, num_updated, num_errors,
+		(num_errors ? " (see sb2d log)" : "")) < 0) return(NULL);
+	return(result);
+}
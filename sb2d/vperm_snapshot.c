@@ -0,0 +1,216 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* sb2d, the rule tree server: vperm snapshots.
+ *
+ * The simulated ownerships and modes ("vperm"/"inodestats") are
+ * saved to a file when the session ends, and loaded to the rule tree
+ * of the next session before any clients have been started (instead
+ * of recreating the state with one RPC call per file).
+ *
+ * The snapshot is keyed by dev/ino, like the inodestats tree itself.
+ * Two identity checks protect against reused inode numbers:
+ *  - the snapshot is ignored if the dev/ino of the target root
+ *    directory has changed (e.g. the rootfs was extracted again),
+ *  - every entry contains the type, ctime and size of the real file
+ *    as the clients saw it last time. Loaded entries are marked with
+ *    RULETREE_INODESTAT_FLAG_RESTORED; clients drop them if the real
+ *    file doesn't match anymore (the inode may have been reused, or
+ *    the file modified outside of SB2), and clear the mark if it does.
+ *    Entries without that information are not loaded.
+ *
+ * File format: vperm_snapshot_hdr_t, followed by vsh_num_records
+ * inodesimu_t structures (active ones only, in no particular order).
+ * All of them are added to the tree with one call to
+ * ruletree_add_inodestats(), which builds a balanced tree.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sb2_server.h"
+
+#define VPERM_SNAPSHOT_MAGIC	"SB2VPERM"
+#define VPERM_SNAPSHOT_VERSION	2
+
+typedef struct {
+	char		vsh_magic[8];
+	uint32_t	vsh_version;
+	uint32_t	vsh_record_size;	/* sizeof(inodesimu_t) */
+	uint64_t	vsh_target_root_dev;
+	uint64_t	vsh_target_root_ino;
+	uint64_t	vsh_num_records;
+} vperm_snapshot_hdr_t;
+
+static void get_target_root_identity(const char *target_root,
+	uint64_t *devp, uint64_t *inop)
+{
+	struct stat	sb;
+
+	*devp = 0;
+	*inop = 0;
+	if (target_root && (stat(target_root, &sb) == 0)) {
+		*devp = sb.st_dev;
+		*inop = sb.st_ino;
+	}
+}
+
+/* Load a snapshot to the rule tree. Must be called before the server
+ * has been started. Returns number of loaded entries or -1. */
+int vperm_snapshot_load(const char *path, const char *target_root)
+{
+	FILE			*f;
+	vperm_snapshot_hdr_t	hdr;
+	uint64_t		root_dev, root_ino;
+	inodesimu_t		*istats;
+	size_t			num_read;
+	uint32_t		num_active;
+	uint32_t		num_loaded;
+	uint32_t		i;
+
+	f = fopen(path, "r");
+	if (!f) {
+		/* not an error, the very first session doesn't have it */
+		SB_LOG(SB_LOGLEVEL_DEBUG, "vperm snapshot %s: not found", path);
+		return(-1);
+	}
+	if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+	    memcmp(hdr.vsh_magic, VPERM_SNAPSHOT_MAGIC, sizeof(hdr.vsh_magic)) ||
+	    (hdr.vsh_version != VPERM_SNAPSHOT_VERSION) ||
+	    (hdr.vsh_record_size != sizeof(inodesimu_t))) {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"vperm snapshot %s: invalid or incompatible file, ignored",
+			path);
+		fclose(f);
+		return(-1);
+	}
+	get_target_root_identity(target_root, &root_dev, &root_ino);
+	if ((hdr.vsh_target_root_dev != root_dev) ||
+	    (hdr.vsh_target_root_ino != root_ino)) {
+		SB_LOG(SB_LOGLEVEL_NOTICE,
+			"vperm snapshot %s: target root has changed, ignored",
+			path);
+		fclose(f);
+		return(-1);
+	}
+
+	if (hdr.vsh_num_records > UINT32_MAX / sizeof(inodesimu_t)) {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"vperm snapshot %s: invalid file, ignored", path);
+		fclose(f);
+		return(-1);
+	}
+	istats = malloc(hdr.vsh_num_records * sizeof(inodesimu_t) + 1);
+	if (!istats) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "vperm snapshot: Out of memory");
+		fclose(f);
+		return(-1);
+	}
+	num_read = fread(istats, sizeof(inodesimu_t), hdr.vsh_num_records, f);
+	if (num_read != hdr.vsh_num_records)
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"vperm snapshot %s: truncated file", path);
+	fclose(f);
+
+	/* drop inactive entries and entries that can't be verified */
+	for (i = 0, num_active = 0; i < num_read; i++) {
+		if ((istats[i].inodesimu_active_fields != 0) &&
+		    (istats[i].inodesimu_flags & RULETREE_INODESTAT_FLAG_REAL_ID)) {
+			istats[i].inodesimu_flags |= RULETREE_INODESTAT_FLAG_RESTORED;
+			istats[num_active++] = istats[i];
+		}
+	}
+	num_loaded = ruletree_add_inodestats(istats, num_active);
+	for (i = 0; i < num_loaded; i++)
+		inc_vperm_num_active_inodestats();
+	free(istats);
+
+	SB_LOG(SB_LOGLEVEL_INFO, "vperm snapshot %s: loaded %u entries",
+		path, num_loaded);
+	return((int)num_loaded);
+}
+
+struct snapshot_writer_s {
+	FILE		*sw_file;
+	uint64_t	sw_num_records;
+};
+
+static int write_snapshot_record(const inodesimu_t *istat, void *arg)
+{
+	struct snapshot_writer_s	*sw = arg;
+
+	if (istat->inodesimu_active_fields == 0) return(0);
+	if (fwrite(istat, sizeof(*istat), 1, sw->sw_file) != 1) return(1);
+	sw->sw_num_records++;
+	return(0);
+}
+
+/* Save the inodestats to a snapshot file. The file is replaced
+ * atomically, and only if everything could be written.
+ * Must be called after the server threads have been stopped
+ * (stop_cmdq_server(), stop_ruletree_writer()), otherwise the last
+ * updates may be missing. */
+int vperm_snapshot_save(const char *path, const char *target_root)
+{
+	char			*tmp_path = NULL;
+	FILE			*f;
+	vperm_snapshot_hdr_t	hdr;
+	struct snapshot_writer_s	sw;
+
+	if (asprintf(&tmp_path, "%s.%u", path, (unsigned)getpid()) < 0)
+		return(-1);
+	f = fopen(tmp_path, "w");
+	if (!f) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"vperm snapshot: Failed to create %s", tmp_path);
+		free(tmp_path);
+		return(-1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.vsh_magic, VPERM_SNAPSHOT_MAGIC, sizeof(hdr.vsh_magic));
+	hdr.vsh_version = VPERM_SNAPSHOT_VERSION;
+	hdr.vsh_record_size = sizeof(inodesimu_t);
+	get_target_root_identity(target_root,
+		&hdr.vsh_target_root_dev, &hdr.vsh_target_root_ino);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	sw.sw_file = f;
+	sw.sw_num_records = 0;
+	ruletree_for_each_inodestat(write_snapshot_record, &sw);
+
+	hdr.vsh_num_records = sw.sw_num_records;
+	if (fseek(f, 0, SEEK_SET) == 0)
+		fwrite(&hdr, sizeof(hdr), 1, f);
+	if (ferror(f) | fclose(f)) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"vperm snapshot: Failed to write %s", tmp_path);
+		unlink(tmp_path);
+		free(tmp_path);
+		return(-1);
+	}
+	if (rename(tmp_path, path) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"vperm snapshot: Failed to rename %s to %s (%s)",
+			tmp_path, path, strerror(errno));
+		unlink(tmp_path);
+		free(tmp_path);
+		return(-1);
+	}
+	free(tmp_path);
+	SB_LOG(SB_LOGLEVEL_INFO, "vperm snapshot %s: saved %llu entries",
+		path, (unsigned long long)sw.sw_num_records);
+	return(0);
+}
@@ -0,0 +1,207 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ */
+
+/* Exec timeline tracing.
+ *
+ * If SBOX_SESSION_EXEC_TRACE_DIR is set ("sb2 -X dir"), every process
+ * appends events to "dir/<pid>.trace":
+ *  - "start": libsb2 has been initialized (after exec, or in the
+ *    first process of the session),
+ *  - "exec" and "posix_spawn": see do_exec() and do_posix_spawn(),
+ *  - "fork": in the child,
+ *  - "exit": at exit() or _exit(),
+ *  - PROCESSCLOCK regions (prepare_exec, map_path_for_exec,
+ *    execve_preprocess...) while an exec is being prepared.
+ * Every event is one line, formatted as a Chrome trace event object
+ * with a CLOCK_MONOTONIC timestamp; "sb2-exectrace" merges the files
+ * to a timeline that can be loaded to chrome://tracing or Perfetto.
+ *
+ * Like the logger, this opens the file for every event instead of
+ * keeping an extra fd open in the traced program. Events are written
+ * with a single write() to a file opened with O_APPEND, so processes
+ * that share a pid (exec) don't mix their lines.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/vfs.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+
+#include <sb2.h>
+#include <sb2_exectrace.h>
+#include <config.h>
+
+#include "exported.h"
+
+#define EXEC_TRACE_MAX_STR	1024
+
+/* per thread: an exec in one thread must not make the regions of
+ * other threads visible in the trace */
+__thread int exec_trace_region_depth__ = 0;
+
+static const char *exec_trace_dir = NULL;	/* NULL = not active */
+
+/* pid of the process that has recorded its "exit" event. A pid instead
+ * of a flag, because a vfork()ed child shares our variables. */
+static pid_t exec_trace_exit_recorded_pid = 0;
+
+int exec_trace_is_active(void)
+{
+	return(exec_trace_dir != NULL);
+}
+
+/* copy a string to a JSON string (without quotes) */
+static size_t json_escape(char *dst, size_t dstsize, const char *src)
+{
+	size_t	n = 0;
+	size_t	srclen = 0;
+
+	for (; *src && (n + 7 < dstsize) &&
+	       (srclen < EXEC_TRACE_MAX_STR); src++, srclen++) {
+		unsigned char c = *src;
+
+		if ((c == '"') || (c == '\\')) {
+			dst[n++] = '\\';
+			dst[n++] = c;
+		} else if (c < 0x20) {
+			n += snprintf(dst + n, dstsize - n, "\\u%04x", c);
+		} else {
+			dst[n++] = c;
+		}
+	}
+	dst[n] = '\0';
+	return(n);
+}
+
+/* N.B. no malloc() here: this may be called in a vfork()ed child */
+static void write_trace_line(const char *line, int len)
+{
+	char	path[PATH_MAX];
+	int	fd;
+
+	if (snprintf(path, sizeof(path), "%s/%d.trace",
+	    exec_trace_dir, (int)getpid()) >= (int)sizeof(path)) return;
+	fd = open_nomap_nolog(path, O_WRONLY | O_APPEND | O_CREAT,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd >= 0) {
+		int r; /* needed to get around some unnecessary warnings from gcc*/
+		r = write(fd, line, len);
+		(void)r;
+		close_nomap_nolog(fd);
+	}
+}
+
+void exec_trace_event(const char *name,
+	const struct timespec *start_time,
+	const char *str_key, const char *str_val,
+	const char *int_key, long long int_val)
+{
+	struct timespec		now;
+	unsigned long long	ts_ns;
+	char			line[3 * EXEC_TRACE_MAX_STR];
+	char			esc[2 * EXEC_TRACE_MAX_STR];
+	int			len;
+	int			saved_errno = errno;
+
+	if (!exec_trace_dir) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (start_time) {
+		unsigned long long dur_ns;
+
+		ts_ns = (unsigned long long)start_time->tv_sec * 1000000000ULL +
+			start_time->tv_nsec;
+		dur_ns = (unsigned long long)now.tv_sec * 1000000000ULL +
+			now.tv_nsec - ts_ns;
+		len = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"cat\":\"sb2\",\"ph\":\"X\","
+			"\"ts\":%llu.%03u,\"dur\":%llu.%03u,",
+			name, ts_ns / 1000, (unsigned)(ts_ns % 1000),
+			dur_ns / 1000, (unsigned)(dur_ns % 1000));
+	} else {
+		ts_ns = (unsigned long long)now.tv_sec * 1000000000ULL +
+			now.tv_nsec;
+		len = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"cat\":\"sb2\",\"ph\":\"i\",\"s\":\"t\","
+			"\"ts\":%llu.%03u,",
+			name, ts_ns / 1000, (unsigned)(ts_ns % 1000));
+	}
+	len += snprintf(line + len, sizeof(line) - len,
+		"\"pid\":%d,\"tid\":%d,\"args\":{\"ppid\":%d",
+		(int)getpid(), (int)syscall(SYS_gettid), (int)getppid());
+	if (str_key) {
+		json_escape(esc, sizeof(esc), str_val ? str_val : "");
+		len += snprintf(line + len, sizeof(line) - len,
+			",\"%s\":\"%s\"", str_key, esc);
+	}
+	if (int_key) {
+		len += snprintf(line + len, sizeof(line) - len,
+			",\"%s\":%lld", int_key, int_val);
+	}
+	len += snprintf(line + len, sizeof(line) - len, "}}\n");
+	if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+
+	write_trace_line(line, len);
+	errno = saved_errno;
+}
+
+void exec_trace_region(const char *name,
+	const struct timespec *start_time, const char *param)
+{
+	exec_trace_event(name, start_time, "param", param, NULL, 0);
+}
+
+void exec_trace_begin_exec(void)
+{
+	if (exec_trace_dir) exec_trace_region_depth__++;
+}
+
+void exec_trace_end_exec(void)
+{
+	if (exec_trace_region_depth__ > 0) exec_trace_region_depth__--;
+}
+
+void exec_trace_exit(int status)
+{
+	if (!exec_trace_dir) return;
+	exec_trace_event("exit", NULL, NULL, NULL, "status", status);
+	exec_trace_exit_recorded_pid = getpid();
+}
+
+static void exec_trace_atexit(void)
+{
+	/* returned from main(); status is not known here */
+	if (exec_trace_exit_recorded_pid == getpid()) return;
+	exec_trace_event("exit", NULL, NULL, NULL, NULL, 0);
+}
+
+static void exec_trace_fork_child(void)
+{
+	exec_trace_region_depth__ = 0;
+	exec_trace_event("fork", NULL, NULL, NULL, NULL, 0);
+}
+
+void exec_trace_init(const char *trace_dir)
+{
+	if (!trace_dir || (*trace_dir != '/') || exec_trace_dir) return;
+
+	exec_trace_dir = trace_dir;
+	atexit(exec_trace_atexit);
+	pthread_atfork(NULL, NULL, exec_trace_fork_child);
+
+	exec_trace_event("start", NULL, "binary",
+		(sbox_orig_binary_name ? sbox_orig_binary_name :
+		 sbox_binary_name), NULL, 0);
+}
@@ -0,0 +1,35 @@
+# Exec policy sets LD_LIBRARY_PATH and LD_PRELOAD for native programs
+set -e
+
+# "sb2-show -v exec" shows the environment of the new program
+# ("unmodified", "added" or "new" values). The variables come from the
+# environment template of the exec policy (the policy's own value,
+# or the host's value), or from the user's value + prefix/suffix.
+sb2-show -v exec /bin/true | grep -v "modified, old:\|removed:" > exec.txt
+
+for var in LD_LIBRARY_PATH LD_PRELOAD; do
+	n=`grep -c ": $var=" exec.txt` || true
+	if [ "$n" != 1 ]; then
+		echo "$var set $n times:"
+		cat exec.txt
+		exit 1
+	fi
+done
+
+# Policies that define native_app_ld_library_path or
+# native_app_ld_preload must get exactly that value to their
+# environment template, not the host's value.
+sb2-ruletree > ruletree.txt
+sed -n \
+	-e "s/.*'native_app_ld_library_path'[[:space:]]*STRING[[:space:]]*'\(.*\)'.*/LD_LIBRARY_PATH=\1/p" \
+	-e "s/.*'native_app_ld_preload'[[:space:]]*STRING[[:space:]]*'\(.*\)'.*/LD_PRELOAD=\1/p" \
+	ruletree.txt | sort -u > policy-overrides
+sed -n "s/.*STRING[[:space:]]*'\(LD_[A-Z_]*=.*\)'.*/\1/p" \
+	ruletree.txt | sort -u > env-templates
+
+while read v; do
+	if ! grep -qxF "$v" env-templates; then
+		echo "Not in any environment template: $v"
+		exit 1
+	fi
+done < policy-overrides
@@ -55,6 +55,7 @@ int open_nomap_nolog(const char *pathname, int flags, mode_t mode)
 }
 
 char *sbox_session_dir = NULL; /* Fake var, referenced by the library=>must have something*/ 
+char *sbox_inherited_ruletree_fd = NULL; /* another one */
 
 /* -------------------- */
 
@@ -675,6 +676,14 @@ static void print_ruletree_object_type(ruletree_object_offset_t obj_offs)
 			else
 				printf("BOOLEAN <none; got NULL pointer>");
 			break;
+		case SB2_RULETREE_OBJECT_TYPE_BLOOMFILTER:
+			printf("BLOOMFILTER %u bits",
+				((ruletree_bloomfilter_t*)hdr)->rtree_bf_num_bits);
+			break;
+		case SB2_RULETREE_OBJECT_TYPE_BINARY_INFO_CACHE:
+			printf("BINARY_INFO_CACHE %u entries",
+				((ruletree_binary_info_cache_t*)hdr)->rtree_bic_num_entries);
+			break;
 		default:
 			printf("<unknown type %d>",
 				hdr->rtree_obj_type);
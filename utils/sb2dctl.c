@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -32,6 +33,7 @@
 #include "sb2.h"
 #include "rule_tree.h"
 #include "rule_tree_rpc.h"
+#include "sb2_vperm.h"
 #include "mapping.h"
 #include "libsb2.h"
 
@@ -46,6 +48,17 @@ LIBSB2_CALLER(char *, sb2__ruletree_rpc__init2__,
 	(void), (),
 	NULL)
 
+/* create call_sb2__ruletree_rpc__stats__() */
+LIBSB2_CALLER(char *, sb2__ruletree_rpc__stats__,
+	(void), (),
+	NULL)
+
+/* create call_sb2__ruletree_rpc__vperm_import__() */
+LIBSB2_CALLER(char *, sb2__ruletree_rpc__vperm_import__,
+	(const char *manifest_path, const char *root_dir),
+	(manifest_path, root_dir),
+	NULL)
+
 /* create call_sb2__ruletree_rpc__ping__() */
 LIBSB2_VOID_CALLER(sb2__ruletree_rpc__ping__,
 	(void), ())
@@ -112,7 +125,15 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Usage:\n\t%s command\n", argv[0]);
 		fprintf(stderr, "commands\n"
 				"   ping     Send a 'ping' to sb2d\n"
-				"   init2    Send a 'init2' to sb2d, wait and print the reply\n");
+				"   init2    Send a 'init2' to sb2d, wait and print the reply\n"
+				"   stats    Print sb2d's runtime statistics\n"
+				"   vperm-import MANIFEST [ROOT_DIR]\n"
+				"            Import simulated owners, groups and modes\n"
+				"            from MANIFEST (lines of 'path uid gid mode',\n"
+				"            paths relative to ROOT_DIR, default '/').\n"
+				"            Both are mapped by libsb2, so '/' is the\n"
+				"            target root; with -n, ROOT_DIR is a real\n"
+				"            path and must be given explicitly\n");
 		exit(1);
 	}
 
@@ -135,6 +156,67 @@ int main(int argc, char *argv[])
 		} else {
 			exit(1);
 		}
+	} else if (!strcmp(cmd, "stats")) {
+		char *msg;
+		if (libsb2_handle) {
+			msg = call_sb2__ruletree_rpc__stats__();
+		} else {
+			msg = ruletree_rpc__stats();
+		}
+		if (msg) {
+			fputs(msg, stdout);
+			free(msg);
+		} else {
+			fprintf(stderr, "Failed to get statistics from sb2d\n");
+			exit(1);
+		}
+	} else if (!strcmp(cmd, "vperm-import")) {
+		const char	*manifest = argv[optind+1];
+		const char	*root_dir = "/";
+		char		*manifest_path = NULL;
+		char		cwd[PATH_MAX];
+		char		*msg;
+
+		if (!manifest) {
+			fprintf(stderr, "Usage:\n\t%s vperm-import MANIFEST [ROOT_DIR]\n",
+				argv[0]);
+			exit(1);
+		}
+		if (argv[optind+2]) {
+			root_dir = argv[optind+2];
+		} else if (!libsb2_handle) {
+			/* "/" would be the host's root directory */
+			fprintf(stderr, "%s: ROOT_DIR is required when "
+				"libsb2 is not used\n", argv[0]);
+			exit(1);
+		}
+		if (*root_dir != '/') {
+			fprintf(stderr, "%s: ROOT_DIR must be an absolute "
+				"path\n", argv[0]);
+			exit(1);
+		}
+		/* sb2d needs an absolute path */
+		if (*manifest == '/') {
+			manifest_path = strdup(manifest);
+		} else if (!getcwd(cwd, sizeof(cwd)) ||
+		    (asprintf(&manifest_path, "%s/%s", cwd, manifest) < 0)) {
+			fprintf(stderr, "Failed to get current directory\n");
+			exit(1);
+		}
+		if (libsb2_handle) {
+			msg = call_sb2__ruletree_rpc__vperm_import__(
+				manifest_path, root_dir);
+		} else {
+			msg = ruletree_rpc__vperm_import(manifest_path, root_dir);
+		}
+		free(manifest_path);
+		if (msg) {
+			printf("%s\n", msg);
+			free(msg);
+		} else {
+			fprintf(stderr, "vperm-import failed\n");
+			exit(1);
+		}
 	} else {
 		fprintf(stderr, "Unknown command %s\n", cmd);
 		exit(1);
@@ -176,3 +258,17 @@ int chmod_nomap_nolog(const char *path, mode_t mode)
 	return(chmod(path, mode));
 }
 
+
+/* sb2dctl doesn't read inodestats from the rule tree,
+ * queued vperm updates don't need to be flushed before that. */
+void set_vperm_pending_updates_fns(void (*flush_fn)(void),
+	uint32_t (*num_pending_fn)(void))
+{
+	(void)flush_fn;
+	(void)num_pending_fn;
+}
+
+int vperm_write_behind_updates(void)
+{
+	return(0);
+}